@@ -8,6 +8,8 @@
 #include <cassert>
 #include <cstdio>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <unordered_map>
 
 #define SPV_ENABLE_UTILITY_CODE
@@ -20,43 +22,73 @@ namespace respv {
     static bool SpvIsSupported(SpvOp opCode) {
         switch (opCode) {
         case SpvOpUndef:
+        case SpvOpSourceContinued:
         case SpvOpSource:
+        case SpvOpSourceExtension:
         case SpvOpName:
         case SpvOpMemberName:
+        case SpvOpString:
+        case SpvOpLine:
+        case SpvOpNoLine:
+        case SpvOpModuleProcessed:
         case SpvOpExtension:
         case SpvOpExtInstImport:
         case SpvOpExtInst:
         case SpvOpMemoryModel:
         case SpvOpEntryPoint:
         case SpvOpExecutionMode:
+        case SpvOpExecutionModeId:
         case SpvOpCapability:
         case SpvOpTypeVoid:
         case SpvOpTypeBool:
         case SpvOpTypeInt:
         case SpvOpTypeFloat:
         case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
         case SpvOpTypeImage:
         case SpvOpTypeSampler:
         case SpvOpTypeSampledImage:
         case SpvOpTypeArray:
         case SpvOpTypeRuntimeArray:
         case SpvOpTypeStruct:
+        case SpvOpTypeOpaque:
         case SpvOpTypePointer:
         case SpvOpTypeFunction:
+        case SpvOpTypeEvent:
+        case SpvOpTypeDeviceEvent:
+        case SpvOpTypeReserveId:
+        case SpvOpTypeQueue:
+        case SpvOpTypePipe:
+        case SpvOpTypeForwardPointer:
+        case SpvOpTypePipeStorage:
+        case SpvOpTypeNamedBarrier:
         case SpvOpConstantTrue:
         case SpvOpConstantFalse:
         case SpvOpConstant:
         case SpvOpConstantComposite:
         case SpvOpConstantNull:
+        case SpvOpSpecConstantTrue:
+        case SpvOpSpecConstantFalse:
         case SpvOpSpecConstant:
         case SpvOpFunction:
+        case SpvOpFunctionParameter:
         case SpvOpFunctionEnd:
+        case SpvOpFunctionCall:
         case SpvOpVariable:
         case SpvOpLoad:
         case SpvOpStore:
         case SpvOpAccessChain:
+        case SpvOpInBoundsAccessChain:
+        case SpvOpPtrAccessChain:
+        case SpvOpInBoundsPtrAccessChain:
         case SpvOpDecorate:
         case SpvOpMemberDecorate:
+        case SpvOpDecorationGroup:
+        case SpvOpGroupDecorate:
+        case SpvOpGroupMemberDecorate:
+        case SpvOpDecorateId:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorateString:
         case SpvOpVectorShuffle:
         case SpvOpCompositeConstruct:
         case SpvOpCompositeExtract:
@@ -71,6 +103,8 @@ namespace respv {
         case SpvOpConvertFToS:
         case SpvOpConvertSToF:
         case SpvOpConvertUToF:
+        case SpvOpConvertPtrToU:
+        case SpvOpConvertUToPtr:
         case SpvOpBitcast:
         case SpvOpSNegate:
         case SpvOpFNegate:
@@ -135,9 +169,15 @@ namespace respv {
         case SpvOpBitwiseXor:
         case SpvOpBitwiseAnd:
         case SpvOpNot:
+        case SpvOpBitFieldInsert:
+        case SpvOpBitFieldSExtract:
+        case SpvOpBitFieldUExtract:
+        case SpvOpBitReverse:
+        case SpvOpBitCount:
         case SpvOpDPdx:
         case SpvOpDPdy:
         case SpvOpPhi:
+        case SpvOpLoopMerge:
         case SpvOpSelectionMerge:
         case SpvOpLabel:
         case SpvOpBranch:
@@ -145,6 +185,7 @@ namespace respv {
         case SpvOpSwitch:
         case SpvOpKill:
         case SpvOpReturn:
+        case SpvOpReturnValue:
         case SpvOpUnreachable:
             return true;
         default:
@@ -153,10 +194,34 @@ namespace respv {
     }
 
     static bool SpvIsIgnored(SpvOp opCode) {
+        // Debug information is left out of the output, as it doesn't affect what the shader does.
         switch (opCode) {
+        case SpvOpSourceContinued:
         case SpvOpSource:
+        case SpvOpSourceExtension:
         case SpvOpName:
         case SpvOpMemberName:
+        case SpvOpString:
+        case SpvOpLine:
+        case SpvOpNoLine:
+        case SpvOpModuleProcessed:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool SpvIsDecoration(SpvOp opCode) {
+        // Decorations refer to their targets and count as users that keep them alive, except when an entry point is selected.
+        // The dead store elimination still ignores them when it looks for variables and accesses that are never read.
+        switch (opCode) {
+        case SpvOpDecorate:
+        case SpvOpMemberDecorate:
+        case SpvOpGroupDecorate:
+        case SpvOpGroupMemberDecorate:
+        case SpvOpDecorateId:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorateString:
             return true;
         default:
             return false;
@@ -168,8 +233,12 @@ namespace respv {
         case SpvOpExecutionMode:
         case SpvOpDecorate:
         case SpvOpMemberDecorate:
+        case SpvOpDecorateString:
+        case SpvOpMemberDecorateString:
+        case SpvOpTypeForwardPointer:
         case SpvOpBranchConditional:
         case SpvOpSwitch:
+        case SpvOpReturnValue:
             operandWordStart = 1;
             operandWordCount = 1;
             operandWordStride = 1;
@@ -184,6 +253,7 @@ namespace respv {
             operandWordSkipString = false;
             return true;
         case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
         case SpvOpTypeImage:
         case SpvOpTypeSampledImage:
         case SpvOpTypeRuntimeArray:
@@ -208,6 +278,28 @@ namespace respv {
             operandWordSkip = UINT32_MAX;
             operandWordSkipString = false;
             return true;
+        case SpvOpGroupDecorate:
+            operandWordStart = 1;
+            operandWordCount = UINT32_MAX;
+            operandWordStride = 1;
+            operandWordSkip = UINT32_MAX;
+            operandWordSkipString = false;
+            return true;
+        case SpvOpGroupMemberDecorate:
+            operandWordStart = 2;
+            operandWordCount = UINT32_MAX;
+            operandWordStride = 2;
+            operandWordSkip = UINT32_MAX;
+            operandWordSkipString = false;
+            return true;
+        case SpvOpExecutionModeId:
+        case SpvOpDecorateId:
+            operandWordStart = 1;
+            operandWordCount = UINT32_MAX;
+            operandWordStride = 1;
+            operandWordSkip = 1;
+            operandWordSkipString = false;
+            return true;
         case SpvOpEntryPoint:
             operandWordStart = 2;
             operandWordCount = UINT32_MAX;
@@ -224,12 +316,16 @@ namespace respv {
         case SpvOpConvertFToS:
         case SpvOpConvertSToF:
         case SpvOpConvertUToF:
+        case SpvOpConvertPtrToU:
+        case SpvOpConvertUToPtr:
         case SpvOpBitcast:
         case SpvOpSNegate:
         case SpvOpFNegate:
         case SpvOpAll:
         case SpvOpLogicalNot:
         case SpvOpNot:
+        case SpvOpBitReverse:
+        case SpvOpBitCount:
         case SpvOpDPdx:
         case SpvOpDPdy:
             operandWordStart = 3;
@@ -306,14 +402,27 @@ namespace respv {
             operandWordSkipString = false;
             return true;
         case SpvOpSelect:
+        case SpvOpBitFieldSExtract:
+        case SpvOpBitFieldUExtract:
             operandWordStart = 3;
             operandWordCount = 3;
             operandWordStride = 1;
             operandWordSkip = UINT32_MAX;
             operandWordSkipString = false;
             return true;
+        case SpvOpBitFieldInsert:
+            operandWordStart = 3;
+            operandWordCount = 4;
+            operandWordStride = 1;
+            operandWordSkip = UINT32_MAX;
+            operandWordSkipString = false;
+            return true;
         case SpvOpConstantComposite:
+        case SpvOpFunctionCall:
         case SpvOpAccessChain:
+        case SpvOpInBoundsAccessChain:
+        case SpvOpPtrAccessChain:
+        case SpvOpInBoundsPtrAccessChain:
         case SpvOpCompositeConstruct:
             operandWordStart = 3;
             operandWordCount = UINT32_MAX;
@@ -364,6 +473,11 @@ namespace respv {
             labelWordCount = 1;
             labelWordStride = 1;
             return true;
+        case SpvOpLoopMerge:
+            labelWordStart = 1;
+            labelWordCount = 2;
+            labelWordStride = 1;
+            return true;
         case SpvOpBranchConditional:
             labelWordStart = 2;
             labelWordCount = 2;
@@ -398,7 +512,7 @@ namespace respv {
         if (relativeWordIndex == operandWordSkip) {
             if (operandWordSkipString) {
                 const char *operandString = reinterpret_cast<const char *>(&spirvWords[wordIndex + operandWordIndex]);
-                uint32_t stringLengthInWords = (strlen(operandString) + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+                uint32_t stringLengthInWords = (strlen(operandString) + sizeof(uint32_t)) / sizeof(uint32_t);
                 operandWordIndex += stringLengthInWords;
             }
             else {
@@ -428,12 +542,25 @@ namespace respv {
         instructions.clear();
         instructionInDegrees.clear();
         instructionOutDegrees.clear();
+        instructionDecorationDegrees.clear();
         instructionOrder.clear();
+        instructionLevels.clear();
         results.clear();
         specializations.clear();
         decorations.clear();
         phis.clear();
+        variables.clear();
+        regions.clear();
+        localLoads.clear();
+        localValues.clear();
         listNodes.clear();
+        defaultSwitchOpConstantInt = UINT32_MAX;
+        fingerprint = 0;
+        streamWords.clear();
+        streamDeferredInstructions.clear();
+        streamWordIndex = 0;
+        streamPendingByteCount = 0;
+        streaming = false;
     }
 
     uint32_t Shader::addToList(uint32_t instructionIndex, uint32_t listIndex) {
@@ -441,13 +568,7 @@ namespace respv {
         return uint32_t(listNodes.size() - 1);
     }
 
-    bool Shader::parseWords(const void *data, size_t size) {
-        assert(data != nullptr);
-        assert(size > 0);
-
-        spirvWords = reinterpret_cast<const uint32_t *>(data);
-        spirvWordCount = size / sizeof(uint32_t);
-
+    bool Shader::parseHeader() {
         const uint32_t startingWordIndex = 5;
         if (spirvWordCount < startingWordIndex) {
             fprintf(stderr, "Not enough words in SPIR-V.\n");
@@ -469,79 +590,94 @@ namespace respv {
         listNodes.reserve(idBound);
         results.resize(idBound, Result());
         results.shrink_to_fit();
+        return true;
+    }
+
+    bool Shader::parseInstruction(uint32_t wordIndex) {
+        SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+        bool hasResult, hasType;
+        SpvHasResultAndType(opCode, &hasResult, &hasType);
+
+        if (hasResult) {
+            uint32_t resultId = spirvWords[wordIndex + (hasType ? 2 : 1)];
+            if (resultId >= results.size()) {
+                fprintf(stderr, "SPIR-V Parsing error. Invalid Result ID: %u.\n", resultId);
+                return false;
+            }
+
+            results[resultId].instructionIndex = uint32_t(instructions.size());
+        }
+
+        if (SpvIsDecoration(opCode)) {
+            decorations.emplace_back(uint32_t(instructions.size()));
+        }
+        else if (opCode == SpvOpPhi) {
+            phis.emplace_back(uint32_t(instructions.size()));
+        }
+        else if (opCode == SpvOpVariable) {
+            variables.emplace_back(uint32_t(instructions.size()));
+        }
+
+        instructions.emplace_back(wordIndex);
+        return true;
+    }
+
+    bool Shader::parseWords(const void *data, size_t size) {
+        assert(data != nullptr);
+        assert(size > 0);
+
+        spirvWords = reinterpret_cast<const uint32_t *>(data);
+        spirvWordCount = size / sizeof(uint32_t);
+        if (!parseHeader()) {
+            return false;
+        }
 
         // Parse all instructions.
+        const uint32_t startingWordIndex = 5;
         uint32_t wordIndex = startingWordIndex;
         while (wordIndex < spirvWordCount) {
-            SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
             uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
-
-            bool hasResult, hasType;
-            SpvHasResultAndType(opCode, &hasResult, &hasType);
-
-            if (hasResult) {
-                uint32_t resultId = spirvWords[wordIndex + (hasType ? 2 : 1)];
-                if (resultId >= idBound) {
-                    fprintf(stderr, "SPIR-V Parsing error. Invalid Result ID: %u.\n", resultId);
-                    return false;
-                }
-
-                results[resultId].instructionIndex = uint32_t(instructions.size());
+            if (wordCount == 0) {
+                fprintf(stderr, "SPIR-V Parsing error. Instruction at word %u has a word count of zero.\n", wordIndex);
+                return false;
             }
 
-            if ((opCode == SpvOpDecorate) || (opCode == SpvOpMemberDecorate)) {
-                decorations.emplace_back(uint32_t(instructions.size()));
-            }
-            else if (opCode == SpvOpPhi) {
-                phis.emplace_back(uint32_t(instructions.size()));
+            if (!parseInstruction(wordIndex)) {
+                return false;
             }
 
-            instructions.emplace_back(wordIndex);
             wordIndex += wordCount;
         }
 
+        computeFingerprint();
         return true;
     }
 
-    bool Shader::process() {
-        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
-            uint32_t wordIndex = instructions[i].wordIndex;
+    void Shader::computeFingerprint() {
+        // The debug information is skipped and the IDs are numbered in the order they're first seen in, as debug instructions
+        // with results like OpString shift the IDs of everything that comes after them. The generator and the ID bound
+        // in the header are left out for the same reason.
+        thread_local std::vector<uint32_t> canonicalIds;
+        thread_local std::vector<uint32_t> instructionWords;
+        thread_local std::vector<uint8_t> skippedInstructions;
+        thread_local std::vector<uint8_t> resultUses;
+        canonicalIds.clear();
+        canonicalIds.resize(results.size(), UINT32_MAX);
+
+        // Calls the visitor with the index of every word of the instruction that refers to an ID.
+        auto visitIdWords = [&](uint32_t wordIndex, const auto &visitor) {
             SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
             uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
-            if (!SpvIsSupported(opCode)) {
-                fprintf(stderr, "%s is not supported yet.\n", SpvOpToString(opCode));
-                return false;
-            }
-
             bool hasResult, hasType;
             SpvHasResultAndType(opCode, &hasResult, &hasType);
+            if (hasType && (wordCount > 1)) {
+                visitor(1);
+            }
 
-            if (hasType) {
-                uint32_t typeId = spirvWords[wordIndex + 1];
-                if (typeId >= results.size()) {
-                    fprintf(stderr, "SPIR-V Parsing error. Invalid Type ID: %u.\n", typeId);
-                    return false;
-                }
-
-                if (results[typeId].instructionIndex == UINT32_MAX) {
-                    fprintf(stderr, "SPIR-V Parsing error. Result %u is not valid.\n", typeId);
-                    return false;
-                }
-
-                uint32_t typeInstructionIndex = results[typeId].instructionIndex;
-                instructions[typeInstructionIndex].adjacentListIndex = addToList(i, instructions[typeInstructionIndex].adjacentListIndex);
-
-                // Check if it's an OpConstant of Int type so it can be reused on switches.
-                if ((opCode == SpvOpConstant) && (defaultSwitchOpConstantInt == UINT32_MAX)) {
-                    uint32_t typeWordIndex = instructions[typeInstructionIndex].wordIndex;
-                    SpvOp typeOpCode = SpvOp(spirvWords[typeWordIndex] & 0xFFFFU);
-                    if (typeOpCode == SpvOpTypeInt) {
-                        defaultSwitchOpConstantInt = spirvWords[wordIndex + 2];
-                    }
-                }
+            if (hasResult && (wordCount > (hasType ? 2U : 1U))) {
+                visitor(hasType ? 2 : 1);
             }
-            
-            // Every operand should be adjacent to this instruction.
+
             uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
             bool operandWordSkipString;
             if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
@@ -555,208 +691,328 @@ namespace respv {
                         break;
                     }
 
-                    uint32_t operandId = spirvWords[wordIndex + operandWordIndex];
-                    if (operandId >= results.size()) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", operandId);
-                        return false;
-                    }
-
-                    if (results[operandId].instructionIndex == UINT32_MAX) {
-                        fprintf(stderr, "SPIR-V Parsing error. Result %u is not valid.\n", operandId);
-                        return false;
-                    }
-
-                    uint32_t resultIndex = results[operandId].instructionIndex;
-                    instructions[resultIndex].adjacentListIndex = addToList(i, instructions[resultIndex].adjacentListIndex);
+                    visitor(operandWordIndex);
                     operandWordIndex += operandWordStride;
                 }
             }
 
-            // This instruction should be adjacent to every label referenced. OpPhi is excluded from this.
             uint32_t labelWordStart, labelWordCount, labelWordStride;
             if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
                 for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
-                    uint32_t labelId = spirvWords[wordIndex + labelWordStart + j * labelWordStride];
-                    if (labelId >= results.size()) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", labelId);
-                        return false;
-                    }
-
-                    if (results[labelId].instructionIndex == UINT32_MAX) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", labelId);
-                        return false;
-                    }
-
-                    uint32_t labelIndex = results[labelId].instructionIndex;
-                    instructions[i].adjacentListIndex = addToList(labelIndex, instructions[i].adjacentListIndex);
+                    visitor(labelWordStart + j * labelWordStride);
                 }
             }
 
-            // Parse parented blocks of OpPhi to indicate the dependency.
             if (opCode == SpvOpPhi) {
-                for (uint32_t j = 3; j < wordCount; j += 2) {
-                    uint32_t labelId = spirvWords[wordIndex + j + 1];
-                    if (labelId >= results.size()) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Parent ID: %u.\n", labelId);
-                        return false;
-                    }
-
-                    if (results[labelId].instructionIndex == UINT32_MAX) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Parent ID: %u.\n", labelId);
-                        return false;
-                    }
-
-                    uint32_t labelIndex = results[labelId].instructionIndex;
-                    instructions[labelIndex].adjacentListIndex = addToList(i, instructions[labelIndex].adjacentListIndex);
+                for (uint32_t j = 3; (j + 1) < wordCount; j += 2) {
+                    visitor(j + 1);
                 }
             }
-            // Parse decorations.
-            else if (opCode == SpvOpDecorate) {
-                uint32_t decoration = spirvWords[wordIndex + 2];
-                if (decoration == SpvDecorationSpecId) {
-                    uint32_t resultId = spirvWords[wordIndex + 1];
-                    uint32_t constantId = spirvWords[wordIndex + 3];
-                    if (resultId >= results.size()) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", resultId);
-                        return false;
-                    }
+        };
 
-                    uint32_t resultInstructionIndex = results[resultId].instructionIndex;
-                    if (resultInstructionIndex == UINT32_MAX) {
-                        fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", resultId);
-                        return false;
+        // Non-semantic instruction sets like NonSemantic.Shader.DebugInfo.100 are debug information as well. Their imports,
+        // the instructions that use them and the extension that enables them are skipped. The constants that only the
+        // skipped instructions use, like line numbers, are skipped along with them. The instructions are visited backwards
+        // so every use of a constant has been seen before the constant itself, but decorations come before their targets
+        // and have to be counted first. Decorations, imports and extensions are only found in the global section, and the
+        // backwards pass is skipped entirely when there's no non-semantic set.
+        const uint8_t UsedByModule = 0x1;
+        const uint8_t UsedByNonSemantic = 0x2;
+        const uint8_t NonSemanticSet = 0x4;
+        uint32_t instructionCount = uint32_t(instructions.size());
+        skippedInstructions.clear();
+        skippedInstructions.resize(instructionCount, 0);
+        resultUses.clear();
+        resultUses.resize(results.size(), 0);
+        bool nonSemanticSets = false;
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+            if (opCode == SpvOpFunction) {
+                break;
+            }
+            else if (SpvIsDecoration(opCode)) {
+                visitIdWords(wordIndex, [&](uint32_t wordOffset) {
+                    uint32_t id = spirvWords[wordIndex + wordOffset];
+                    if (id < resultUses.size()) {
+                        resultUses[id] |= UsedByModule;
                     }
-
-                    specializations.resize(std::max(specializations.size(), size_t(constantId + 1)));
-                    specializations[constantId].constantInstructionIndex = resultInstructionIndex;
-                    specializations[constantId].decorationInstructionIndex = i;
+                });
+            }
+            else if ((opCode == SpvOpExtInstImport) && (wordCount > 2) && (spirvWords[wordIndex + 1] < resultUses.size())) {
+                const char *setName = reinterpret_cast<const char *>(&spirvWords[wordIndex + 2]);
+                size_t setNameSize = std::min(size_t(wordCount - 2) * sizeof(uint32_t), strlen("NonSemantic."));
+                if (strncmp(setName, "NonSemantic.", setNameSize) == 0) {
+                    resultUses[spirvWords[wordIndex + 1]] |= NonSemanticSet;
+                    skippedInstructions[i] = 1;
+                    nonSemanticSets = true;
+                }
+            }
+            else if ((opCode == SpvOpExtension) && (wordCount > 1)) {
+                const char *extensionName = reinterpret_cast<const char *>(&spirvWords[wordIndex + 1]);
+                if (strncmp(extensionName, "SPV_KHR_non_semantic_info", (wordCount - 1) * sizeof(uint32_t)) == 0) {
+                    skippedInstructions[i] = 1;
                 }
             }
         }
 
-        if (defaultSwitchOpConstantInt == UINT32_MAX) {
-            fprintf(stderr, "Unable to find an OpConstantInt to use as replacement for switches. Adding this instruction automatically is not supported yet.\n");
-            return false;
-        }
-
-        return true;
-    }
+        for (uint32_t i = nonSemanticSets ? instructionCount : 0; i > 0; i--) {
+            uint32_t wordIndex = instructions[i - 1].wordIndex;
+            SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+            bool skipped = skippedInstructions[i - 1];
+            switch (opCode) {
+            case SpvOpExtInst:
+                skipped = (wordCount > 3) && (spirvWords[wordIndex + 3] < resultUses.size()) && (resultUses[spirvWords[wordIndex + 3]] & NonSemanticSet);
+                break;
+            case SpvOpConstant:
+            case SpvOpConstantTrue:
+            case SpvOpConstantFalse:
+            case SpvOpConstantComposite:
+            case SpvOpConstantNull:
+                skipped = (wordCount > 2) && (spirvWords[wordIndex + 2] < resultUses.size()) && ((resultUses[spirvWords[wordIndex + 2]] & (UsedByModule | UsedByNonSemantic)) == UsedByNonSemantic);
+                break;
+            default:
+                break;
+            }
 
-    struct InstructionSort {
-        uint32_t instructionIndex = 0;
-        uint32_t instructionLevel = 0;
+            skippedInstructions[i - 1] = skipped;
+            if (SpvIsIgnored(opCode) || SpvIsDecoration(opCode)) {
+                continue;
+            }
 
-        InstructionSort() {
-            // Empty.
+            // The result isn't a use of itself.
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            uint32_t resultWordOffset = hasResult ? (hasType ? 2 : 1) : UINT32_MAX;
+            uint8_t useFlag = skipped ? UsedByNonSemantic : UsedByModule;
+            visitIdWords(wordIndex, [&](uint32_t wordOffset) {
+                uint32_t id = spirvWords[wordIndex + wordOffset];
+                if ((wordOffset != resultWordOffset) && (id < resultUses.size())) {
+                    resultUses[id] |= useFlag;
+                }
+            });
         }
 
-        InstructionSort(uint32_t instructionIndex, uint32_t instructionLevel) {
-            this->instructionIndex = instructionIndex;
-            this->instructionLevel = instructionLevel;
-        }
+        uint32_t canonicalIdCount = 0;
+        auto canonicalizeId = [&](uint32_t &id) {
+            if (id < canonicalIds.size()) {
+                if (canonicalIds[id] == UINT32_MAX) {
+                    canonicalIds[id] = canonicalIdCount++;
+                }
 
-        bool operator<(const InstructionSort &i) const {
-            if (instructionLevel < i.instructionLevel) {
-                return true;
+                id = canonicalIds[id];
             }
-            else if (instructionLevel > i.instructionLevel) {
-                return false;
+        };
+
+        // FNV-1a.
+        uint64_t hash = 14695981039346656037ULL;
+        auto hashWord = [&](uint32_t word) {
+            hash ^= word;
+            hash *= 1099511628211ULL;
+        };
+
+        hashWord(spirvWords[0]);
+        hashWord(spirvWords[1]);
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+            if (SpvIsIgnored(opCode) || skippedInstructions[i]) {
+                continue;
             }
 
-            return instructionIndex < i.instructionIndex;
-        }
-    };
+            // The IDs defined by skipped instructions are never seen, so they don't take up a number.
+            instructionWords.assign(&spirvWords[wordIndex], &spirvWords[wordIndex + wordCount]);
+            visitIdWords(wordIndex, [&](uint32_t wordOffset) {
+                canonicalizeId(instructionWords[wordOffset]);
+            });
 
-    bool Shader::sort() {
-        // Count the in and out degrees for all instructions.
-        instructionInDegrees.clear();
-        instructionOutDegrees.clear();
-        instructionInDegrees.resize(instructions.size(), 0);
-        instructionOutDegrees.resize(instructions.size(), 0);
-        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
-            uint32_t listIndex = instructions[i].adjacentListIndex;
-            while (listIndex != UINT32_MAX) {
-                const ListNode &listNode = listNodes[listIndex];
-                instructionInDegrees[listNode.instructionIndex]++;
-                instructionOutDegrees[i]++;
-                listIndex = listNode.nextListIndex;
+            for (uint32_t word : instructionWords) {
+                hashWord(word);
             }
         }
 
-        // Make a copy of the degrees as they'll be used to perform a topological sort.
-        std::vector<uint32_t> sortDegrees;
-        sortDegrees.resize(instructionInDegrees.size());
-        memcpy(sortDegrees.data(), instructionInDegrees.data(), sizeof(uint32_t) *sortDegrees.size());
+        fingerprint = hash;
+    }
 
-        // The first nodes to be processed should be the ones with no incoming connections.
-        std::vector<uint32_t> instructionStack;
-        instructionStack.clear();
-        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
-            if (sortDegrees[i] == 0) {
-                instructionStack.emplace_back(i);
-            }
+    bool Shader::checkReferences(uint32_t instructionIndex) const {
+        uint32_t wordIndex = instructions[instructionIndex].wordIndex;
+        SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+        auto isDefined = [&](uint32_t id) {
+            return (id < results.size()) && (results[id].instructionIndex != UINT32_MAX);
+        };
+
+        bool hasResult, hasType;
+        SpvHasResultAndType(opCode, &hasResult, &hasType);
+        if (hasType && !isDefined(spirvWords[wordIndex + 1])) {
+            return false;
         }
 
-        instructionOrder.reserve(instructions.size());
-        instructionOrder.clear();
-        while (!instructionStack.empty()) {
-            uint32_t i = instructionStack.back();
-            instructionStack.pop_back();
-            instructionOrder.emplace_back(i);
+        uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+        bool operandWordSkipString;
+        if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+            uint32_t operandWordIndex = operandWordStart;
+            for (uint32_t j = 0; j < operandWordCount; j++) {
+                if (checkOperandWordSkip(wordIndex, spirvWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                    continue;
+                }
 
-            // Look for the adjacents and reduce their degree. Push it to the stack if their degree reaches zero.
-            uint32_t listIndex = instructions[i].adjacentListIndex;
-            while (listIndex != UINT32_MAX) {
-                const ListNode &listNode = listNodes[listIndex];
-                uint32_t &sortDegree = sortDegrees[listNode.instructionIndex];
-                assert(sortDegree > 0);
-                sortDegree--;
-                if (sortDegree == 0) {
-                    instructionStack.emplace_back(listNode.instructionIndex);
+                if (operandWordIndex >= wordCount) {
+                    break;
                 }
 
-                listIndex = listNode.nextListIndex;
+                if (!isDefined(spirvWords[wordIndex + operandWordIndex])) {
+                    return false;
+                }
+
+                operandWordIndex += operandWordStride;
             }
         }
 
-        std::vector<InstructionSort> instructionSortVector;
-        instructionSortVector.clear();
-        instructionSortVector.resize(instructionOrder.size(), InstructionSort());
-        for (uint32_t instructionIndex : instructionOrder) {
-            uint32_t nextLevel = instructionSortVector[instructionIndex].instructionLevel + 1;
-            uint32_t listIndex = instructions[instructionIndex].adjacentListIndex;
-            while (listIndex != UINT32_MAX) {
-                const ListNode &listNode = listNodes[listIndex];
-                uint32_t &listLevel = instructionSortVector[listNode.instructionIndex].instructionLevel;
-                listLevel = std::max(listLevel, nextLevel);
-                listIndex = listNode.nextListIndex;
+        uint32_t labelWordStart, labelWordCount, labelWordStride;
+        if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+            for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                if (!isDefined(spirvWords[wordIndex + labelWordStart + j * labelWordStride])) {
+                    return false;
+                }
             }
-
-            instructionSortVector[instructionIndex].instructionIndex = instructionIndex;
         }
 
-        std::sort(instructionSortVector.begin(), instructionSortVector.end());
-        
-        // Rebuild the instruction order vector with the sorted indices.
-        instructionOrder.clear();
-        for (InstructionSort &instructionSort : instructionSortVector) {
-            instructionOrder.emplace_back(instructionSort.instructionIndex);
+        if (opCode == SpvOpPhi) {
+            for (uint32_t j = 3; (j + 1) < wordCount; j += 2) {
+                if (!isDefined(spirvWords[wordIndex + j + 1])) {
+                    return false;
+                }
+            }
+        }
+        else if ((opCode == SpvOpDecorate) && (wordCount > 2) && (spirvWords[wordIndex + 2] == SpvDecorationSpecId)) {
+            if (!isDefined(spirvWords[wordIndex + 1])) {
+                return false;
+            }
         }
 
         return true;
     }
 
-    bool Shader::parse(const void *data, size_t size) {
-        assert(data != nullptr);
-        assert((size % sizeof(uint32_t) == 0) && "Size of data must be aligned to the word size.");
-
+    bool Shader::beginParse(size_t sizeHint) {
         clear();
+        streaming = true;
+        streamWords.reserve(sizeHint / sizeof(uint32_t));
+        return true;
+    }
 
-        if (!parseWords(data, size)) {
+    bool Shader::parseChunk(const void *data, size_t size) {
+        assert(streaming && "beginParse must be called before feeding chunks.");
+        assert((data != nullptr) || (size == 0));
+
+        // Append the chunk to the owned words. Bytes that don't complete a word are carried over to the next chunk.
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        size_t byteIndex = 0;
+        while ((streamPendingByteCount > 0) && (streamPendingByteCount < sizeof(uint32_t)) && (byteIndex < size)) {
+            streamPendingBytes[streamPendingByteCount++] = bytes[byteIndex++];
+            if (streamPendingByteCount == sizeof(uint32_t)) {
+                uint32_t word;
+                memcpy(&word, streamPendingBytes, sizeof(uint32_t));
+                streamWords.emplace_back(word);
+                streamPendingByteCount = 0;
+            }
+        }
+
+        size_t chunkWordCount = (size - byteIndex) / sizeof(uint32_t);
+        if (chunkWordCount > 0) {
+            size_t previousWordCount = streamWords.size();
+            streamWords.resize(previousWordCount + chunkWordCount);
+            memcpy(&streamWords[previousWordCount], &bytes[byteIndex], chunkWordCount * sizeof(uint32_t));
+            byteIndex += chunkWordCount * sizeof(uint32_t);
+        }
+
+        while ((streamPendingByteCount < sizeof(uint32_t)) && (byteIndex < size)) {
+            streamPendingBytes[streamPendingByteCount++] = bytes[byteIndex++];
+        }
+
+        // The words may have been reallocated.
+        spirvWords = streamWords.data();
+        spirvWordCount = streamWords.size();
+
+        const uint32_t startingWordIndex = 5;
+        if (streamWordIndex == 0) {
+            if (spirvWordCount < startingWordIndex) {
+                return true;
+            }
+
+            if (!parseHeader()) {
+                return false;
+            }
+
+            streamWordIndex = startingWordIndex;
+        }
+
+        // Parse every instruction that has been fully received. Instructions are processed right away unless
+        // they reference results that haven't arrived yet, in which case they're deferred until the end.
+        while (streamWordIndex < spirvWordCount) {
+            uint32_t wordCount = (spirvWords[streamWordIndex] >> 16U) & 0xFFFFU;
+            if (wordCount == 0) {
+                fprintf(stderr, "SPIR-V Parsing error. Instruction at word %u has a word count of zero.\n", streamWordIndex);
+                return false;
+            }
+
+            if ((streamWordIndex + wordCount) > spirvWordCount) {
+                break;
+            }
+
+            uint32_t instructionIndex = uint32_t(instructions.size());
+            if (!parseInstruction(streamWordIndex)) {
+                return false;
+            }
+
+            if (checkReferences(instructionIndex)) {
+                if (!processInstruction(instructionIndex)) {
+                    return false;
+                }
+            }
+            else {
+                streamDeferredInstructions.emplace_back(instructionIndex);
+            }
+
+            streamWordIndex += wordCount;
+        }
+
+        return true;
+    }
+
+    bool Shader::endParse() {
+        assert(streaming && "beginParse must be called before ending the parse.");
+        streaming = false;
+
+        if (streamPendingByteCount > 0) {
+            fprintf(stderr, "SPIR-V Parsing error. Stream ended with %u bytes that don't form a word.\n", streamPendingByteCount);
             return false;
         }
 
-        if (!process()) {
+        if (streamWordIndex == 0) {
+            fprintf(stderr, "Not enough words in SPIR-V.\n");
+            return false;
+        }
+
+        if (streamWordIndex != spirvWordCount) {
+            fprintf(stderr, "SPIR-V Parsing error. Stream ended in the middle of an instruction.\n");
+            return false;
+        }
+
+        for (uint32_t instructionIndex : streamDeferredInstructions) {
+            if (!processInstruction(instructionIndex)) {
+                return false;
+            }
+        }
+
+        streamDeferredInstructions.clear();
+        streamDeferredInstructions.shrink_to_fit();
+        computeFingerprint();
+
+        if (!processFinish()) {
             return false;
         }
 
@@ -767,839 +1023,6807 @@ namespace respv {
         return true;
     }
 
-    bool Shader::empty() const {
-        return false;
-    }
+    bool Shader::processInstruction(uint32_t i, uint32_t providerBegin, uint32_t providerEnd) {
+        // When a provider range is specified, only the edges that start from instructions inside the range are added.
+        // This is used to reconnect instructions to results that have been replaced during an update.
+        const bool allProviders = (providerBegin == 0) && (providerEnd == UINT32_MAX);
+        auto isProvider = [&](uint32_t index) {
+            return (index >= providerBegin) && (index < providerEnd);
+        };
 
-    // Optimizer
 
-    struct Resolution {
-        enum Type {
-            Unknown,
-            Constant,
-            Variable
-        };
+        uint32_t wordIndex = instructions[i].wordIndex;
+        SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+        if (!SpvIsSupported(opCode)) {
+            fprintf(stderr, "%s is not supported yet.\n", SpvOpToString(opCode));
+            return false;
+        }
 
-        Type type = Type::Unknown;
+        bool hasResult, hasType;
+        SpvHasResultAndType(opCode, &hasResult, &hasType);
 
-        struct {
-            union {
-                int32_t i32;
-                uint32_t u32;
-            };
-        } value = {};
+        if (hasType) {
+            uint32_t typeId = spirvWords[wordIndex + 1];
+            if (typeId >= results.size()) {
+                fprintf(stderr, "SPIR-V Parsing error. Invalid Type ID: %u.\n", typeId);
+                return false;
+            }
 
-        static Resolution fromBool(bool value) {
-            Resolution r;
-            r.type = Type::Constant;
-            r.value.u32 = value ? 1 : 0;
-            return r;
-        }
+            if (results[typeId].instructionIndex == UINT32_MAX) {
+                fprintf(stderr, "SPIR-V Parsing error. Result %u is not valid.\n", typeId);
+                return false;
+            }
 
-        static Resolution fromInt32(int32_t value) {
-            Resolution r;
-            r.type = Type::Constant;
-            r.value.i32 = value;
-            return r;
-        }
+            uint32_t typeInstructionIndex = results[typeId].instructionIndex;
+            if (isProvider(typeInstructionIndex)) {
+                instructions[typeInstructionIndex].adjacentListIndex = addToList(i, instructions[typeInstructionIndex].adjacentListIndex);
+            }
 
-        static Resolution fromUint32(uint32_t value) {
-            Resolution r;
-            r.type = Type::Constant;
-            r.value.u32 = value;
-            return r;
+            // Check if it's an OpConstant of Int type so it can be reused on switches.
+            if (allProviders && (opCode == SpvOpConstant) && (defaultSwitchOpConstantInt == UINT32_MAX)) {
+                uint32_t typeWordIndex = instructions[typeInstructionIndex].wordIndex;
+                SpvOp typeOpCode = SpvOp(spirvWords[typeWordIndex] & 0xFFFFU);
+                if (typeOpCode == SpvOpTypeInt) {
+                    defaultSwitchOpConstantInt = spirvWords[wordIndex + 2];
+                }
+            }
         }
-    };
+        
+        // Every operand should be adjacent to this instruction.
+        uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+        bool operandWordSkipString;
+        if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+            uint32_t operandWordIndex = operandWordStart;
+            for (uint32_t j = 0; j < operandWordCount; j++) {
+                if (checkOperandWordSkip(wordIndex, spirvWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                    continue;
+                }
 
-    struct OptimizerContext {
-        const Shader &shader;
-        std::vector<uint32_t> &instructionInDegrees;
-        std::vector<uint32_t> &instructionOutDegrees;
-        std::vector<Resolution> &resolutions;
-        std::vector<uint8_t> &optimizedData;
+                if (operandWordIndex >= wordCount) {
+                    break;
+                }
 
-        OptimizerContext() = delete;
-    };
+                uint32_t operandId = spirvWords[wordIndex + operandWordIndex];
+                if (operandId >= results.size()) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", operandId);
+                    return false;
+                }
 
-    static void optimizerEliminateInstruction(uint32_t instructionIndex, OptimizerContext &c) {
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
-        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-        for (uint32_t j = 0; j < wordCount; j++) {
-            optimizedWords[wordIndex + j] = UINT32_MAX;
+                if (results[operandId].instructionIndex == UINT32_MAX) {
+                    fprintf(stderr, "SPIR-V Parsing error. Result %u is not valid.\n", operandId);
+                    return false;
+                }
+
+                // Types can refer to a pointer that's declared after them with OpTypeForwardPointer, such as a struct with a
+                // physical pointer to itself. The edge is left out so the declarations can still be sorted, as the forward
+                // declaration already keeps the pointer alive.
+                uint32_t resultIndex = results[operandId].instructionIndex;
+                bool typeOpCode = (opCode == SpvOpTypeArray) || (opCode == SpvOpTypeRuntimeArray) || (opCode == SpvOpTypeStruct) || (opCode == SpvOpTypePointer) || (opCode == SpvOpTypeFunction);
+                bool forwardPointer = typeOpCode && (resultIndex > i);
+                if (isProvider(resultIndex) && !forwardPointer) {
+                    instructions[resultIndex].adjacentListIndex = addToList(i, instructions[resultIndex].adjacentListIndex);
+                }
+
+                operandWordIndex += operandWordStride;
+            }
         }
-    }
 
-    static void optimizerReduceResultDegrees(OptimizerContext &c, std::vector<uint32_t> &resultStack) {
-        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
-        while (!resultStack.empty()) {
-            uint32_t resultId = resultStack.back();
-            resultStack.pop_back();
+        // This instruction should be adjacent to every label referenced. OpPhi is excluded from this.
+        uint32_t labelWordStart, labelWordCount, labelWordStride;
+        if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+            for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                uint32_t labelId = spirvWords[wordIndex + labelWordStart + j * labelWordStride];
+                if (labelId >= results.size()) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", labelId);
+                    return false;
+                }
 
-            uint32_t instructionIndex = c.shader.results[resultId].instructionIndex;
-            uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+                if (results[labelId].instructionIndex == UINT32_MAX) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", labelId);
+                    return false;
+                }
 
-            // Instruction's been deleted.
-            if (optimizedWords[wordIndex] == UINT32_MAX) {
-                continue;
+                uint32_t labelIndex = results[labelId].instructionIndex;
+                if (isProvider(labelIndex)) {
+                    instructions[i].adjacentListIndex = addToList(labelIndex, instructions[i].adjacentListIndex);
+                }
             }
+        }
 
-            c.instructionOutDegrees[instructionIndex]--;
+        // Parse parented blocks of OpPhi to indicate the dependency.
+        if (opCode == SpvOpPhi) {
+            for (uint32_t j = 3; j < wordCount; j += 2) {
+                uint32_t labelId = spirvWords[wordIndex + j + 1];
+                if (labelId >= results.size()) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Parent ID: %u.\n", labelId);
+                    return false;
+                }
 
-            // When nothing uses the result from this instruction anymore, we can delete it. Push any operands it uses into the stack as well to reduce their out degrees.
-            if (c.instructionOutDegrees[instructionIndex] == 0) {
-                SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
-                uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-                uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
-                bool operandWordSkipString;
-                if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
-                    uint32_t operandWordIndex = operandWordStart;
-                    for (uint32_t j = 0; j < operandWordCount; j++) {
-                        if (checkOperandWordSkip(wordIndex, optimizedWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
-                            continue;
-                        }
+                if (results[labelId].instructionIndex == UINT32_MAX) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Parent ID: %u.\n", labelId);
+                    return false;
+                }
 
-                        if (operandWordIndex >= wordCount) {
-                            break;
-                        }
+                uint32_t labelIndex = results[labelId].instructionIndex;
+                if (isProvider(labelIndex)) {
+                    instructions[labelIndex].adjacentListIndex = addToList(i, instructions[labelIndex].adjacentListIndex);
+                }
+            }
+        }
+        // Parse decorations.
+        else if (allProviders && (opCode == SpvOpDecorate)) {
+            uint32_t decoration = spirvWords[wordIndex + 2];
+            if (decoration == SpvDecorationSpecId) {
+                uint32_t resultId = spirvWords[wordIndex + 1];
+                uint32_t constantId = spirvWords[wordIndex + 3];
+                if (resultId >= results.size()) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", resultId);
+                    return false;
+                }
 
-                        uint32_t operandId = optimizedWords[wordIndex + operandWordIndex];
-                        resultStack.emplace_back(operandId);
-                        operandWordIndex += operandWordStride;
-                    }
+                uint32_t resultInstructionIndex = results[resultId].instructionIndex;
+                if (resultInstructionIndex == UINT32_MAX) {
+                    fprintf(stderr, "SPIR-V Parsing error. Invalid Operand ID: %u.\n", resultId);
+                    return false;
                 }
 
-                optimizerEliminateInstruction(instructionIndex, c);
+                specializations.resize(std::max(specializations.size(), size_t(constantId + 1)));
+                specializations[constantId].constantInstructionIndex = resultInstructionIndex;
+                specializations[constantId].decorationInstructionIndex = i;
             }
         }
+
+        return true;
     }
 
-    static bool optimizerPrepareData(OptimizerContext &c) {
-        c.resolutions.clear();
-        c.resolutions.resize(c.shader.results.size(), Resolution());
-        c.instructionInDegrees.resize(c.shader.instructionInDegrees.size());
-        c.instructionOutDegrees.resize(c.shader.instructionOutDegrees.size());
-        c.optimizedData.resize(c.shader.spirvWordCount * sizeof(uint32_t));
-        memcpy(c.instructionInDegrees.data(), c.shader.instructionInDegrees.data(), sizeof(uint32_t) * c.shader.instructionInDegrees.size());
-        memcpy(c.instructionOutDegrees.data(), c.shader.instructionOutDegrees.data(), sizeof(uint32_t) * c.shader.instructionOutDegrees.size());
-        memcpy(c.optimizedData.data(), c.shader.spirvWords, c.optimizedData.size());
+    bool Shader::processFinish() {
+        if (defaultSwitchOpConstantInt == UINT32_MAX) {
+            fprintf(stderr, "Unable to find an OpConstantInt to use as replacement for switches. Adding this instruction automatically is not supported yet.\n");
+            return false;
+        }
+
+        analyzeVariables();
+        analyzeLocalLoads(0, uint32_t(instructions.size()));
         return true;
     }
 
-    static bool optimizerPatchSpecializationConstants(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, OptimizerContext &c) {
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        for (uint32_t i = 0; i < newSpecConstantCount; i++) {
-            const SpecConstant &newSpecConstant = newSpecConstants[i];
-            if (newSpecConstant.specId >= c.shader.specializations.size()) {
-                continue;
-            }
+    bool Shader::checkConstantTable(uint32_t instructionIndex) const {
+        // Only variables private to the invocation that are initialized with a constant can be considered.
+        uint32_t wordIndex = instructions[instructionIndex].wordIndex;
+        uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+        uint32_t storageClass = spirvWords[wordIndex + 3];
+        if ((wordCount < 5) || ((storageClass != SpvStorageClassPrivate) && (storageClass != SpvStorageClassFunction))) {
+            return false;
+        }
 
-            const Specialization &specialization = c.shader.specializations[newSpecConstant.specId];
-            if (specialization.constantInstructionIndex == UINT32_MAX) {
-                continue;
-            }
+        uint32_t initializerId = spirvWords[wordIndex + 4];
+        uint32_t initializerIndex = results[initializerId].instructionIndex;
+        SpvOp initializerOpCode = SpvOp(spirvWords[instructions[initializerIndex].wordIndex] & 0xFFFFU);
+        switch (initializerOpCode) {
+        case SpvOpConstantTrue:
+        case SpvOpConstantFalse:
+        case SpvOpConstant:
+        case SpvOpConstantComposite:
+            break;
+        default:
+            return false;
+        }
 
-            uint32_t constantWordIndex = c.shader.instructions[specialization.constantInstructionIndex].wordIndex;
-            SpvOp constantOpCode = SpvOp(optimizedWords[constantWordIndex] & 0xFFFFU);
-            uint32_t constantWordCount = (optimizedWords[constantWordIndex] >> 16U) & 0xFFFFU;
-            switch (constantOpCode) {
-            case SpvOpSpecConstantTrue:
-            case SpvOpSpecConstantFalse:
-                optimizedWords[constantWordIndex] = (newSpecConstant.values[0] ? SpvOpConstantTrue : SpvOpConstantFalse) | (constantWordCount << 16U);
+        // The variable can only be read through loads, either directly or through access chains that only have loads as users.
+        uint32_t resultId = spirvWords[wordIndex + 2];
+        uint32_t listIndex = instructions[instructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = listNodes[listIndex];
+            uint32_t userWordIndex = instructions[listNode.instructionIndex].wordIndex;
+            SpvOp userOpCode = SpvOp(spirvWords[userWordIndex] & 0xFFFFU);
+            switch (userOpCode) {
+            case SpvOpLoad:
+            case SpvOpDecorate:
+            case SpvOpGroupDecorate:
+            case SpvOpDecorateId:
+            case SpvOpDecorateString:
+            case SpvOpEntryPoint:
                 break;
-            case SpvOpSpecConstant:
-                if (constantWordCount <= 3) {
-                    fprintf(stderr, "Optimization error. Specialization constant has less words than expected.\n");
+            case SpvOpAccessChain: {
+                if (spirvWords[userWordIndex + 3] != resultId) {
                     return false;
                 }
 
-                if (newSpecConstant.values.size() != (constantWordCount - 3)) {
-                    fprintf(stderr, "Optimization error. Value count for specialization constant %u differs from the expected size.\n", newSpecConstant.specId);
-                    return false;
+                uint32_t chainListIndex = instructions[listNode.instructionIndex].adjacentListIndex;
+                while (chainListIndex != UINT32_MAX) {
+                    const ListNode &chainListNode = listNodes[chainListIndex];
+                    SpvOp chainUserOpCode = SpvOp(spirvWords[instructions[chainListNode.instructionIndex].wordIndex] & 0xFFFFU);
+                    if ((chainUserOpCode != SpvOpLoad) && !SpvIsDecoration(chainUserOpCode)) {
+                        return false;
+                    }
+
+                    chainListIndex = chainListNode.nextListIndex;
                 }
 
-                optimizedWords[constantWordIndex] = SpvOpConstant | (constantWordCount << 16U);
-                memcpy(&optimizedWords[constantWordIndex + 3], newSpecConstant.values.data(), sizeof(uint32_t) * (constantWordCount - 3));
                 break;
+            }
             default:
-                fprintf(stderr, "Optimization error. Can't patch opCode %u.\n", constantOpCode);
                 return false;
             }
 
-            // Eliminate the decorator instruction as well.
-            optimizerEliminateInstruction(specialization.decorationInstructionIndex, c);
+            listIndex = listNode.nextListIndex;
         }
 
         return true;
     }
 
-    static void optimizerEvaluateResult(uint32_t resultId, OptimizerContext &c) {
-        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
-        const Result &result = c.shader.results[resultId];
-        Resolution &resolution = c.resolutions[resultId];
-        uint32_t resultWordIndex = c.shader.instructions[result.instructionIndex].wordIndex;
-        SpvOp opCode = SpvOp(optimizedWords[resultWordIndex] & 0xFFFFU);
-        uint32_t wordCount = (optimizedWords[resultWordIndex] >> 16U) & 0xFFFFU;
-        switch (opCode) {
-        case SpvOpConstant: {
-            // Parse the known type of constants. Any other types will be considered as variable.
-            const Result &typeResult = c.shader.results[optimizedWords[resultWordIndex + 1]];
-            uint32_t typeWordIndex = c.shader.instructions[typeResult.instructionIndex].wordIndex;
-            SpvOp typeOpCode = SpvOp(optimizedWords[typeWordIndex] & 0xFFFFU);
-            uint32_t typeWidthInBits = optimizedWords[typeWordIndex + 2];
-            uint32_t typeSigned = optimizedWords[typeWordIndex + 3];
-            if ((typeOpCode == SpvOpTypeInt) && (typeWidthInBits == 32)) {
-                if (typeSigned) {
-                    resolution = Resolution::fromInt32(int32_t(optimizedWords[resultWordIndex + 3]));
-                }
-                else {
-                    resolution = Resolution::fromUint32(optimizedWords[resultWordIndex + 3]);
+    void Shader::analyzeVariables(uint32_t rangeBegin, uint32_t rangeEnd) {
+        // When a range of functions is specified, only the variables inside of it are analyzed along with the global ones,
+        // which come before any function and can be used from all of them. The variables of the other functions can only
+        // be used by the functions they belong to, and the decorations in the global section don't change.
+        const bool allVariables = (rangeBegin == 0) && (rangeEnd == UINT32_MAX);
+        if (!allVariables) {
+            auto variableLess = [](const Variable &variable, uint32_t instructionIndex) {
+                return variable.instructionIndex < instructionIndex;
+            };
+
+            for (Variable &variable : variables) {
+                if (spirvWords[instructions[variable.instructionIndex].wordIndex + 3] == SpvStorageClassFunction) {
+                    break;
                 }
+
+                variable.constantTable = checkConstantTable(variable.instructionIndex);
             }
-            else {
-                resolution.type = Resolution::Type::Variable;
+
+            auto variableIt = std::lower_bound(variables.begin(), variables.end(), rangeBegin, variableLess);
+            auto variableEnd = std::lower_bound(variableIt, variables.end(), rangeEnd, variableLess);
+            for (; variableIt != variableEnd; variableIt++) {
+                variableIt->constantTable = checkConstantTable(variableIt->instructionIndex);
+                variableIt->descriptorSet = UINT32_MAX;
+                variableIt->binding = UINT32_MAX;
             }
 
-            break;
+            return;
         }
-        case SpvOpConstantTrue:
-            resolution = Resolution::fromBool(true);
-            break;
-        case SpvOpConstantFalse:
-            resolution = Resolution::fromBool(false);
-            break;
-        case SpvOpBitcast: {
-            const Resolution &operandResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            resolution = Resolution::fromUint32(operandResolution.value.u32);
-            break;
+
+        for (Variable &variable : variables) {
+            variable.constantTable = checkConstantTable(variable.instructionIndex);
+            variable.descriptorSet = UINT32_MAX;
+            variable.binding = UINT32_MAX;
         }
-        case SpvOpIAdd: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.u32 + secondResolution.value.u32);
-            break;
+
+        for (const Decoration &decoration : decorations) {
+            uint32_t wordIndex = instructions[decoration.instructionIndex].wordIndex;
+            SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+            if ((opCode != SpvOpDecorate) || (wordCount < 4)) {
+                continue;
+            }
+
+            uint32_t decorationType = spirvWords[wordIndex + 2];
+            if ((decorationType != SpvDecorationDescriptorSet) && (decorationType != SpvDecorationBinding)) {
+                continue;
+            }
+
+            uint32_t variableIndex = findVariable(results[spirvWords[wordIndex + 1]].instructionIndex);
+            if (variableIndex == UINT32_MAX) {
+                continue;
+            }
+
+            if (decorationType == SpvDecorationDescriptorSet) {
+                variables[variableIndex].descriptorSet = spirvWords[wordIndex + 3];
+            }
+            else {
+                variables[variableIndex].binding = spirvWords[wordIndex + 3];
+            }
         }
-        case SpvOpISub: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.u32 - secondResolution.value.u32);
-            break;
+    }
+
+    uint32_t Shader::findVariable(uint32_t instructionIndex) const {
+        auto variableIt = std::lower_bound(variables.begin(), variables.end(), instructionIndex, [](const Variable &variable, uint32_t instructionIndex) {
+            return variable.instructionIndex < instructionIndex;
+        });
+
+        if ((variableIt == variables.end()) || (variableIt->instructionIndex != instructionIndex)) {
+            return UINT32_MAX;
         }
-        case SpvOpIMul: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
+
+        return uint32_t(variableIt - variables.begin());
+    }
+
+    void Shader::analyzeLocalLoads(uint32_t rangeBegin, uint32_t rangeEnd) {
+        // The value of a variable is tracked through the blocks of the function in the order they're laid out. The entry of a
+        // block combines the values its predecessors exit with, and a block that's entered with different values from each of
+        // its predecessors behaves like an OpPhi. Predecessors that come later in the layout aren't tracked.
+        enum class StateKind {
+            Unknown,
+            Undefined,
+            Value,
+            Merge
+        };
+
+        struct State {
+            StateKind kind = StateKind::Unknown;
+            uint32_t id = 0;
+
+            bool operator==(const State &s) const {
+                return (kind == s.kind) && (id == s.id);
+            }
+        };
+
+        thread_local std::vector<uint32_t> blockLabelIndices;
+        thread_local std::vector<uint32_t> instructionBlocks;
+        thread_local std::vector<std::pair<uint32_t, uint32_t>> blockEdges;
+        thread_local std::vector<uint32_t> predecessorStarts;
+        thread_local std::vector<uint32_t> predecessors;
+        thread_local std::vector<uint32_t> accessIndices;
+        thread_local std::vector<State> exitStates;
+        auto instructionOpCode = [&](uint32_t instructionIndex) {
+            return SpvOp(spirvWords[instructions[instructionIndex].wordIndex] & 0xFFFFU);
+        };
+
+        uint32_t functionBegin = rangeBegin;
+        while (functionBegin < rangeEnd) {
+            if (instructionOpCode(functionBegin) != SpvOpFunction) {
+                functionBegin++;
+                continue;
+            }
+
+            uint32_t functionEnd = functionBegin + 1;
+            while ((functionEnd < rangeEnd) && (instructionOpCode(functionEnd - 1) != SpvOpFunctionEnd)) {
+                functionEnd++;
+            }
+
+            // Find the block of every instruction and the edges between the blocks.
+            blockLabelIndices.clear();
+            instructionBlocks.clear();
+            instructionBlocks.resize(functionEnd - functionBegin, UINT32_MAX);
+            for (uint32_t i = functionBegin; i < functionEnd; i++) {
+                if (instructionOpCode(i) == SpvOpLabel) {
+                    blockLabelIndices.emplace_back(i);
+                }
+
+                instructionBlocks[i - functionBegin] = blockLabelIndices.empty() ? UINT32_MAX : uint32_t(blockLabelIndices.size() - 1);
+            }
+
+            blockEdges.clear();
+            for (uint32_t i = functionBegin; i < functionEnd; i++) {
+                SpvOp opCode = instructionOpCode(i);
+                if ((opCode != SpvOpBranch) && (opCode != SpvOpBranchConditional) && (opCode != SpvOpSwitch)) {
+                    continue;
+                }
+
+                uint32_t wordIndex = instructions[i].wordIndex;
+                uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+                uint32_t labelWordStart, labelWordCount, labelWordStride;
+                SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride);
+                for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                    uint32_t labelIndex = results[spirvWords[wordIndex + labelWordStart + j * labelWordStride]].instructionIndex;
+                    if ((labelIndex >= functionBegin) && (labelIndex < functionEnd)) {
+                        blockEdges.emplace_back(instructionBlocks[labelIndex - functionBegin], instructionBlocks[i - functionBegin]);
+                    }
+                }
+            }
+
+            std::sort(blockEdges.begin(), blockEdges.end());
+            blockEdges.erase(std::unique(blockEdges.begin(), blockEdges.end()), blockEdges.end());
+
+            uint32_t blockCount = uint32_t(blockLabelIndices.size());
+            predecessorStarts.clear();
+            predecessorStarts.resize(blockCount + 1, 0);
+            predecessors.clear();
+            for (const std::pair<uint32_t, uint32_t> &blockEdge : blockEdges) {
+                predecessorStarts[blockEdge.first + 1]++;
+                predecessors.emplace_back(blockEdge.second);
+            }
+
+            for (uint32_t b = 0; b < blockCount; b++) {
+                predecessorStarts[b + 1] += predecessorStarts[b];
+            }
+
+            for (uint32_t i = functionBegin; i < functionEnd; i++) {
+                uint32_t wordIndex = instructions[i].wordIndex;
+                uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+                if ((instructionOpCode(i) != SpvOpVariable) || (spirvWords[wordIndex + 3] != SpvStorageClassFunction)) {
+                    continue;
+                }
+
+                // The address of the variable must not escape, so it can only be used as the pointer of loads and stores.
+                uint32_t variableId = spirvWords[wordIndex + 2];
+                bool escapes = false;
+                bool hasLoads = false;
+                accessIndices.clear();
+                uint32_t listIndex = instructions[i].adjacentListIndex;
+                while ((listIndex != UINT32_MAX) && !escapes) {
+                    const ListNode &listNode = listNodes[listIndex];
+                    uint32_t userWordIndex = instructions[listNode.instructionIndex].wordIndex;
+                    switch (instructionOpCode(listNode.instructionIndex)) {
+                    case SpvOpLoad:
+                        accessIndices.emplace_back(listNode.instructionIndex);
+                        hasLoads = true;
+                        break;
+                    case SpvOpStore:
+                        escapes = (spirvWords[userWordIndex + 1] != variableId) || (spirvWords[userWordIndex + 2] == variableId);
+                        accessIndices.emplace_back(listNode.instructionIndex);
+                        break;
+                    case SpvOpDecorate:
+                    case SpvOpGroupDecorate:
+                    case SpvOpDecorateId:
+                    case SpvOpDecorateString:
+                        break;
+                    default:
+                        escapes = true;
+                        break;
+                    }
+
+                    listIndex = listNode.nextListIndex;
+                }
+
+                if (escapes || !hasLoads) {
+                    continue;
+                }
+
+                std::sort(accessIndices.begin(), accessIndices.end());
+                accessIndices.erase(std::unique(accessIndices.begin(), accessIndices.end()), accessIndices.end());
+
+                State initialState;
+                initialState.kind = (wordCount > 4) ? StateKind::Value : StateKind::Undefined;
+                initialState.id = (wordCount > 4) ? spirvWords[wordIndex + 4] : 0;
+
+                // Blocks before the first access exit with the initial state, and blocks after the last access don't need to be visited.
+                // A loop that starts before the first access and goes back from after it is visited from its header instead, as the
+                // value can change before it gets back to it.
+                uint32_t firstAccessBlock = instructionBlocks[accessIndices.front() - functionBegin];
+                uint32_t firstBlock = firstAccessBlock;
+                for (uint32_t b = 0; (b < firstAccessBlock) && (firstBlock == firstAccessBlock); b++) {
+                    for (uint32_t p = predecessorStarts[b]; p < predecessorStarts[b + 1]; p++) {
+                        if (predecessors[p] >= firstAccessBlock) {
+                            firstBlock = b;
+                            break;
+                        }
+                    }
+                }
+
+                uint32_t lastBlock = instructionBlocks[accessIndices.back() - functionBegin];
+                exitStates.clear();
+                exitStates.resize(lastBlock + 1, initialState);
+
+                uint32_t accessIndex = 0;
+                uint32_t accessCount = uint32_t(accessIndices.size());
+                for (uint32_t b = firstBlock; b <= lastBlock; b++) {
+                    State state;
+                    if (b == 0) {
+                        state = initialState;
+                    }
+                    else if (predecessorStarts[b] < predecessorStarts[b + 1]) {
+                        State firstState = (predecessors[predecessorStarts[b]] < b) ? exitStates[predecessors[predecessorStarts[b]]] : State();
+                        bool allEqual = true;
+                        bool allValues = true;
+                        for (uint32_t p = predecessorStarts[b]; p < predecessorStarts[b + 1]; p++) {
+                            uint32_t predecessor = predecessors[p];
+                            State predecessorState = (predecessor < b) ? exitStates[predecessor] : State();
+                            allEqual = allEqual && (predecessorState == firstState);
+                            allValues = allValues && (predecessorState.kind == StateKind::Value);
+                        }
+
+                        if (allEqual) {
+                            state = firstState;
+                        }
+                        else if (allValues) {
+                            state.kind = StateKind::Merge;
+                            state.id = b;
+                        }
+                    }
+
+                    while ((accessIndex < accessCount) && (instructionBlocks[accessIndices[accessIndex] - functionBegin] == b)) {
+                        uint32_t accessInstructionIndex = accessIndices[accessIndex++];
+                        uint32_t accessWordIndex = instructions[accessInstructionIndex].wordIndex;
+                        if (instructionOpCode(accessInstructionIndex) == SpvOpStore) {
+                            state.kind = StateKind::Value;
+                            state.id = spirvWords[accessWordIndex + 2];
+                            continue;
+                        }
+
+                        uint32_t valueIndex = uint32_t(localValues.size());
+                        if (state.kind == StateKind::Value) {
+                            localValues.emplace_back(state.id, UINT32_MAX);
+                        }
+                        else if (state.kind == StateKind::Merge) {
+                            for (uint32_t p = predecessorStarts[state.id]; p < predecessorStarts[state.id + 1]; p++) {
+                                uint32_t predecessor = predecessors[p];
+                                uint32_t labelIndex = blockLabelIndices[predecessor];
+                                localValues.emplace_back(exitStates[predecessor].id, spirvWords[instructions[labelIndex].wordIndex + 1]);
+                            }
+                        }
+                        else {
+                            continue;
+                        }
+
+                        // The load must be evaluated after the values and the labels they come from.
+                        uint32_t valueCount = uint32_t(localValues.size()) - valueIndex;
+                        uint32_t mergeLabelId = (state.kind == StateKind::Merge) ? spirvWords[instructions[blockLabelIndices[state.id]].wordIndex + 1] : UINT32_MAX;
+                        localLoads.emplace_back(accessInstructionIndex, valueIndex, valueCount, mergeLabelId);
+                        for (uint32_t j = valueIndex; j < (valueIndex + valueCount); j++) {
+                            uint32_t providerIndex = results[localValues[j].resultId].instructionIndex;
+                            instructions[providerIndex].adjacentListIndex = addToList(accessInstructionIndex, instructions[providerIndex].adjacentListIndex);
+                            if (localValues[j].labelId != UINT32_MAX) {
+                                uint32_t labelIndex = results[localValues[j].labelId].instructionIndex;
+                                instructions[labelIndex].adjacentListIndex = addToList(accessInstructionIndex, instructions[labelIndex].adjacentListIndex);
+                            }
+                        }
+                    }
+
+                    exitStates[b] = state;
+                }
+            }
+
+            functionBegin = functionEnd;
+        }
+
+        std::sort(localLoads.begin(), localLoads.end(), [](const LocalLoad &a, const LocalLoad &b) {
+            return a.instructionIndex < b.instructionIndex;
+        });
+    }
+
+    uint32_t Shader::findLocalLoad(uint32_t instructionIndex) const {
+        auto localLoadIt = std::lower_bound(localLoads.begin(), localLoads.end(), instructionIndex, [](const LocalLoad &localLoad, uint32_t instructionIndex) {
+            return localLoad.instructionIndex < instructionIndex;
+        });
+
+        if ((localLoadIt == localLoads.end()) || (localLoadIt->instructionIndex != instructionIndex)) {
+            return UINT32_MAX;
+        }
+
+        return uint32_t(localLoadIt - localLoads.begin());
+    }
+
+    bool Shader::process() {
+        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
+            if (!processInstruction(i)) {
+                return false;
+            }
+        }
+
+        return processFinish();
+    }
+
+    struct InstructionSort {
+        uint32_t instructionIndex = 0;
+        uint32_t instructionLevel = 0;
+
+        InstructionSort() {
+            // Empty.
+        }
+
+        InstructionSort(uint32_t instructionIndex, uint32_t instructionLevel) {
+            this->instructionIndex = instructionIndex;
+            this->instructionLevel = instructionLevel;
+        }
+
+        bool operator<(const InstructionSort &i) const {
+            if (instructionLevel < i.instructionLevel) {
+                return true;
+            }
+            else if (instructionLevel > i.instructionLevel) {
+                return false;
+            }
+
+            return instructionIndex < i.instructionIndex;
+        }
+    };
+
+    uint32_t Shader::instructionResultId(uint32_t instructionIndex) const {
+        uint32_t wordIndex = instructions[instructionIndex].wordIndex;
+        bool hasResult, hasType;
+        SpvHasResultAndType(SpvOp(spirvWords[wordIndex] & 0xFFFFU), &hasResult, &hasType);
+        return hasResult ? spirvWords[wordIndex + (hasType ? 2 : 1)] : UINT32_MAX;
+    }
+
+    void Shader::countEdge(uint32_t providerIndex, uint32_t providerResultId, uint32_t userIndex, int32_t count) {
+        // The values that loads from local variables are resolved to are left out of the out degree, as those edges
+        // only order the evaluation. Decorations are also counted on their own, so the optimizer can choose whether
+        // they keep their target alive.
+        uint32_t userWordIndex = instructions[userIndex].wordIndex;
+        SpvOp userOpCode = SpvOp(spirvWords[userWordIndex] & 0xFFFFU);
+        bool localValue = (userOpCode == SpvOpLoad) && (spirvWords[userWordIndex + 1] != providerResultId) && (spirvWords[userWordIndex + 3] != providerResultId);
+        instructionInDegrees[userIndex] += uint32_t(count);
+        if (!localValue) {
+            instructionOutDegrees[providerIndex] += uint32_t(count);
+        }
+
+        if (SpvIsDecoration(userOpCode)) {
+            instructionDecorationDegrees[providerIndex] += uint32_t(count);
+        }
+    }
+
+    void Shader::countDegrees() {
+        instructionInDegrees.clear();
+        instructionOutDegrees.clear();
+        instructionInDegrees.resize(instructions.size(), 0);
+        instructionOutDegrees.resize(instructions.size(), 0);
+        instructionDecorationDegrees.clear();
+        instructionDecorationDegrees.resize(instructions.size(), 0);
+        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
+            uint32_t resultId = instructionResultId(i);
+            uint32_t listIndex = instructions[i].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[listIndex];
+                countEdge(i, resultId, listNode.instructionIndex, 1);
+                listIndex = listNode.nextListIndex;
+            }
+        }
+    }
+
+    void Shader::analyzeRegions(uint32_t rangeBegin, uint32_t rangeEnd) {
+        // Regions never leave the function they're in, so only the ones inside of the range are replaced.
+        auto regionLess = [](const Region &region, uint32_t instructionIndex) {
+            return region.labelInstructionIndex < instructionIndex;
+        };
+
+        auto regionIt = std::lower_bound(regions.begin(), regions.end(), rangeBegin, regionLess);
+        auto regionEnd = std::lower_bound(regionIt, regions.end(), rangeEnd, regionLess);
+        size_t insertIndex = size_t(regionIt - regions.begin());
+        regions.erase(regionIt, regionEnd);
+
+        thread_local std::vector<Region> rangeRegions;
+        rangeRegions.clear();
+
+        uint32_t instructionCount = uint32_t(instructions.size());
+        uint32_t scanEnd = std::min(rangeEnd, instructionCount);
+        auto instructionOpCode = [&](uint32_t instructionIndex) {
+            return SpvOp(spirvWords[instructions[instructionIndex].wordIndex] & 0xFFFFU);
+        };
+
+        for (uint32_t i = rangeBegin; (i + 1) < scanEnd; i++) {
+            if ((instructionOpCode(i) != SpvOpSelectionMerge) || (instructionOpCode(i + 1) != SpvOpBranchConditional)) {
+                continue;
+            }
+
+            uint32_t branchWordIndex = instructions[i + 1].wordIndex;
+            uint32_t mergeLabelId = spirvWords[instructions[i].wordIndex + 1];
+            uint32_t armLabelIds[2] = { spirvWords[branchWordIndex + 2], spirvWords[branchWordIndex + 3] };
+            if (armLabelIds[0] == armLabelIds[1]) {
+                continue;
+            }
+
+            for (uint32_t j = 0; j < 2; j++) {
+                uint32_t armLabelId = armLabelIds[j];
+                uint32_t otherLabelId = armLabelIds[j ^ 1];
+                uint32_t labelIndex = results[armLabelId].instructionIndex;
+                if ((armLabelId == mergeLabelId) || (labelIndex <= (i + 1))) {
+                    continue;
+                }
+
+                // The arm extends until the label of the merge block, the label of the other arm or the end of the function.
+                uint32_t endIndex = labelIndex + 1;
+                while (endIndex < instructionCount) {
+                    SpvOp opCode = instructionOpCode(endIndex);
+                    if (opCode == SpvOpFunctionEnd) {
+                        break;
+                    }
+                    else if (opCode == SpvOpLabel) {
+                        uint32_t labelId = spirvWords[instructions[endIndex].wordIndex + 1];
+                        if ((labelId == mergeLabelId) || (labelId == otherLabelId)) {
+                            break;
+                        }
+                    }
+
+                    endIndex++;
+                }
+
+                // The span is only valid if the branch of the header is the only reference to its labels from outside of it.
+                uint32_t labelInDegrees = 0;
+                uint32_t internalReferences = 0;
+                for (uint32_t k = labelIndex; k < endIndex; k++) {
+                    uint32_t wordIndex = instructions[k].wordIndex;
+                    SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+                    uint32_t wordCount = (spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+                    if (opCode == SpvOpLabel) {
+                        labelInDegrees += instructionInDegrees[k];
+                    }
+
+                    uint32_t labelWordStart, labelWordCount, labelWordStride;
+                    if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+                        for (uint32_t l = 0; (l < labelWordCount) && ((labelWordStart + l * labelWordStride) < wordCount); l++) {
+                            uint32_t referenceIndex = results[spirvWords[wordIndex + labelWordStart + l * labelWordStride]].instructionIndex;
+                            if ((referenceIndex >= labelIndex) && (referenceIndex < endIndex)) {
+                                internalReferences++;
+                            }
+                        }
+                    }
+                }
+
+                if (labelInDegrees == (internalReferences + 1)) {
+                    rangeRegions.emplace_back(labelIndex, endIndex);
+                }
+            }
+        }
+
+        std::sort(rangeRegions.begin(), rangeRegions.end(), [](const Region &a, const Region &b) {
+            return a.labelInstructionIndex < b.labelInstructionIndex;
+        });
+
+        regions.insert(regions.begin() + insertIndex, rangeRegions.begin(), rangeRegions.end());
+    }
+
+    uint32_t Shader::findRegion(uint32_t labelInstructionIndex) const {
+        auto regionIt = std::lower_bound(regions.begin(), regions.end(), labelInstructionIndex, [](const Region &region, uint32_t labelInstructionIndex) {
+            return region.labelInstructionIndex < labelInstructionIndex;
+        });
+
+        if ((regionIt == regions.end()) || (regionIt->labelInstructionIndex != labelInstructionIndex)) {
+            return UINT32_MAX;
+        }
+
+        return uint32_t(regionIt - regions.begin());
+    }
+
+    bool Shader::isBackEdge(uint32_t providerIndex, uint32_t userIndex) const {
+        // The branch that goes back to the header of a loop and the values an OpPhi receives from the end of the loop are
+        // the only providers that can come after their users.
+        if (providerIndex <= userIndex) {
+            return false;
+        }
+
+        SpvOp userOpCode = SpvOp(spirvWords[instructions[userIndex].wordIndex] & 0xFFFFU);
+        return (userOpCode == SpvOpLabel) || (userOpCode == SpvOpPhi);
+    }
+
+    bool Shader::sort() {
+        // Count the in and out degrees for all instructions.
+        countDegrees();
+        analyzeRegions();
+
+        // Make a copy of the degrees as they'll be used to perform a topological sort. Back edges aren't part of it.
+        std::vector<uint32_t> sortDegrees;
+        sortDegrees.resize(instructionInDegrees.size());
+        memcpy(sortDegrees.data(), instructionInDegrees.data(), sizeof(uint32_t) *sortDegrees.size());
+        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
+            uint32_t listIndex = instructions[i].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[listIndex];
+                if (isBackEdge(i, listNode.instructionIndex)) {
+                    sortDegrees[listNode.instructionIndex]--;
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        }
+
+        // The first nodes to be processed should be the ones with no incoming connections.
+        std::vector<uint32_t> instructionStack;
+        instructionStack.clear();
+        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
+            if (sortDegrees[i] == 0) {
+                instructionStack.emplace_back(i);
+            }
+        }
+
+        instructionOrder.reserve(instructions.size());
+        instructionOrder.clear();
+        while (!instructionStack.empty()) {
+            uint32_t i = instructionStack.back();
+            instructionStack.pop_back();
+            instructionOrder.emplace_back(i);
+
+            // Look for the adjacents and reduce their degree. Push it to the stack if their degree reaches zero.
+            uint32_t listIndex = instructions[i].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[listIndex];
+                if (isBackEdge(i, listNode.instructionIndex)) {
+                    listIndex = listNode.nextListIndex;
+                    continue;
+                }
+
+                uint32_t &sortDegree = sortDegrees[listNode.instructionIndex];
+                assert(sortDegree > 0);
+                sortDegree--;
+                if (sortDegree == 0) {
+                    instructionStack.emplace_back(listNode.instructionIndex);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        }
+
+        if (instructionOrder.size() != instructions.size()) {
+            fprintf(stderr, "SPIR-V Parsing error. The instructions have a cyclic dependency that can't be sorted.\n");
+            return false;
+        }
+
+        std::vector<InstructionSort> instructionSortVector;
+        instructionSortVector.clear();
+        instructionSortVector.resize(instructionOrder.size(), InstructionSort());
+        for (uint32_t instructionIndex : instructionOrder) {
+            uint32_t nextLevel = instructionSortVector[instructionIndex].instructionLevel + 1;
+            uint32_t listIndex = instructions[instructionIndex].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[listIndex];
+                if (!isBackEdge(instructionIndex, listNode.instructionIndex)) {
+                    uint32_t &listLevel = instructionSortVector[listNode.instructionIndex].instructionLevel;
+                    listLevel = std::max(listLevel, nextLevel);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+
+            instructionSortVector[instructionIndex].instructionIndex = instructionIndex;
+        }
+
+        std::sort(instructionSortVector.begin(), instructionSortVector.end());
+        
+        // Rebuild the instruction order vector with the sorted indices. The levels are stored so updates can extend the order.
+        instructionOrder.clear();
+        instructionLevels.resize(instructions.size());
+        for (InstructionSort &instructionSort : instructionSortVector) {
+            instructionOrder.emplace_back(instructionSort.instructionIndex);
+            instructionLevels[instructionSort.instructionIndex] = instructionSort.instructionLevel;
+        }
+
+        return true;
+    }
+
+    bool Shader::parse(const void *data, size_t size) {
+        assert(data != nullptr);
+        assert((size % sizeof(uint32_t) == 0) && "Size of data must be aligned to the word size.");
+
+        clear();
+
+        if (!parseWords(data, size)) {
+            return false;
+        }
+
+        if (!process()) {
+            return false;
+        }
+
+        if (!sort()) {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Shader::update(const void *data, size_t size) {
+        assert(data != nullptr);
+        assert((size % sizeof(uint32_t) == 0) && "Size of data must be aligned to the word size.");
+
+        // There's nothing to reuse if the shader wasn't parsed before.
+        const uint32_t *newWords = reinterpret_cast<const uint32_t *>(data);
+        const size_t newWordCount = size / sizeof(uint32_t);
+        const uint32_t startingWordIndex = 5;
+        if ((spirvWords == nullptr) || streaming || instructions.empty() || (instructionOrder.size() != instructions.size())) {
+            return parse(data, size);
+        }
+
+        // Any changes to the header, including the ID bound, require a full parse.
+        if ((newWordCount < startingWordIndex) || (memcmp(newWords, spirvWords, startingWordIndex * sizeof(uint32_t)) != 0)) {
+            return parse(data, size);
+        }
+
+        auto oldOpCode = [&](uint32_t instructionIndex) {
+            return SpvOp(spirvWords[instructions[instructionIndex].wordIndex] & 0xFFFFU);
+        };
+
+        auto oldWordCount = [&](uint32_t instructionIndex) {
+            return (spirvWords[instructions[instructionIndex].wordIndex] >> 16U) & 0xFFFFU;
+        };
+
+        // Find how many instructions at the start and the end of the module are identical.
+        const uint32_t oldInstructionCount = uint32_t(instructions.size());
+        uint32_t prefixCount = 0;
+        while (prefixCount < oldInstructionCount) {
+            uint32_t wordIndex = instructions[prefixCount].wordIndex;
+            uint32_t wordCount = oldWordCount(prefixCount);
+            if (((wordIndex + wordCount) > newWordCount) || (memcmp(&spirvWords[wordIndex], &newWords[wordIndex], wordCount * sizeof(uint32_t)) != 0)) {
+                break;
+            }
+
+            prefixCount++;
+        }
+
+        if ((prefixCount == oldInstructionCount) && (newWordCount == spirvWordCount)) {
+            // The module is identical, only the location of the words changed.
+            spirvWords = newWords;
+            streamWords.clear();
+            streamWords.shrink_to_fit();
+            return true;
+        }
+
+        const uint32_t prefixWordCount = (prefixCount < oldInstructionCount) ? instructions[prefixCount].wordIndex : uint32_t(spirvWordCount);
+        const int64_t wordDelta = int64_t(newWordCount) - int64_t(spirvWordCount);
+        uint32_t suffixCount = 0;
+        while ((prefixCount + suffixCount) < oldInstructionCount) {
+            uint32_t instructionIndex = oldInstructionCount - 1 - suffixCount;
+            uint32_t wordIndex = instructions[instructionIndex].wordIndex;
+            uint32_t wordCount = oldWordCount(instructionIndex);
+            int64_t newWordIndex = int64_t(wordIndex) + wordDelta;
+            if ((newWordIndex < int64_t(prefixWordCount)) || (memcmp(&spirvWords[wordIndex], &newWords[newWordIndex], wordCount * sizeof(uint32_t)) != 0)) {
+                break;
+            }
+
+            suffixCount++;
+        }
+
+        // Expand the range of modified instructions so it covers entire functions. Changes that reach into the
+        // global section can affect the analysis of the entire module, so those require a full parse.
+        uint32_t rangeBegin = prefixCount;
+        uint32_t oldRangeEnd = oldInstructionCount - suffixCount;
+        if ((rangeBegin < oldInstructionCount) && (oldOpCode(rangeBegin) == SpvOpFunction)) {
+            // The range already starts at a function.
+        }
+        else if ((rangeBegin > 0) && (oldOpCode(rangeBegin - 1) == SpvOpFunctionEnd)) {
+            // The range starts right after a function.
+        }
+        else {
+            while ((rangeBegin > 0) && (oldOpCode(rangeBegin - 1) != SpvOpFunction) && (oldOpCode(rangeBegin - 1) != SpvOpFunctionEnd)) {
+                rangeBegin--;
+            }
+
+            if ((rangeBegin == 0) || (oldOpCode(rangeBegin - 1) != SpvOpFunction)) {
+                return parse(data, size);
+            }
+
+            rangeBegin--;
+        }
+
+        oldRangeEnd = std::max(oldRangeEnd, rangeBegin);
+        while ((oldRangeEnd < oldInstructionCount) && (oldOpCode(oldRangeEnd) != SpvOpFunction) && ((oldRangeEnd == rangeBegin) || (oldOpCode(oldRangeEnd - 1) != SpvOpFunctionEnd))) {
+            oldRangeEnd++;
+        }
+
+        // Find the boundaries of the instructions in the modified range of the new module.
+        const uint32_t rangeWordBegin = (rangeBegin < oldInstructionCount) ? instructions[rangeBegin].wordIndex : uint32_t(spirvWordCount);
+        const uint32_t newRangeWordEnd = uint32_t((oldRangeEnd < oldInstructionCount) ? (int64_t(instructions[oldRangeEnd].wordIndex) + wordDelta) : int64_t(newWordCount));
+        thread_local std::vector<uint32_t> newRangeWordIndices;
+        newRangeWordIndices.clear();
+        uint32_t newWordIndex = rangeWordBegin;
+        while (newWordIndex < newRangeWordEnd) {
+            uint32_t wordCount = (newWords[newWordIndex] >> 16U) & 0xFFFFU;
+            if (wordCount == 0) {
+                return parse(data, size);
+            }
+
+            newRangeWordIndices.emplace_back(newWordIndex);
+            newWordIndex += wordCount;
+        }
+
+        if (newWordIndex != newRangeWordEnd) {
+            return parse(data, size);
+        }
+
+        if (!newRangeWordIndices.empty()) {
+            SpvOp firstOpCode = SpvOp(newWords[newRangeWordIndices.front()] & 0xFFFFU);
+            SpvOp lastOpCode = SpvOp(newWords[newRangeWordIndices.back()] & 0xFFFFU);
+            if ((firstOpCode != SpvOpFunction) || (lastOpCode != SpvOpFunctionEnd)) {
+                return parse(data, size);
+            }
+        }
+
+        // From this point on the analysis is modified. Any errors fall back to a full parse, which will either
+        // rebuild the analysis from scratch or fail the same way a regular parse would.
+        const uint32_t newRangeCount = uint32_t(newRangeWordIndices.size());
+        const uint32_t newRangeEnd = rangeBegin + newRangeCount;
+        const int64_t instructionDelta = int64_t(newRangeCount) - int64_t(oldRangeEnd - rangeBegin);
+        auto remapIndex = [&](uint32_t instructionIndex) {
+            if (instructionIndex < rangeBegin) {
+                return instructionIndex;
+            }
+            else if (instructionIndex >= oldRangeEnd) {
+                return uint32_t(int64_t(instructionIndex) + instructionDelta);
+            }
+            else {
+                return UINT32_MAX;
+            }
+        };
+
+        // Instructions outside of the range that use results from the range must be connected to the new results.
+        // The degrees of the edges that are removed are subtracted, so only the instructions that are connected to the
+        // range need to be counted again.
+        thread_local std::vector<uint32_t> affectedUsers;
+        affectedUsers.clear();
+        for (uint32_t i = rangeBegin; i < oldRangeEnd; i++) {
+            uint32_t resultId = instructionResultId(i);
+            uint32_t listIndex = instructions[i].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[listIndex];
+                uint32_t userIndex = remapIndex(listNode.instructionIndex);
+                if (userIndex != UINT32_MAX) {
+                    countEdge(i, resultId, listNode.instructionIndex, -1);
+                    affectedUsers.emplace_back(userIndex);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        }
+
+        std::sort(affectedUsers.begin(), affectedUsers.end());
+        affectedUsers.erase(std::unique(affectedUsers.begin(), affectedUsers.end()), affectedUsers.end());
+
+        // Splice the instructions and rebuild the adjacency lists without the edges that pointed into the old range.
+        std::vector<Instruction> newInstructions;
+        std::vector<ListNode> newListNodes;
+        newInstructions.reserve(size_t(int64_t(instructions.size()) + instructionDelta));
+        newListNodes.reserve(listNodes.size());
+        auto copyList = [&](uint32_t providerIndex) {
+            uint32_t providerResultId = instructionResultId(providerIndex);
+            uint32_t oldListIndex = instructions[providerIndex].adjacentListIndex;
+            uint32_t firstListIndex = UINT32_MAX;
+            uint32_t lastListIndex = UINT32_MAX;
+            while (oldListIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[oldListIndex];
+                uint32_t targetIndex = remapIndex(listNode.instructionIndex);
+                if (targetIndex == UINT32_MAX) {
+                    countEdge(providerIndex, providerResultId, listNode.instructionIndex, -1);
+                }
+                else {
+                    newListNodes.emplace_back(targetIndex, UINT32_MAX);
+                    uint32_t newListIndex = uint32_t(newListNodes.size() - 1);
+                    if (lastListIndex == UINT32_MAX) {
+                        firstListIndex = newListIndex;
+                    }
+                    else {
+                        newListNodes[lastListIndex].nextListIndex = newListIndex;
+                    }
+
+                    lastListIndex = newListIndex;
+                }
+
+                oldListIndex = listNode.nextListIndex;
+            }
+
+            return firstListIndex;
+        };
+
+        for (uint32_t i = 0; i < rangeBegin; i++) {
+            newInstructions.emplace_back(instructions[i].wordIndex);
+            newInstructions.back().adjacentListIndex = copyList(i);
+        }
+
+        for (uint32_t wordIndex : newRangeWordIndices) {
+            newInstructions.emplace_back(wordIndex);
+        }
+
+        for (uint32_t i = oldRangeEnd; i < oldInstructionCount; i++) {
+            newInstructions.emplace_back(uint32_t(int64_t(instructions[i].wordIndex) + wordDelta));
+            newInstructions.back().adjacentListIndex = copyList(i);
+        }
+
+        for (Result &result : results) {
+            if (result.instructionIndex != UINT32_MAX) {
+                result.instructionIndex = remapIndex(result.instructionIndex);
+            }
+        }
+
+        std::vector<Phi> newPhis;
+        newPhis.reserve(phis.size());
+        for (const Phi &phi : phis) {
+            if (phi.instructionIndex < rangeBegin) {
+                newPhis.emplace_back(phi.instructionIndex);
+            }
+        }
+
+        for (uint32_t i = 0; i < newRangeCount; i++) {
+            if (SpvOp(newWords[newRangeWordIndices[i]] & 0xFFFFU) == SpvOpPhi) {
+                newPhis.emplace_back(rangeBegin + i);
+            }
+        }
+
+        for (const Phi &phi : phis) {
+            if (phi.instructionIndex >= oldRangeEnd) {
+                newPhis.emplace_back(remapIndex(phi.instructionIndex));
+            }
+        }
+
+        std::vector<Variable> newVariables;
+        newVariables.reserve(variables.size());
+        for (const Variable &variable : variables) {
+            if (variable.instructionIndex < rangeBegin) {
+                newVariables.emplace_back(variable);
+            }
+        }
+
+        for (uint32_t i = 0; i < newRangeCount; i++) {
+            if (SpvOp(newWords[newRangeWordIndices[i]] & 0xFFFFU) == SpvOpVariable) {
+                newVariables.emplace_back(rangeBegin + i);
+            }
+        }
+
+        for (const Variable &variable : variables) {
+            if (variable.instructionIndex >= oldRangeEnd) {
+                newVariables.emplace_back(variable);
+                newVariables.back().instructionIndex = remapIndex(variable.instructionIndex);
+            }
+        }
+
+        std::vector<LocalLoad> newLocalLoads;
+        std::vector<LocalValue> newLocalValues;
+        newLocalLoads.reserve(localLoads.size());
+        newLocalValues.reserve(localValues.size());
+        for (const LocalLoad &localLoad : localLoads) {
+            uint32_t newIndex = remapIndex(localLoad.instructionIndex);
+            if (newIndex != UINT32_MAX) {
+                newLocalLoads.emplace_back(newIndex, uint32_t(newLocalValues.size()), localLoad.valueCount, localLoad.mergeLabelId);
+                newLocalValues.insert(newLocalValues.end(), localValues.begin() + localLoad.valueIndex, localValues.begin() + localLoad.valueIndex + localLoad.valueCount);
+            }
+        }
+
+        for (Decoration &decoration : decorations) {
+            decoration.instructionIndex = remapIndex(decoration.instructionIndex);
+        }
+
+        for (Specialization &specialization : specializations) {
+            if (specialization.constantInstructionIndex != UINT32_MAX) {
+                specialization.constantInstructionIndex = remapIndex(specialization.constantInstructionIndex);
+                specialization.decorationInstructionIndex = remapIndex(specialization.decorationInstructionIndex);
+            }
+        }
+
+        regions.erase(std::remove_if(regions.begin(), regions.end(), [&](const Region &region) {
+            return (region.labelInstructionIndex >= rangeBegin) && (region.labelInstructionIndex < oldRangeEnd);
+        }), regions.end());
+
+        for (Region &region : regions) {
+            if (region.labelInstructionIndex >= oldRangeEnd) {
+                region.labelInstructionIndex = remapIndex(region.labelInstructionIndex);
+                region.endInstructionIndex = uint32_t(int64_t(region.endInstructionIndex) + instructionDelta);
+            }
+        }
+
+        // The new range starts with no levels or degrees.
+        auto spliceRange = [&](std::vector<uint32_t> &vector) {
+            vector.erase(vector.begin() + rangeBegin, vector.begin() + oldRangeEnd);
+            vector.insert(vector.begin() + rangeBegin, newRangeCount, 0);
+        };
+
+        spliceRange(instructionLevels);
+        spliceRange(instructionInDegrees);
+        spliceRange(instructionOutDegrees);
+        spliceRange(instructionDecorationDegrees);
+
+        std::vector<uint32_t> filteredOrder;
+        filteredOrder.reserve(newInstructions.size());
+        for (uint32_t instructionIndex : instructionOrder) {
+            uint32_t newIndex = remapIndex(instructionIndex);
+            if (newIndex != UINT32_MAX) {
+                filteredOrder.emplace_back(newIndex);
+            }
+        }
+
+        instructions = std::move(newInstructions);
+        listNodes = std::move(newListNodes);
+        phis = std::move(newPhis);
+        variables = std::move(newVariables);
+        localLoads = std::move(newLocalLoads);
+        localValues = std::move(newLocalValues);
+        spirvWords = newWords;
+        spirvWordCount = newWordCount;
+        streamWords.clear();
+        streamWords.shrink_to_fit();
+
+        // Every edge that's added from this point on is connected to the new range. New edges are always put at the
+        // start of the adjacency lists, so they can be found without visiting the rest of the lists.
+        const uint32_t firstNewListIndex = uint32_t(listNodes.size());
+
+        // Register the results of the new range and analyze its instructions.
+        for (uint32_t i = rangeBegin; i < newRangeEnd; i++) {
+            uint32_t wordIndex = instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(spirvWords[wordIndex] & 0xFFFFU);
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            if (hasResult) {
+                uint32_t resultId = spirvWords[wordIndex + (hasType ? 2 : 1)];
+                if ((resultId >= results.size()) || (results[resultId].instructionIndex != UINT32_MAX)) {
+                    return parse(data, size);
+                }
+
+                results[resultId].instructionIndex = i;
+            }
+        }
+
+        for (uint32_t i = rangeBegin; i < newRangeEnd; i++) {
+            if (!processInstruction(i)) {
+                return parse(data, size);
+            }
+        }
+
+        for (uint32_t userIndex : affectedUsers) {
+            if (!checkReferences(userIndex) || !processInstruction(userIndex, rangeBegin, newRangeEnd)) {
+                return parse(data, size);
+            }
+        }
+
+        analyzeVariables(rangeBegin, newRangeEnd);
+        analyzeLocalLoads(rangeBegin, newRangeEnd);
+
+        // Count the degrees of the new edges and assign levels to the new range in topological order. Edges coming
+        // from the rest of the module use the levels that were already known. Levels only need to grow for the order
+        // to remain valid, so any instruction outside of the range that depends on the new range is moved further down
+        // the order if necessary.
+        thread_local std::vector<uint32_t> rangeDegrees;
+        thread_local std::vector<uint32_t> instructionStack;
+        thread_local std::vector<uint32_t> movedInstructions;
+        rangeDegrees.assign(newRangeCount, 0);
+        instructionStack.clear();
+        movedInstructions.clear();
+        for (uint32_t i = 0; i < uint32_t(instructions.size()); i++) {
+            uint32_t listIndex = instructions[i].adjacentListIndex;
+            if ((listIndex == UINT32_MAX) || (listIndex < firstNewListIndex)) {
+                continue;
+            }
+
+            bool providerInRange = (i >= rangeBegin) && (i < newRangeEnd);
+            uint32_t resultId = instructionResultId(i);
+            while ((listIndex != UINT32_MAX) && (listIndex >= firstNewListIndex)) {
+                const ListNode &listNode = listNodes[listIndex];
+                uint32_t targetIndex = listNode.instructionIndex;
+                countEdge(i, resultId, targetIndex, 1);
+                if (isBackEdge(i, targetIndex)) {
+                    listIndex = listNode.nextListIndex;
+                    continue;
+                }
+
+                if ((targetIndex >= rangeBegin) && (targetIndex < newRangeEnd)) {
+                    if (providerInRange) {
+                        rangeDegrees[targetIndex - rangeBegin]++;
+                    }
+                    else {
+                        instructionLevels[targetIndex] = std::max(instructionLevels[targetIndex], instructionLevels[i] + 1);
+                    }
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        }
+
+        for (uint32_t i = 0; i < newRangeCount; i++) {
+            if (rangeDegrees[i] == 0) {
+                instructionStack.emplace_back(rangeBegin + i);
+            }
+        }
+
+        uint32_t sortedRangeCount = 0;
+        while (!instructionStack.empty()) {
+            uint32_t i = instructionStack.back();
+            instructionStack.pop_back();
+
+            bool instructionInRange = (i >= rangeBegin) && (i < newRangeEnd);
+            if (instructionInRange) {
+                sortedRangeCount++;
+            }
+
+            uint32_t nextLevel = instructionLevels[i] + 1;
+            uint32_t listIndex = instructions[i].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = listNodes[listIndex];
+                uint32_t targetIndex = listNode.instructionIndex;
+                uint32_t &targetLevel = instructionLevels[targetIndex];
+                bool targetInRange = (targetIndex >= rangeBegin) && (targetIndex < newRangeEnd);
+                if (isBackEdge(i, targetIndex)) {
+                    listIndex = listNode.nextListIndex;
+                    continue;
+                }
+
+                if (targetInRange) {
+                    if (!instructionInRange) {
+                        // The range depends on an instruction that depends on the range. This is not expected from
+                        // functions, so just sort the module again from scratch.
+                        return parse(data, size);
+                    }
+
+                    targetLevel = std::max(targetLevel, nextLevel);
+                    if (--rangeDegrees[targetIndex - rangeBegin] == 0) {
+                        instructionStack.emplace_back(targetIndex);
+                    }
+                }
+                else if (targetLevel < nextLevel) {
+                    // Instructions outside of the range propagate the increase to anything that depends on them.
+                    targetLevel = nextLevel;
+                    movedInstructions.emplace_back(targetIndex);
+                    instructionStack.emplace_back(targetIndex);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        }
+
+        if (sortedRangeCount != newRangeCount) {
+            return parse(data, size);
+        }
+
+        analyzeRegions(rangeBegin, newRangeEnd);
+
+        // Merge the order of the unmodified instructions with the new and moved instructions.
+        std::sort(movedInstructions.begin(), movedInstructions.end());
+        movedInstructions.erase(std::unique(movedInstructions.begin(), movedInstructions.end()), movedInstructions.end());
+
+        std::vector<InstructionSort> newSortVector;
+        newSortVector.reserve(newRangeCount + movedInstructions.size());
+        for (uint32_t i = rangeBegin; i < newRangeEnd; i++) {
+            newSortVector.emplace_back(i, instructionLevels[i]);
+        }
+
+        for (uint32_t i : movedInstructions) {
+            newSortVector.emplace_back(i, instructionLevels[i]);
+        }
+
+        std::sort(newSortVector.begin(), newSortVector.end());
+
+        instructionOrder.clear();
+        instructionOrder.reserve(instructions.size());
+        size_t newSortIndex = 0;
+        for (uint32_t instructionIndex : filteredOrder) {
+            if (std::binary_search(movedInstructions.begin(), movedInstructions.end(), instructionIndex)) {
+                continue;
+            }
+
+            InstructionSort filteredSort(instructionIndex, instructionLevels[instructionIndex]);
+            while ((newSortIndex < newSortVector.size()) && (newSortVector[newSortIndex] < filteredSort)) {
+                instructionOrder.emplace_back(newSortVector[newSortIndex++].instructionIndex);
+            }
+
+            instructionOrder.emplace_back(instructionIndex);
+        }
+
+        while (newSortIndex < newSortVector.size()) {
+            instructionOrder.emplace_back(newSortVector[newSortIndex++].instructionIndex);
+        }
+
+        computeFingerprint();
+        return true;
+    }
+
+    bool Shader::empty() const {
+        return false;
+    }
+
+    // Optimizer
+
+    // Words inserted by the optimizer inside a function, placed right before the instruction they're anchored to. Instructions
+    // that were moved into another block are placed right after its label instead, in the order they were originally in.
+    // They're discarded if the instruction they're anchored to is eliminated.
+    struct OptimizerInsertion {
+        uint32_t instructionIndex = UINT32_MAX;
+        uint32_t wordIndex = 0;
+        uint32_t wordCount = 0;
+        uint32_t movedInstructionIndex = UINT32_MAX;
+
+        OptimizerInsertion() {
+            // Empty.
+        }
+
+        OptimizerInsertion(uint32_t instructionIndex, uint32_t wordIndex, uint32_t wordCount, uint32_t movedInstructionIndex = UINT32_MAX) {
+            this->instructionIndex = instructionIndex;
+            this->wordIndex = wordIndex;
+            this->wordCount = wordCount;
+            this->movedInstructionIndex = movedInstructionIndex;
+        }
+    };
+
+    // Resolutions and degrees are only valid when their stamp matches the generation of the current run. Entries
+    // with an older stamp are reset to their initial state when they're first accessed, so preparing a run doesn't
+    // need to clear or copy the whole state.
+    struct OptimizerState {
+        std::vector<Resolution> resolutions;
+        std::vector<uint32_t> resolutionStamps;
+        std::vector<uint32_t> instructionInDegrees;
+        std::vector<uint32_t> instructionInDegreeStamps;
+        std::vector<uint32_t> instructionOutDegrees;
+        std::vector<uint32_t> instructionOutDegreeStamps;
+        std::vector<uint32_t> mergedInstructions;
+        std::vector<uint32_t> mergedInstructionStamps;
+        std::vector<uint32_t> resultLeaders;
+        std::vector<uint32_t> resultLeaderStamps;
+        std::vector<uint32_t> insertedWords;
+        std::vector<uint32_t> functionInsertedWords;
+        std::vector<OptimizerInsertion> functionInsertions;
+
+        // Conditions of the selections converted from an OpPhi. The analysis doesn't know they're used by the OpSelect.
+        std::vector<uint32_t> selectConditionIds;
+        uint32_t generation = 0;
+    };
+
+    struct OptimizerContext {
+        const Shader &shader;
+        OptimizerState &state;
+        std::vector<uint8_t> &optimizedData;
+        const OptimizerOptions *options = nullptr;
+        uint64_t evaluatedInstructions = 0;
+        bool budgetExceeded = false;
+        uint32_t idBound = 0;
+        uint64_t changeCount = 0;
+        uint32_t mergedResultCount = 0;
+        bool decorationsAreUses = true;
+
+        OptimizerContext() = delete;
+    };
+
+    static bool optimizerCheckBudget(OptimizerContext &c) {
+        if ((c.options == nullptr) || c.budgetExceeded) {
+            return !c.budgetExceeded;
+        }
+
+        const OptimizerOptions &options = *c.options;
+        if ((options.cancelFlag != nullptr) && options.cancelFlag->load(std::memory_order_relaxed)) {
+            c.budgetExceeded = true;
+        }
+        else if (c.evaluatedInstructions > options.maxEvaluatedInstructions) {
+            c.budgetExceeded = true;
+        }
+        else if ((options.deadline != std::chrono::steady_clock::time_point::max()) && (std::chrono::steady_clock::now() >= options.deadline)) {
+            c.budgetExceeded = true;
+        }
+
+        return !c.budgetExceeded;
+    }
+
+    static Resolution &optimizerResolution(uint32_t resultId, OptimizerContext &c) {
+        OptimizerState &state = c.state;
+        if (state.resolutionStamps[resultId] != state.generation) {
+            state.resolutionStamps[resultId] = state.generation;
+            state.resolutions[resultId] = Resolution();
+        }
+
+        return state.resolutions[resultId];
+    }
+
+    static uint32_t &optimizerInDegree(uint32_t instructionIndex, OptimizerContext &c) {
+        OptimizerState &state = c.state;
+        if (state.instructionInDegreeStamps[instructionIndex] != state.generation) {
+            state.instructionInDegreeStamps[instructionIndex] = state.generation;
+            state.instructionInDegrees[instructionIndex] = c.shader.instructionInDegrees[instructionIndex];
+        }
+
+        return state.instructionInDegrees[instructionIndex];
+    }
+
+    static uint32_t &optimizerOutDegree(uint32_t instructionIndex, OptimizerContext &c) {
+        OptimizerState &state = c.state;
+        if (state.instructionOutDegreeStamps[instructionIndex] != state.generation) {
+            state.instructionOutDegreeStamps[instructionIndex] = state.generation;
+            state.instructionOutDegrees[instructionIndex] = c.shader.instructionOutDegrees[instructionIndex];
+            if (!c.decorationsAreUses) {
+                state.instructionOutDegrees[instructionIndex] -= c.shader.instructionDecorationDegrees[instructionIndex];
+            }
+        }
+
+        return state.instructionOutDegrees[instructionIndex];
+    }
+
+    // Instructions whose results were replaced by an identical one are chained to it, as their users in the analysis now use
+    // the result of the instruction at the start of the chain.
+    static uint32_t &optimizerMergedInstruction(uint32_t instructionIndex, OptimizerContext &c) {
+        OptimizerState &state = c.state;
+        if (state.mergedInstructionStamps[instructionIndex] != state.generation) {
+            state.mergedInstructionStamps[instructionIndex] = state.generation;
+            state.mergedInstructions[instructionIndex] = UINT32_MAX;
+        }
+
+        return state.mergedInstructions[instructionIndex];
+    }
+
+    // Results that were merged into an identical one point to the result that replaced them. The optimizer writes some
+    // references without them being users in the analysis, so those are redirected through here instead.
+    static uint32_t &optimizerResultLeader(uint32_t resultId, OptimizerContext &c) {
+        OptimizerState &state = c.state;
+        if (state.resultLeaderStamps[resultId] != state.generation) {
+            state.resultLeaderStamps[resultId] = state.generation;
+            state.resultLeaders[resultId] = UINT32_MAX;
+        }
+
+        return state.resultLeaders[resultId];
+    }
+
+    static uint32_t optimizerResolveLeader(uint32_t resultId, OptimizerContext &c) {
+        // The leader of a merge can be merged into another result on a later iteration.
+        while ((resultId < c.shader.results.size()) && (optimizerResultLeader(resultId, c) != UINT32_MAX)) {
+            resultId = optimizerResultLeader(resultId, c);
+        }
+
+        return resultId;
+    }
+
+    static void optimizerEliminateInstruction(uint32_t instructionIndex, OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        for (uint32_t j = 0; j < wordCount; j++) {
+            optimizedWords[wordIndex + j] = UINT32_MAX;
+        }
+
+        c.changeCount++;
+    }
+
+    static void optimizerEliminateInstructionAndOperands(uint32_t instructionIndex, OptimizerContext &c, std::vector<uint32_t> &resultStack) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+        bool operandWordSkipString;
+        if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+            uint32_t operandWordIndex = operandWordStart;
+            for (uint32_t j = 0; j < operandWordCount; j++) {
+                if (checkOperandWordSkip(wordIndex, optimizedWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                    continue;
+                }
+
+                if (operandWordIndex >= wordCount) {
+                    break;
+                }
+
+                uint32_t operandId = optimizedWords[wordIndex + operandWordIndex];
+                resultStack.emplace_back(operandId);
+                operandWordIndex += operandWordStride;
+            }
+        }
+
+        optimizerEliminateInstruction(instructionIndex, c);
+    }
+
+    static void optimizerReduceResultDegrees(OptimizerContext &c, std::vector<uint32_t> &resultStack) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        while (!resultStack.empty()) {
+            uint32_t resultId = resultStack.back();
+            resultStack.pop_back();
+
+            // Instructions inserted by the optimizer aren't part of the analysis and are always kept.
+            if (resultId >= c.shader.results.size()) {
+                continue;
+            }
+
+            uint32_t instructionIndex = c.shader.results[resultId].instructionIndex;
+            uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+
+            // Instruction's been deleted.
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            optimizerOutDegree(instructionIndex, c)--;
+
+            // When nothing uses the result from this instruction anymore, we can delete it. Push any operands it uses into the stack as well to reduce their out degrees.
+            // Function calls are kept even if their result isn't used, as the function can have side effects.
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if ((optimizerOutDegree(instructionIndex, c) == 0) && (opCode != SpvOpFunctionCall)) {
+                optimizerEliminateInstructionAndOperands(instructionIndex, c, resultStack);
+
+                // A function that isn't used anymore is deleted along with its whole body.
+                if (opCode == SpvOpFunction) {
+                    bool foundFunctionEnd = false;
+                    uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+                    for (uint32_t i = instructionIndex + 1; (i < instructionCount) && !foundFunctionEnd; i++) {
+                        uint32_t bodyWordIndex = c.shader.instructions[i].wordIndex;
+                        if (optimizedWords[bodyWordIndex] == UINT32_MAX) {
+                            continue;
+                        }
+
+                        foundFunctionEnd = (SpvOp(optimizedWords[bodyWordIndex] & 0xFFFFU) == SpvOpFunctionEnd);
+                        optimizerEliminateInstructionAndOperands(i, c, resultStack);
+                    }
+                }
+            }
+        }
+    }
+
+    static void optimizerPrepareState(OptimizerContext &c) {
+        // The state is reused across runs and shaders, so it only needs to grow to fit the largest one.
+        OptimizerState &state = c.state;
+        if (state.resolutions.size() < c.shader.results.size()) {
+            state.resolutions.resize(c.shader.results.size());
+            state.resolutionStamps.resize(c.shader.results.size(), 0);
+        }
+
+        if (state.resultLeaders.size() < c.shader.results.size()) {
+            state.resultLeaders.resize(c.shader.results.size());
+            state.resultLeaderStamps.resize(c.shader.results.size(), 0);
+        }
+
+        if (state.instructionInDegrees.size() < c.shader.instructions.size()) {
+            state.instructionInDegrees.resize(c.shader.instructions.size());
+            state.instructionInDegreeStamps.resize(c.shader.instructions.size(), 0);
+            state.instructionOutDegrees.resize(c.shader.instructions.size());
+            state.instructionOutDegreeStamps.resize(c.shader.instructions.size(), 0);
+            state.mergedInstructions.resize(c.shader.instructions.size());
+            state.mergedInstructionStamps.resize(c.shader.instructions.size(), 0);
+        }
+
+        state.insertedWords.clear();
+        state.functionInsertedWords.clear();
+        state.functionInsertions.clear();
+        state.selectConditionIds.clear();
+
+        // Starting a new generation invalidates all entries at once. The stamps only need to be cleared when it wraps around.
+        state.generation++;
+        if (state.generation == 0) {
+            std::fill(state.resolutionStamps.begin(), state.resolutionStamps.end(), 0);
+            std::fill(state.instructionInDegreeStamps.begin(), state.instructionInDegreeStamps.end(), 0);
+            std::fill(state.instructionOutDegreeStamps.begin(), state.instructionOutDegreeStamps.end(), 0);
+            std::fill(state.mergedInstructionStamps.begin(), state.mergedInstructionStamps.end(), 0);
+            std::fill(state.resultLeaderStamps.begin(), state.resultLeaderStamps.end(), 0);
+            state.generation = 1;
+        }
+    }
+
+    static bool optimizerPrepareData(OptimizerContext &c) {
+        optimizerPrepareState(c);
+        c.optimizedData.resize(c.shader.spirvWordCount * sizeof(uint32_t));
+        memcpy(c.optimizedData.data(), c.shader.spirvWords, c.optimizedData.size());
+        c.idBound = c.shader.spirvWords[3];
+
+        // Decorations keep their targets alive, except when selecting an entry point, as the interface variables of the
+        // other entry points would otherwise be kept by their locations and built-ins.
+        c.decorationsAreUses = (c.options == nullptr) || c.options->entryPointName.empty();
+        return true;
+    }
+
+    static uint32_t optimizerReserveResult(OptimizerContext &c) {
+        // Passes that run afterwards treat the new result as an unknown value.
+        uint32_t resultId = c.idBound++;
+        OptimizerState &state = c.state;
+        if (state.resolutions.size() < c.idBound) {
+            state.resolutions.resize(c.idBound);
+            state.resolutionStamps.resize(c.idBound, 0);
+        }
+
+        optimizerResolution(resultId, c).type = Resolution::Type::Variable;
+        return resultId;
+    }
+
+    static uint32_t optimizerFindInsertedWords(const uint32_t *words, uint32_t wordCount, OptimizerContext &c) {
+        // Search the global instructions inserted by a previous call for one with the same words, except for the result.
+        const std::vector<uint32_t> &insertedWords = c.state.insertedWords;
+        uint32_t insertedWordCount = uint32_t(insertedWords.size());
+        for (uint32_t i = 0; i < insertedWordCount; i += (insertedWords[i] >> 16U) & 0xFFFFU) {
+            if (((insertedWords[i] >> 16U) & 0xFFFFU) != wordCount) {
+                continue;
+            }
+
+            bool matches = true;
+            for (uint32_t j = 0; (j < wordCount) && matches; j++) {
+                matches = (j == (wordCount - 1)) || (insertedWords[i + j] == words[j]);
+            }
+
+            if (matches) {
+                return insertedWords[i + wordCount - 1];
+            }
+        }
+
+        return UINT32_MAX;
+    }
+
+    static uint32_t optimizerNullConstant(uint32_t typeId, OptimizerContext &c) {
+        // Reuse a null constant of the same type if the module or a previous insertion already has one.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t listIndex = c.shader.instructions[c.shader.results[typeId].instructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = c.shader.listNodes[listIndex];
+            uint32_t wordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+            if ((SpvOp(optimizedWords[wordIndex] & 0xFFFFU) == SpvOpConstantNull) && (optimizedWords[wordIndex + 1] == typeId)) {
+                optimizerOutDegree(listNode.instructionIndex, c)++;
+                return optimizedWords[wordIndex + 2];
+            }
+
+            listIndex = listNode.nextListIndex;
+        }
+
+        const uint32_t constantWords[3] = { SpvOpConstantNull | (3U << 16U), typeId, UINT32_MAX };
+        uint32_t resultId = optimizerFindInsertedWords(constantWords, 3, c);
+        if (resultId != UINT32_MAX) {
+            return resultId;
+        }
+
+        // The new constant is inserted at the end of the global declarations when the module is compacted.
+        resultId = optimizerReserveResult(c);
+        c.state.insertedWords.insert(c.state.insertedWords.end(), constantWords, constantWords + 2);
+        c.state.insertedWords.emplace_back(resultId);
+        return resultId;
+    }
+
+    static uint32_t optimizerIntConstant(uint32_t typeId, uint32_t value, OptimizerContext &c) {
+        // Reuse a 32-bit constant with the same type and value if the module or a previous insertion already has one. Patched
+        // spec constants are skipped, as the output can have other values patched into them later.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t listIndex = c.shader.instructions[c.shader.results[typeId].instructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = c.shader.listNodes[listIndex];
+            uint32_t wordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+            bool isConstant = (c.shader.spirvWords[wordIndex] == (SpvOpConstant | (4U << 16U)));
+            if (isConstant && (optimizedWords[wordIndex] == (SpvOpConstant | (4U << 16U))) && (optimizedWords[wordIndex + 1] == typeId) && (optimizedWords[wordIndex + 3] == value)) {
+                optimizerOutDegree(listNode.instructionIndex, c)++;
+                return optimizedWords[wordIndex + 2];
+            }
+
+            listIndex = listNode.nextListIndex;
+        }
+
+        const uint32_t constantWords[4] = { SpvOpConstant | (4U << 16U), typeId, UINT32_MAX, value };
+        uint32_t resultId = optimizerFindInsertedWords(constantWords, 4, c);
+        if (resultId != UINT32_MAX) {
+            return resultId;
+        }
+
+        resultId = optimizerReserveResult(c);
+        std::vector<uint32_t> &insertedWords = c.state.insertedWords;
+        insertedWords.emplace_back(constantWords[0]);
+        insertedWords.emplace_back(typeId);
+        insertedWords.emplace_back(resultId);
+        insertedWords.emplace_back(value);
+        return resultId;
+    }
+
+    static uint32_t optimizerBoolType(OptimizerContext &c) {
+        // Non-aggregate types are unique in a module, so any boolean type can be used.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if (opCode == SpvOpTypeBool) {
+                return optimizedWords[wordIndex + 1];
+            }
+            else if (opCode == SpvOpFunction) {
+                break;
+            }
+        }
+
+        const uint32_t typeWords[2] = { SpvOpTypeBool | (2U << 16U), UINT32_MAX };
+        uint32_t resultId = optimizerFindInsertedWords(typeWords, 2, c);
+        if (resultId != UINT32_MAX) {
+            return resultId;
+        }
+
+        resultId = optimizerReserveResult(c);
+        c.state.insertedWords.emplace_back(typeWords[0]);
+        c.state.insertedWords.emplace_back(resultId);
+        return resultId;
+    }
+
+    static void optimizerInsertBefore(uint32_t instructionIndex, const uint32_t *words, uint32_t wordCount, OptimizerContext &c) {
+        std::vector<uint32_t> &functionInsertedWords = c.state.functionInsertedWords;
+        c.state.functionInsertions.emplace_back(instructionIndex, uint32_t(functionInsertedWords.size()), wordCount);
+        functionInsertedWords.insert(functionInsertedWords.end(), words, words + wordCount);
+    }
+
+    static void optimizerMoveAfterLabel(uint32_t labelInstructionIndex, uint32_t instructionIndex, OptimizerContext &c) {
+        // The result keeps its ID and its users, so only the words are moved.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        std::vector<uint32_t> &functionInsertedWords = c.state.functionInsertedWords;
+        c.state.functionInsertions.emplace_back(labelInstructionIndex, uint32_t(functionInsertedWords.size()), wordCount, instructionIndex);
+        functionInsertedWords.insert(functionInsertedWords.end(), &optimizedWords[wordIndex], &optimizedWords[wordIndex + wordCount]);
+        optimizerEliminateInstruction(instructionIndex, c);
+    }
+
+    static bool optimizerPatchSpecializationConstants(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        for (uint32_t i = 0; i < newSpecConstantCount; i++) {
+            const SpecConstant &newSpecConstant = newSpecConstants[i];
+            if (newSpecConstant.specId >= c.shader.specializations.size()) {
+                continue;
+            }
+
+            const Specialization &specialization = c.shader.specializations[newSpecConstant.specId];
+            if (specialization.constantInstructionIndex == UINT32_MAX) {
+                continue;
+            }
+
+            // The opcode is read from the shader, so if an ID is given more than once, its last value is the one used.
+            uint32_t constantWordIndex = c.shader.instructions[specialization.constantInstructionIndex].wordIndex;
+            SpvOp constantOpCode = SpvOp(c.shader.spirvWords[constantWordIndex] & 0xFFFFU);
+            uint32_t constantWordCount = (c.shader.spirvWords[constantWordIndex] >> 16U) & 0xFFFFU;
+            switch (constantOpCode) {
+            case SpvOpSpecConstantTrue:
+            case SpvOpSpecConstantFalse:
+                optimizedWords[constantWordIndex] = (newSpecConstant.values[0] ? SpvOpConstantTrue : SpvOpConstantFalse) | (constantWordCount << 16U);
+                break;
+            case SpvOpSpecConstant:
+                if (constantWordCount <= 3) {
+                    fprintf(stderr, "Optimization error. Specialization constant has less words than expected.\n");
+                    return false;
+                }
+
+                if (newSpecConstant.values.size() != (constantWordCount - 3)) {
+                    fprintf(stderr, "Optimization error. Value count for specialization constant %u differs from the expected size.\n", newSpecConstant.specId);
+                    return false;
+                }
+
+                optimizedWords[constantWordIndex] = SpvOpConstant | (constantWordCount << 16U);
+                memcpy(&optimizedWords[constantWordIndex + 3], newSpecConstant.values.data(), sizeof(uint32_t) * (constantWordCount - 3));
+                break;
+            default:
+                fprintf(stderr, "Optimization error. Can't patch opCode %u.\n", constantOpCode);
+                return false;
+            }
+
+            // Eliminate the decorator instruction as well, unless the same ID was already patched.
+            if (optimizedWords[c.shader.instructions[specialization.decorationInstructionIndex].wordIndex] != UINT32_MAX) {
+                optimizerEliminateInstruction(specialization.decorationInstructionIndex, c);
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerSelectEntryPoint(OptimizerContext &c) {
+        if ((c.options == nullptr) || c.options->entryPointName.empty()) {
+            return true;
+        }
+
+        // Entry points and execution modes are always declared before the first function.
+        const OptimizerOptions &options = *c.options;
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        uint32_t selectedFunctionId = UINT32_MAX;
+        uint32_t selectedInstructionIndex = UINT32_MAX;
+        uint32_t globalInstructionCount = 0;
+        for (; globalInstructionCount < instructionCount; globalInstructionCount++) {
+            uint32_t wordIndex = c.shader.instructions[globalInstructionCount].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            if (opCode == SpvOpFunction) {
+                break;
+            }
+            else if ((opCode != SpvOpEntryPoint) || (selectedInstructionIndex != UINT32_MAX) || (wordCount < 4)) {
+                continue;
+            }
+
+            const char *name = reinterpret_cast<const char *>(&optimizedWords[wordIndex + 3]);
+            size_t nameLength = strnlen(name, (wordCount - 3) * sizeof(uint32_t));
+            bool modelMatches = (options.entryPointExecutionModel == UINT32_MAX) || (options.entryPointExecutionModel == optimizedWords[wordIndex + 1]);
+            if (modelMatches && (nameLength == options.entryPointName.size()) && (memcmp(name, options.entryPointName.data(), nameLength) == 0)) {
+                selectedFunctionId = optimizedWords[wordIndex + 2];
+                selectedInstructionIndex = globalInstructionCount;
+            }
+        }
+
+        if (selectedInstructionIndex == UINT32_MAX) {
+            fprintf(stderr, "Optimization error. Entry point %s was not found.\n", options.entryPointName.c_str());
+            return false;
+        }
+
+        // Remove every other entry point and the execution modes of their functions. Their functions and interfaces are
+        // eliminated once nothing else uses them.
+        thread_local std::vector<uint32_t> resultStack;
+        resultStack.clear();
+        for (uint32_t i = 0; i < globalInstructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if ((opCode == SpvOpEntryPoint) && (i != selectedInstructionIndex)) {
+                optimizerEliminateInstructionAndOperands(i, c, resultStack);
+            }
+            else if (((opCode == SpvOpExecutionMode) || (opCode == SpvOpExecutionModeId)) && (optimizedWords[wordIndex + 1] != selectedFunctionId)) {
+                optimizerEliminateInstructionAndOperands(i, c, resultStack);
+            }
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+        return true;
+    }
+
+    static bool optimizerIsSignedDivisionUndefined(int32_t dividend, int32_t divisor) {
+        // Division by zero and the overflow of dividing the minimum value by -1 are both undefined.
+        return (divisor == 0) || ((dividend == INT32_MIN) && (divisor == -1));
+    }
+
+    static bool optimizerBitFieldMask(uint32_t offset, uint32_t count, uint32_t &mask) {
+        // The result is undefined if the field doesn't fit in the value.
+        if ((offset > 32) || (count > 32) || ((offset + count) > 32)) {
+            return false;
+        }
+
+        mask = (count == 32) ? UINT32_MAX : (((1U << count) - 1U) << (offset & 31U));
+        return true;
+    }
+
+    static bool optimizerConstantValue(const Shader &shader, uint32_t instructionIndex, uint32_t &value) {
+        // Only the same types of constants the optimizer can evaluate are considered. The words are read from the shader.
+        const uint32_t *words = shader.spirvWords;
+        uint32_t wordIndex = shader.instructions[instructionIndex].wordIndex;
+        SpvOp opCode = SpvOp(words[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (words[wordIndex] >> 16U) & 0xFFFFU;
+        switch (opCode) {
+        case SpvOpConstantTrue:
+        case SpvOpSpecConstantTrue:
+            value = 1;
+            return true;
+        case SpvOpConstantFalse:
+        case SpvOpSpecConstantFalse:
+            value = 0;
+            return true;
+        case SpvOpConstant:
+        case SpvOpSpecConstant: {
+            uint32_t typeWordIndex = shader.instructions[shader.results[words[wordIndex + 1]].instructionIndex].wordIndex;
+            SpvOp typeOpCode = SpvOp(words[typeWordIndex] & 0xFFFFU);
+            if ((typeOpCode != SpvOpTypeInt) || (words[typeWordIndex + 2] != 32) || (wordCount != 4)) {
+                return false;
+            }
+
+            value = words[wordIndex + 3];
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    static bool optimizerIsGLSLInstructionSet(const uint32_t *words, uint32_t setWordIndex) {
+        uint32_t setWordCount = (words[setWordIndex] >> 16U) & 0xFFFFU;
+        const char *setName = reinterpret_cast<const char *>(&words[setWordIndex + 2]);
+        return strncmp(setName, "GLSL.std.450", (setWordCount - 2) * sizeof(uint32_t)) == 0;
+    }
+
+    static bool optimizerFoldGLSLInteger(uint32_t instruction, const uint32_t *operands, uint32_t operandCount, uint32_t &result) {
+        // Only the integer instructions of GLSL.std.450 are folded, as they give the same result on every device.
+        const uint32_t GLSLstd450SAbs = 5;
+        const uint32_t GLSLstd450SSign = 7;
+        const uint32_t GLSLstd450UMin = 38;
+        const uint32_t GLSLstd450SMin = 39;
+        const uint32_t GLSLstd450UMax = 41;
+        const uint32_t GLSLstd450SMax = 42;
+        const uint32_t GLSLstd450UClamp = 44;
+        const uint32_t GLSLstd450SClamp = 45;
+        const uint32_t GLSLstd450FindILsb = 73;
+        const uint32_t GLSLstd450FindSMsb = 74;
+        const uint32_t GLSLstd450FindUMsb = 75;
+        uint32_t expectedOperandCount;
+        switch (instruction) {
+        case GLSLstd450SAbs:
+        case GLSLstd450SSign:
+        case GLSLstd450FindILsb:
+        case GLSLstd450FindSMsb:
+        case GLSLstd450FindUMsb:
+            expectedOperandCount = 1;
+            break;
+        case GLSLstd450UMin:
+        case GLSLstd450SMin:
+        case GLSLstd450UMax:
+        case GLSLstd450SMax:
+            expectedOperandCount = 2;
+            break;
+        case GLSLstd450UClamp:
+        case GLSLstd450SClamp:
+            expectedOperandCount = 3;
+            break;
+        default:
+            return false;
+        }
+
+        if (operandCount != expectedOperandCount) {
+            return false;
+        }
+
+        auto mostSignificantBit = [](uint32_t value) {
+            uint32_t index = 0;
+            while ((value >>= 1U) != 0) {
+                index++;
+            }
+
+            return index;
+        };
+
+        uint32_t x = operands[0];
+        int32_t signedX = int32_t(x);
+        switch (instruction) {
+        case GLSLstd450SAbs:
+            // The minimum value wraps around like it does with OpSNegate.
+            result = (signedX < 0) ? (0U - x) : x;
+            return true;
+        case GLSLstd450SSign:
+            result = uint32_t(int32_t(signedX > 0) - int32_t(signedX < 0));
+            return true;
+        case GLSLstd450UMin:
+            result = std::min(x, operands[1]);
+            return true;
+        case GLSLstd450SMin:
+            result = uint32_t(std::min(signedX, int32_t(operands[1])));
+            return true;
+        case GLSLstd450UMax:
+            result = std::max(x, operands[1]);
+            return true;
+        case GLSLstd450SMax:
+            result = uint32_t(std::max(signedX, int32_t(operands[1])));
+            return true;
+        case GLSLstd450UClamp:
+            // The result is undefined when the minimum is greater than the maximum.
+            if (operands[1] > operands[2]) {
+                return false;
+            }
+
+            result = std::min(std::max(x, operands[1]), operands[2]);
+            return true;
+        case GLSLstd450SClamp:
+            if (int32_t(operands[1]) > int32_t(operands[2])) {
+                return false;
+            }
+
+            result = uint32_t(std::min(std::max(signedX, int32_t(operands[1])), int32_t(operands[2])));
+            return true;
+        case GLSLstd450FindILsb:
+            // The bit searches return -1 when there's no bit to be found.
+            result = (x == 0) ? UINT32_MAX : mostSignificantBit(x & (0U - x));
+            return true;
+        case GLSLstd450FindSMsb: {
+            // Negative values look for the most significant 0 bit instead.
+            uint32_t value = (signedX < 0) ? ~x : x;
+            result = (value == 0) ? UINT32_MAX : mostSignificantBit(value);
+            return true;
+        }
+        case GLSLstd450FindUMsb:
+            result = (x == 0) ? UINT32_MAX : mostSignificantBit(x);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static void optimizerEvaluateResult(uint32_t resultId, OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        const Result &result = c.shader.results[resultId];
+        Resolution &resolution = optimizerResolution(resultId, c);
+        uint32_t resultWordIndex = c.shader.instructions[result.instructionIndex].wordIndex;
+        SpvOp opCode = SpvOp(optimizedWords[resultWordIndex] & 0xFFFFU);
+        uint32_t wordCount = (optimizedWords[resultWordIndex] >> 16U) & 0xFFFFU;
+        switch (opCode) {
+        case SpvOpConstant: {
+            // Parse the known type of constants. Any other types will be considered as variable.
+            const Result &typeResult = c.shader.results[optimizedWords[resultWordIndex + 1]];
+            uint32_t typeWordIndex = c.shader.instructions[typeResult.instructionIndex].wordIndex;
+            SpvOp typeOpCode = SpvOp(optimizedWords[typeWordIndex] & 0xFFFFU);
+            uint32_t typeWidthInBits = optimizedWords[typeWordIndex + 2];
+            uint32_t typeSigned = optimizedWords[typeWordIndex + 3];
+            if ((typeOpCode == SpvOpTypeInt) && (typeWidthInBits == 32)) {
+                if (typeSigned) {
+                    resolution = Resolution::fromInt32(int32_t(optimizedWords[resultWordIndex + 3]));
+                }
+                else {
+                    resolution = Resolution::fromUint32(optimizedWords[resultWordIndex + 3]);
+                }
+            }
+            else {
+                resolution.type = Resolution::Type::Variable;
+            }
+
+            break;
+        }
+        case SpvOpConstantTrue:
+            resolution = Resolution::fromBool(true);
+            break;
+        case SpvOpConstantFalse:
+            resolution = Resolution::fromBool(false);
+            break;
+        case SpvOpCopyObject:
+            resolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            break;
+        case SpvOpBitcast: {
+            const Resolution &operandResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            resolution = Resolution::fromUint32(operandResolution.value.u32);
+            break;
+        }
+        case SpvOpIAdd: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromUint32(firstResolution.value.u32 + secondResolution.value.u32);
+            break;
+        }
+        case SpvOpISub: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromUint32(firstResolution.value.u32 - secondResolution.value.u32);
+            break;
+        }
+        case SpvOpIMul: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
             resolution = Resolution::fromUint32(firstResolution.value.u32 * secondResolution.value.u32);
             break;
         }
-        case SpvOpUDiv: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.u32 / secondResolution.value.u32);
-            break;
+        case SpvOpUDiv: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (secondResolution.value.u32 == 0) {
+                // Division by zero is undefined, so it's left to be resolved at runtime.
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromUint32(firstResolution.value.u32 / secondResolution.value.u32);
+            }
+
+            break;
+        }
+        case SpvOpSDiv: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (optimizerIsSignedDivisionUndefined(firstResolution.value.i32, secondResolution.value.i32)) {
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromInt32(firstResolution.value.i32 / secondResolution.value.i32);
+            }
+
+            break;
+        }
+        case SpvOpUMod: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (secondResolution.value.u32 == 0) {
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromUint32(firstResolution.value.u32 % secondResolution.value.u32);
+            }
+
+            break;
+        }
+        case SpvOpSRem: {
+            // The sign of the result matches the first operand, which is the behavior of the C++ operator.
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (optimizerIsSignedDivisionUndefined(firstResolution.value.i32, secondResolution.value.i32)) {
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromInt32(firstResolution.value.i32 % secondResolution.value.i32);
+            }
+
+            break;
+        }
+        case SpvOpSMod: {
+            // The sign of the result matches the second operand.
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (optimizerIsSignedDivisionUndefined(firstResolution.value.i32, secondResolution.value.i32)) {
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                int32_t remainder = firstResolution.value.i32 % secondResolution.value.i32;
+                if ((remainder != 0) && ((remainder < 0) != (secondResolution.value.i32 < 0))) {
+                    remainder += secondResolution.value.i32;
+                }
+
+                resolution = Resolution::fromInt32(remainder);
+            }
+
+            break;
+        }
+        case SpvOpSNegate: {
+            // Negate as unsigned so the minimum value wraps around instead of overflowing.
+            const Resolution &operandResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            resolution = Resolution::fromUint32(0U - operandResolution.value.u32);
+            break;
+        }
+        case SpvOpLogicalEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) == (secondResolution.value.u32 != 0));
+            break;
+        }
+        case SpvOpLogicalNotEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) != (secondResolution.value.u32 != 0));
+            break;
+        }
+        case SpvOpLogicalOr: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) || (secondResolution.value.u32 != 0));
+            break;
+        }
+        case SpvOpLogicalAnd: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) && (secondResolution.value.u32 != 0));
+            break;
+        }
+        case SpvOpLogicalNot: {
+            const Resolution &operandResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            resolution = Resolution::fromBool(operandResolution.value.u32 == 0);
+            break;
+        }
+        case SpvOpSelect: {
+            const Resolution &conditionResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 5], c);
+            resolution = (conditionResolution.value.u32 != 0) ? firstResolution : secondResolution;
+            break;
+        }
+        case SpvOpIEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.u32 == secondResolution.value.u32);
+            break;
+        }
+        case SpvOpINotEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.u32 != secondResolution.value.u32);
+            break;
+        }
+        case SpvOpUGreaterThan: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.u32 > secondResolution.value.u32);
+            break;
+        }
+        case SpvOpSGreaterThan: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.i32 > secondResolution.value.i32);
+            break;
+        }
+        case SpvOpUGreaterThanEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.u32 >= secondResolution.value.u32);
+            break;
+        }
+        case SpvOpSGreaterThanEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.i32 >= secondResolution.value.i32);
+            break;
+        }
+        case SpvOpULessThan: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.u32 < secondResolution.value.u32);
+            break;
+        }
+        case SpvOpSLessThan: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.i32 < secondResolution.value.i32);
+            break;
+        }
+        case SpvOpULessThanEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.u32 <= secondResolution.value.u32);
+            break;
+        }
+        case SpvOpSLessThanEqual: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromBool(firstResolution.value.i32 <= secondResolution.value.i32);
+            break;
+        }
+        case SpvOpShiftRightLogical: {
+            const Resolution &baseResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &shiftResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (shiftResolution.value.u32 >= 32) {
+                // Shifting by the bit width or more is undefined.
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromUint32(baseResolution.value.u32 >> shiftResolution.value.u32);
+            }
+
+            break;
+        }
+        case SpvOpShiftRightArithmetic: {
+            const Resolution &baseResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &shiftResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (shiftResolution.value.u32 >= 32) {
+                // Shifting by the bit width or more is undefined.
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromInt32(baseResolution.value.i32 >> shiftResolution.value.u32);
+            }
+
+            break;
+        }
+        case SpvOpShiftLeftLogical: {
+            const Resolution &baseResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &shiftResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            if (shiftResolution.value.u32 >= 32) {
+                // Shifting by the bit width or more is undefined.
+                resolution.type = Resolution::Type::Variable;
+            }
+            else {
+                resolution = Resolution::fromUint32(baseResolution.value.u32 << shiftResolution.value.u32);
+            }
+
+            break;
+        }
+        case SpvOpBitwiseOr: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromUint32(firstResolution.value.u32 | secondResolution.value.u32);
+            break;
+        }
+        case SpvOpBitwiseAnd: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromUint32(firstResolution.value.u32 & secondResolution.value.u32);
+            break;
+        }
+        case SpvOpBitwiseXor: {
+            const Resolution &firstResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &secondResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            resolution = Resolution::fromUint32(firstResolution.value.u32 ^ secondResolution.value.u32);
+            break;
+        }
+        case SpvOpNot: {
+            const Resolution &operandResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            resolution = Resolution::fromUint32(~operandResolution.value.u32);
+            break;
+        }
+        case SpvOpBitFieldInsert: {
+            const Resolution &baseResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &insertResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            const Resolution &offsetResolution = optimizerResolution(optimizedWords[resultWordIndex + 5], c);
+            const Resolution &countResolution = optimizerResolution(optimizedWords[resultWordIndex + 6], c);
+            uint32_t mask;
+            if (optimizerBitFieldMask(offsetResolution.value.u32, countResolution.value.u32, mask)) {
+                uint32_t offset = offsetResolution.value.u32 & 31U;
+                resolution = Resolution::fromUint32((baseResolution.value.u32 & ~mask) | ((insertResolution.value.u32 << offset) & mask));
+            }
+            else {
+                resolution.type = Resolution::Type::Variable;
+            }
+
+            break;
+        }
+        case SpvOpBitFieldSExtract:
+        case SpvOpBitFieldUExtract: {
+            const Resolution &baseResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            const Resolution &offsetResolution = optimizerResolution(optimizedWords[resultWordIndex + 4], c);
+            const Resolution &countResolution = optimizerResolution(optimizedWords[resultWordIndex + 5], c);
+            uint32_t mask;
+            if (optimizerBitFieldMask(offsetResolution.value.u32, countResolution.value.u32, mask)) {
+                uint32_t count = countResolution.value.u32;
+                uint32_t field = (baseResolution.value.u32 & mask) >> (offsetResolution.value.u32 & 31U);
+                if ((opCode == SpvOpBitFieldSExtract) && (count > 0) && (count < 32) && ((field >> (count - 1)) & 1U)) {
+                    // Replicate the sign bit of the field into the upper bits.
+                    field |= ~((1U << count) - 1U);
+                }
+
+                resolution = Resolution::fromUint32(field);
+            }
+            else {
+                resolution.type = Resolution::Type::Variable;
+            }
+
+            break;
+        }
+        case SpvOpBitReverse: {
+            const Resolution &operandResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            uint32_t value = operandResolution.value.u32;
+            uint32_t reversed = 0;
+            for (uint32_t i = 0; i < 32; i++) {
+                reversed = (reversed << 1U) | ((value >> i) & 1U);
+            }
+
+            resolution = Resolution::fromUint32(reversed);
+            break;
+        }
+        case SpvOpBitCount: {
+            const Resolution &operandResolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            uint32_t value = operandResolution.value.u32;
+            uint32_t count = 0;
+            while (value != 0) {
+                value &= value - 1U;
+                count++;
+            }
+
+            resolution = Resolution::fromUint32(count);
+            break;
+        }
+        case SpvOpExtInstImport:
+            // The set is known ahead of time, so it doesn't keep the extended instructions that use it from being evaluated.
+            resolution = Resolution::fromUint32(0);
+            break;
+        case SpvOpExtInst: {
+            uint32_t setWordIndex = c.shader.instructions[c.shader.results[optimizedWords[resultWordIndex + 3]].instructionIndex].wordIndex;
+            uint32_t operandCount = wordCount - 5;
+            uint32_t operands[3] = {};
+            uint32_t value = 0;
+            for (uint32_t j = 0; (j < operandCount) && (j < 3); j++) {
+                operands[j] = optimizerResolution(optimizedWords[resultWordIndex + 5 + j], c).value.u32;
+            }
+
+            if (optimizerIsGLSLInstructionSet(optimizedWords, setWordIndex) && optimizerFoldGLSLInteger(optimizedWords[resultWordIndex + 4], operands, operandCount, value)) {
+                resolution = Resolution::fromUint32(value);
+            }
+            else {
+                resolution.type = Resolution::Type::Variable;
+            }
+
+            break;
+        }
+        case SpvOpPhi: {
+            // Resolve as constant if Phi operator was compacted to only one option. The option can come from the back edge of
+            // a loop, which isn't resolved yet.
+            if ((wordCount == 5) && (optimizerResolution(optimizedWords[resultWordIndex + 3], c).type != Resolution::Type::Unknown)) {
+                resolution = optimizerResolution(optimizedWords[resultWordIndex + 3], c);
+            }
+            else {
+                resolution.type = Resolution::Type::Variable;
+            }
+
+            break;
+        }
+        default:
+            // It's not known how to evaluate the instruction, consider the result a variable.
+            resolution.type = Resolution::Type::Variable;
+            break;
+        }
+    }
+
+    static bool optimizerFindDecoration(const Shader &shader, uint32_t targetId, uint32_t member, SpvDecoration decoration, uint32_t &value) {
+        // Decorations are users of their target, so only the adjacency of the target needs to be searched. Members are
+        // only matched when a member index is specified.
+        const uint32_t *shaderWords = shader.spirvWords;
+        uint32_t listIndex = shader.instructions[shader.results[targetId].instructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = shader.listNodes[listIndex];
+            uint32_t wordIndex = shader.instructions[listNode.instructionIndex].wordIndex;
+            SpvOp opCode = SpvOp(shaderWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (shaderWords[wordIndex] >> 16U) & 0xFFFFU;
+            if ((opCode == SpvOpDecorate) && (member == UINT32_MAX) && (shaderWords[wordIndex + 2] == decoration)) {
+                value = (wordCount > 3) ? shaderWords[wordIndex + 3] : 0;
+                return true;
+            }
+            else if ((opCode == SpvOpMemberDecorate) && (member != UINT32_MAX) && (shaderWords[wordIndex + 2] == member) && (shaderWords[wordIndex + 3] == decoration)) {
+                value = (wordCount > 4) ? shaderWords[wordIndex + 4] : 0;
+                return true;
+            }
+
+            listIndex = listNode.nextListIndex;
+        }
+
+        return false;
+    }
+
+    static bool optimizerEvaluateTableLoad(uint32_t resultId, uint32_t pointerWordIndex, const Variable &variable, OptimizerContext &c) {
+        // Walk the constituents of the initializer with the indices of the access chain.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        const uint32_t *shaderWords = c.shader.spirvWords;
+        SpvOp pointerOpCode = SpvOp(optimizedWords[pointerWordIndex] & 0xFFFFU);
+        uint32_t pointerWordCount = (optimizedWords[pointerWordIndex] >> 16U) & 0xFFFFU;
+        uint32_t elementId = shaderWords[c.shader.instructions[variable.instructionIndex].wordIndex + 4];
+        for (uint32_t i = (pointerOpCode == SpvOpAccessChain) ? 4 : pointerWordCount; i < pointerWordCount; i++) {
+            const Resolution &indexResolution = optimizerResolution(optimizedWords[pointerWordIndex + i], c);
+            if (indexResolution.type != Resolution::Type::Constant) {
+                return false;
+            }
+
+            uint32_t elementWordIndex = c.shader.instructions[c.shader.results[elementId].instructionIndex].wordIndex;
+            SpvOp elementOpCode = SpvOp(shaderWords[elementWordIndex] & 0xFFFFU);
+            uint32_t elementWordCount = (shaderWords[elementWordIndex] >> 16U) & 0xFFFFU;
+            if ((elementOpCode != SpvOpConstantComposite) || (indexResolution.value.u32 >= (elementWordCount - 3))) {
+                return false;
+            }
+
+            elementId = shaderWords[elementWordIndex + 3 + indexResolution.value.u32];
+        }
+
+        uint32_t value;
+        if (!optimizerConstantValue(c.shader, c.shader.results[elementId].instructionIndex, value)) {
+            return false;
+        }
+
+        optimizerResolution(resultId, c) = Resolution::fromUint32(value);
+        return true;
+    }
+
+    static bool optimizerEvaluateKnownLoad(uint32_t resultId, uint32_t pointerWordIndex, const Variable &variable, OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        const uint32_t *shaderWords = c.shader.spirvWords;
+        uint32_t variableWordIndex = c.shader.instructions[variable.instructionIndex].wordIndex;
+        uint32_t storageClass = shaderWords[variableWordIndex + 3];
+        KnownValue::Source source;
+        if (storageClass == SpvStorageClassUniform) {
+            source = KnownValue::Source::UniformBuffer;
+        }
+        else if (storageClass == SpvStorageClassPushConstant) {
+            source = KnownValue::Source::PushConstant;
+        }
+        else {
+            return false;
+        }
+
+        // Blocks in the Uniform storage class that aren't decorated as such are storage buffers, which can be written to.
+        uint32_t typeId = shaderWords[c.shader.instructions[c.shader.results[shaderWords[variableWordIndex + 1]].instructionIndex].wordIndex + 3];
+        uint32_t decorationValue;
+        if ((source == KnownValue::Source::UniformBuffer) && !optimizerFindDecoration(c.shader, typeId, UINT32_MAX, SpvDecorationBlock, decorationValue)) {
+            return false;
+        }
+
+        // Compute the offset of the element from the layout decorations of the types the access chain goes through.
+        SpvOp pointerOpCode = SpvOp(optimizedWords[pointerWordIndex] & 0xFFFFU);
+        uint32_t pointerWordCount = (optimizedWords[pointerWordIndex] >> 16U) & 0xFFFFU;
+        uint64_t offset = 0;
+        for (uint32_t i = (pointerOpCode == SpvOpAccessChain) ? 4 : pointerWordCount; i < pointerWordCount; i++) {
+            const Resolution &indexResolution = optimizerResolution(optimizedWords[pointerWordIndex + i], c);
+            if (indexResolution.type != Resolution::Type::Constant) {
+                return false;
+            }
+
+            uint32_t index = indexResolution.value.u32;
+            uint32_t typeWordIndex = c.shader.instructions[c.shader.results[typeId].instructionIndex].wordIndex;
+            SpvOp typeOpCode = SpvOp(shaderWords[typeWordIndex] & 0xFFFFU);
+            uint32_t typeWordCount = (shaderWords[typeWordIndex] >> 16U) & 0xFFFFU;
+            switch (typeOpCode) {
+            case SpvOpTypeStruct:
+                if ((index >= (typeWordCount - 2)) || !optimizerFindDecoration(c.shader, typeId, index, SpvDecorationOffset, decorationValue)) {
+                    return false;
+                }
+
+                offset += decorationValue;
+                typeId = shaderWords[typeWordIndex + 2 + index];
+                break;
+            case SpvOpTypeArray:
+            case SpvOpTypeRuntimeArray:
+                if (!optimizerFindDecoration(c.shader, typeId, UINT32_MAX, SpvDecorationArrayStride, decorationValue)) {
+                    return false;
+                }
+
+                offset += uint64_t(index) * decorationValue;
+                typeId = shaderWords[typeWordIndex + 2];
+                break;
+            case SpvOpTypeVector:
+                // Only vectors of 32-bit components can reach the final type check below.
+                offset += uint64_t(index) * sizeof(uint32_t);
+                typeId = shaderWords[typeWordIndex + 2];
+                break;
+            default:
+                return false;
+            }
+        }
+
+        uint32_t typeWordIndex = c.shader.instructions[c.shader.results[typeId].instructionIndex].wordIndex;
+        if ((SpvOp(shaderWords[typeWordIndex] & 0xFFFFU) != SpvOpTypeInt) || (shaderWords[typeWordIndex + 2] != 32) || (offset > UINT32_MAX)) {
+            return false;
+        }
+
+        for (const KnownValue &knownValue : c.options->knownValues) {
+            if ((knownValue.source != source) || (knownValue.offset != offset)) {
+                continue;
+            }
+
+            if ((source == KnownValue::Source::UniformBuffer) && ((knownValue.descriptorSet != variable.descriptorSet) || (knownValue.binding != variable.binding))) {
+                continue;
+            }
+
+            optimizerResolution(resultId, c) = Resolution::fromUint32(knownValue.value);
+            return true;
+        }
+
+        return false;
+    }
+
+    static bool optimizerBranchesTo(uint32_t labelInstructionIndex, uint32_t targetLabelId, OptimizerContext &c) {
+        // While the label may not have been eliminated, verify its terminator is still pointing to the target.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = c.shader.instructions.size();
+        for (uint32_t i = labelInstructionIndex; i < instructionCount; i++) {
+            uint32_t searchWordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp searchOpCode = SpvOp(optimizedWords[searchWordIndex] & 0xFFFFU);
+            uint32_t searchWordCount = (optimizedWords[searchWordIndex] >> 16U) & 0xFFFFU;
+            if (SpvOpIsTerminator(searchOpCode)) {
+                uint32_t labelWordStart, labelWordCount, labelWordStride;
+                if (SpvHasLabels(searchOpCode, labelWordStart, labelWordCount, labelWordStride)) {
+                    for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < searchWordCount); j++) {
+                        if (optimizedWords[searchWordIndex + labelWordStart + j * labelWordStride] == targetLabelId) {
+                            return true;
+                        }
+                    }
+                }
+
+                return false;
+            }
+        }
+
+        return false;
+    }
+
+    static bool optimizerEvaluateLocalLoad(uint32_t resultId, const LocalLoad &localLoad, OptimizerContext &c) {
+        // Values that come from predecessors that no longer branch to the block of the load are ignored. The load can be
+        // solved if all the remaining values are the same constant.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        Resolution resolution;
+        for (uint32_t i = localLoad.valueIndex; i < (localLoad.valueIndex + localLoad.valueCount); i++) {
+            const LocalValue &localValue = c.shader.localValues[i];
+            if (localValue.labelId != UINT32_MAX) {
+                uint32_t labelInstructionIndex = c.shader.results[localValue.labelId].instructionIndex;
+                if ((optimizedWords[c.shader.instructions[labelInstructionIndex].wordIndex] == UINT32_MAX) || !optimizerBranchesTo(labelInstructionIndex, localLoad.mergeLabelId, c)) {
+                    continue;
+                }
+            }
+
+            const Resolution &valueResolution = optimizerResolution(localValue.resultId, c);
+            if (valueResolution.type != Resolution::Type::Constant) {
+                return false;
+            }
+            else if (resolution.type == Resolution::Type::Unknown) {
+                resolution = valueResolution;
+            }
+            else if (valueResolution.value.u32 != resolution.value.u32) {
+                return false;
+            }
+        }
+
+        if (resolution.type == Resolution::Type::Unknown) {
+            return false;
+        }
+
+        optimizerResolution(resultId, c) = resolution;
+        return true;
+    }
+
+    static bool optimizerEvaluateLoad(uint32_t wordIndex, OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t resultId = optimizedWords[wordIndex + 2];
+        uint32_t localLoadIndex = c.shader.findLocalLoad(c.shader.results[resultId].instructionIndex);
+        if ((localLoadIndex != UINT32_MAX) && optimizerEvaluateLocalLoad(resultId, c.shader.localLoads[localLoadIndex], c)) {
+            return true;
+        }
+
+        // The pointer must be a variable or an access chain into one.
+        uint32_t pointerIndex = c.shader.results[optimizedWords[wordIndex + 3]].instructionIndex;
+        uint32_t pointerWordIndex = c.shader.instructions[pointerIndex].wordIndex;
+        SpvOp pointerOpCode = SpvOp(optimizedWords[pointerWordIndex] & 0xFFFFU);
+        uint32_t variableIndex = pointerIndex;
+        if (pointerOpCode == SpvOpAccessChain) {
+            variableIndex = c.shader.results[optimizedWords[pointerWordIndex + 3]].instructionIndex;
+        }
+        else if (pointerOpCode != SpvOpVariable) {
+            return false;
+        }
+
+        uint32_t variablePosition = c.shader.findVariable(variableIndex);
+        if (variablePosition == UINT32_MAX) {
+            return false;
+        }
+
+        const Variable &variable = c.shader.variables[variablePosition];
+        if (variable.constantTable) {
+            return optimizerEvaluateTableLoad(resultId, pointerWordIndex, variable, c);
+        }
+        else if ((c.options != nullptr) && !c.options->knownValues.empty()) {
+            return optimizerEvaluateKnownLoad(resultId, pointerWordIndex, variable, c);
+        }
+        else {
+            return false;
+        }
+    }
+
+    static void optimizerPushOperands(uint32_t wordIndex, std::vector<uint32_t> &resultStack, OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+        bool operandWordSkipString;
+        if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+            uint32_t operandWordIndex = operandWordStart;
+            for (uint32_t j = 0; j < operandWordCount; j++) {
+                if (checkOperandWordSkip(wordIndex, optimizedWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                    continue;
+                }
+
+                if (operandWordIndex >= wordCount) {
+                    break;
+                }
+
+                uint32_t operandId = optimizedWords[wordIndex + operandWordIndex];
+                resultStack.emplace_back(operandId);
+                operandWordIndex += operandWordStride;
+            }
+        }
+    }
+
+    static bool optimizerEliminateUnreachableLoop(uint32_t labelInstructionIndex, std::vector<uint32_t> &labelStack, std::vector<uint32_t> &resultStack, OptimizerContext &c) {
+        // The back edges of a loop keep the degree of its header above zero after every way into the loop is gone. When
+        // the only references left to the header come from inside of the loop, everything from the header up to the merge
+        // block is eliminated.
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        uint32_t mergeLabelId = UINT32_MAX;
+        for (uint32_t i = labelInstructionIndex + 1; (i < instructionCount) && (mergeLabelId == UINT32_MAX); i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+            else if (opCode == SpvOpLoopMerge) {
+                mergeLabelId = optimizedWords[wordIndex + 1];
+            }
+            else if (SpvOpIsTerminator(opCode)) {
+                return false;
+            }
+        }
+
+        if (mergeLabelId == UINT32_MAX) {
+            return false;
+        }
+
+        uint32_t labelId = optimizedWords[c.shader.instructions[labelInstructionIndex].wordIndex + 1];
+        uint32_t mergeInstructionIndex = c.shader.results[mergeLabelId].instructionIndex;
+        uint32_t loopReferenceCount = 0;
+        for (uint32_t i = labelInstructionIndex; i < mergeInstructionIndex; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            uint32_t labelWordStart, labelWordCount, labelWordStride;
+            if ((optimizedWords[wordIndex] != UINT32_MAX) && SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+                for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                    loopReferenceCount += (optimizedWords[wordIndex + labelWordStart + j * labelWordStride] == labelId);
+                }
+            }
+        }
+
+        if (optimizerInDegree(labelInstructionIndex, c) != loopReferenceCount) {
+            return false;
+        }
+
+        // Only the labels outside of the loop need their degrees reduced. The labels inside of it are left without any
+        // references so they're skipped if they're still in the stack.
+        for (uint32_t i = labelInstructionIndex; i < mergeInstructionIndex; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            uint32_t labelWordStart, labelWordCount, labelWordStride;
+            if (opCode == SpvOpLabel) {
+                optimizerInDegree(i, c) = 0;
+            }
+            else if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+                for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                    uint32_t targetLabelId = optimizedWords[wordIndex + labelWordStart + j * labelWordStride];
+                    uint32_t targetInstructionIndex = c.shader.results[targetLabelId].instructionIndex;
+                    if ((targetInstructionIndex < labelInstructionIndex) || (targetInstructionIndex >= mergeInstructionIndex)) {
+                        labelStack.emplace_back(targetLabelId);
+                    }
+                }
+            }
+
+            optimizerPushOperands(wordIndex, resultStack, c);
+            optimizerEliminateInstruction(i, c);
+        }
+
+        return true;
+    }
+
+    static void optimizerReduceLabelDegree(uint32_t firstLabelId, OptimizerContext &c) {
+        thread_local std::vector<uint32_t> labelStack;
+        thread_local std::vector<uint32_t> resultStack;
+        thread_local std::vector<uint32_t> degreeReductions;
+        labelStack.emplace_back(firstLabelId);
+        resultStack.clear();
+        degreeReductions.clear();
+
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        while (!labelStack.empty()) {
+            uint32_t labelId = labelStack.back();
+            labelStack.pop_back();
+
+            uint32_t instructionIndex = c.shader.results[labelId].instructionIndex;
+            if (optimizerInDegree(instructionIndex, c) == 0) {
+                continue;
+            }
+
+            optimizerInDegree(instructionIndex, c)--;
+            if ((optimizerInDegree(instructionIndex, c) > 0) && optimizerEliminateUnreachableLoop(instructionIndex, labelStack, resultStack, c)) {
+                continue;
+            }
+
+            // If a label's degree becomes 0, eliminate all the instructions of the block.
+            // Eliminate as many instructions as possible until finding the terminator of the block.
+            // When finding the terminator, look at the labels it has and push them to the stack to
+            // reduce their degrees as well.
+            if (optimizerInDegree(instructionIndex, c) == 0) {
+                bool foundTerminator = false;
+                uint32_t instructionCount = c.shader.instructions.size();
+                for (uint32_t i = instructionIndex; (i < instructionCount) && !foundTerminator; i++) {
+                    uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+                    if (optimizedWords[wordIndex] == UINT32_MAX) {
+                        continue;
+                    }
+
+                    // If the instruction has labels it can reference, we push the labels to reduce their degrees as well.
+                    SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+                    uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+                    uint32_t labelWordStart, labelWordCount, labelWordStride;
+                    if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+                        for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                            uint32_t terminatorLabelId = optimizedWords[wordIndex + labelWordStart + j * labelWordStride];
+                            labelStack.emplace_back(terminatorLabelId);
+                        }
+                    }
+
+                    // If the instruction has operands, decrease their degree.
+                    optimizerPushOperands(wordIndex, resultStack, c);
+                    foundTerminator = SpvOpIsTerminator(opCode);
+                    optimizerEliminateInstruction(i, c);
+                }
+            }
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+    }
+
+    static void optimizerReduceArmDegree(uint32_t armLabelId, OptimizerContext &c) {
+        // When the branch of the header is the last reference to the arm, the whole region is eliminated in one go.
+        // Otherwise the degree of the label is reduced as usual.
+        uint32_t labelInstructionIndex = c.shader.results[armLabelId].instructionIndex;
+        uint32_t regionIndex = c.shader.findRegion(labelInstructionIndex);
+        if ((regionIndex == UINT32_MAX) || (optimizerInDegree(labelInstructionIndex, c) != 1)) {
+            optimizerReduceLabelDegree(armLabelId, c);
+            return;
+        }
+
+        // Only references to labels outside of the region need their degrees reduced.
+        const Region &region = c.shader.regions[regionIndex];
+        thread_local std::vector<uint32_t> labelIds;
+        thread_local std::vector<uint32_t> resultStack;
+        labelIds.clear();
+        resultStack.clear();
+
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        for (uint32_t i = region.labelInstructionIndex; i < region.endInstructionIndex; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            uint32_t labelWordStart, labelWordCount, labelWordStride;
+            if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
+                for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                    uint32_t labelId = optimizedWords[wordIndex + labelWordStart + j * labelWordStride];
+                    uint32_t labelIndex = c.shader.results[labelId].instructionIndex;
+                    if ((labelIndex < region.labelInstructionIndex) || (labelIndex >= region.endInstructionIndex)) {
+                        labelIds.emplace_back(labelId);
+                    }
+                }
+            }
+            else if (opCode == SpvOpLabel) {
+                optimizerInDegree(i, c) = 0;
+            }
+
+            optimizerEliminateInstructionAndOperands(i, c, resultStack);
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+
+        for (uint32_t labelId : labelIds) {
+            optimizerReduceLabelDegree(labelId, c);
+        }
+    }
+
+    static uint32_t optimizerKnownZeroBits(uint32_t resultId, uint32_t depth, OptimizerContext &c) {
+        // Find the bits of a 32-bit integer that are known to be zero even if its value isn't known.
+        const Resolution &resolution = optimizerResolution(resultId, c);
+        if (resolution.type == Resolution::Type::Constant) {
+            return ~resolution.value.u32;
+        }
+
+        const uint32_t maxDepth = 8;
+        if ((depth >= maxDepth) || (resultId >= c.shader.results.size())) {
+            return 0;
+        }
+
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t wordIndex = c.shader.instructions[c.shader.results[resultId].instructionIndex].wordIndex;
+        if (optimizedWords[wordIndex] == UINT32_MAX) {
+            return 0;
+        }
+
+        auto constantOperand = [&](uint32_t operandId, uint32_t &value) {
+            const Resolution &operandResolution = optimizerResolution(operandId, c);
+            value = operandResolution.value.u32;
+            return operandResolution.type == Resolution::Type::Constant;
+        };
+
+        SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+        uint32_t value = 0;
+        switch (opCode) {
+        case SpvOpBitwiseAnd:
+            return optimizerKnownZeroBits(optimizedWords[wordIndex + 3], depth + 1, c) | optimizerKnownZeroBits(optimizedWords[wordIndex + 4], depth + 1, c);
+        case SpvOpBitwiseOr:
+        case SpvOpBitwiseXor:
+            return optimizerKnownZeroBits(optimizedWords[wordIndex + 3], depth + 1, c) & optimizerKnownZeroBits(optimizedWords[wordIndex + 4], depth + 1, c);
+        case SpvOpSelect:
+            return optimizerKnownZeroBits(optimizedWords[wordIndex + 4], depth + 1, c) & optimizerKnownZeroBits(optimizedWords[wordIndex + 5], depth + 1, c);
+        case SpvOpShiftRightLogical:
+            if (constantOperand(optimizedWords[wordIndex + 4], value) && (value < 32)) {
+                return (optimizerKnownZeroBits(optimizedWords[wordIndex + 3], depth + 1, c) >> value) | ~(UINT32_MAX >> value);
+            }
+
+            return 0;
+        case SpvOpShiftLeftLogical:
+            if (constantOperand(optimizedWords[wordIndex + 4], value) && (value < 32)) {
+                return (optimizerKnownZeroBits(optimizedWords[wordIndex + 3], depth + 1, c) << value) | ((1U << value) - 1U);
+            }
+
+            return 0;
+        case SpvOpUMod:
+            // The remainder can't be larger than the divisor minus one.
+            if (constantOperand(optimizedWords[wordIndex + 4], value) && (value != 0)) {
+                uint32_t mask = 0;
+                while (mask < (value - 1U)) {
+                    mask = (mask << 1U) | 1U;
+                }
+
+                return ~mask | optimizerKnownZeroBits(optimizedWords[wordIndex + 3], depth + 1, c);
+            }
+
+            return 0;
+        case SpvOpBitFieldUExtract:
+            if (constantOperand(optimizedWords[wordIndex + 5], value) && (value < 32)) {
+                return ~((1U << value) - 1U);
+            }
+
+            return 0;
+        default:
+            return 0;
+        }
+    }
+
+    static void optimizerSimplifySwitch(uint32_t instructionIndex, OptimizerContext &c) {
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        uint32_t selectorId = optimizedWords[wordIndex + 1];
+        uint32_t defaultLabelId = optimizedWords[wordIndex + 2];
+        if ((wordCount <= 3) || (selectorId >= c.shader.results.size())) {
+            return;
+        }
+
+        // Only selectors of 32-bit integers are supported, as the width of the literals depends on it.
+        uint32_t selectorWordIndex = c.shader.instructions[c.shader.results[selectorId].instructionIndex].wordIndex;
+        bool hasResult, hasType;
+        SpvHasResultAndType(SpvOp(optimizedWords[selectorWordIndex] & 0xFFFFU), &hasResult, &hasType);
+        if (!hasType) {
+            return;
+        }
+
+        uint32_t selectorTypeId = optimizedWords[selectorWordIndex + 1];
+        uint32_t selectorTypeWordIndex = c.shader.instructions[c.shader.results[selectorTypeId].instructionIndex].wordIndex;
+        if ((SpvOp(optimizedWords[selectorTypeWordIndex] & 0xFFFFU) != SpvOpTypeInt) || (optimizedWords[selectorTypeWordIndex + 2] != 32)) {
+            return;
+        }
+
+        // Cases that branch to the default label are redundant, and cases the selector can't match given the bits of it that
+        // are known to be zero can never be taken.
+        thread_local std::vector<uint32_t> removedLabelIds;
+        removedLabelIds.clear();
+
+        uint32_t knownZeroBits = optimizerKnownZeroBits(selectorId, 0, c);
+        uint32_t caseLabelId = UINT32_MAX;
+        bool singleCaseLabel = true;
+        uint32_t caseWordCount = 3;
+        for (uint32_t i = 3; (i + 1) < wordCount; i += 2) {
+            uint32_t literal = optimizedWords[wordIndex + i];
+            uint32_t labelId = optimizedWords[wordIndex + i + 1];
+            if ((labelId == defaultLabelId) || ((literal & knownZeroBits) != 0)) {
+                removedLabelIds.emplace_back(labelId);
+                continue;
+            }
+
+            singleCaseLabel = singleCaseLabel && ((caseLabelId == UINT32_MAX) || (caseLabelId == labelId));
+            caseLabelId = labelId;
+            optimizedWords[wordIndex + caseWordCount] = literal;
+            optimizedWords[wordIndex + caseWordCount + 1] = labelId;
+            caseWordCount += 2;
+        }
+
+        // When only one other label remains, the switch is converted to a conditional branch that compares the selector
+        // against the literals of its cases.
+        const uint32_t maxConvertedCaseCount = 4;
+        uint32_t caseCount = (caseWordCount - 3) / 2;
+        bool convertToBranch = (caseCount > 0) && (caseCount <= maxConvertedCaseCount) && singleCaseLabel;
+        if (removedLabelIds.empty() && !convertToBranch) {
+            return;
+        }
+
+        thread_local std::vector<uint32_t> resultStack;
+        resultStack.clear();
+        if (convertToBranch) {
+            uint32_t selectorInstructionIndex = c.shader.results[selectorId].instructionIndex;
+            uint32_t boolTypeId = optimizerBoolType(c);
+            uint32_t conditionId = UINT32_MAX;
+            thread_local std::vector<uint32_t> conditionWords;
+            conditionWords.clear();
+            for (uint32_t i = 0; i < caseCount; i++) {
+                uint32_t literalId = optimizerIntConstant(selectorTypeId, optimizedWords[wordIndex + 3 + i * 2], c);
+                uint32_t equalId = optimizerReserveResult(c);
+                conditionWords.insert(conditionWords.end(), { SpvOpIEqual | (5U << 16U), boolTypeId, equalId, selectorId, literalId });
+                if (conditionId == UINT32_MAX) {
+                    conditionId = equalId;
+                }
+                else {
+                    uint32_t orId = optimizerReserveResult(c);
+                    conditionWords.insert(conditionWords.end(), { SpvOpLogicalOr | (5U << 16U), boolTypeId, orId, conditionId, equalId });
+                    conditionId = orId;
+                }
+
+                // Every comparison uses the selector while the switch only used it once, and the case label is only
+                // referenced once by the conditional branch.
+                if (i > 0) {
+                    optimizerOutDegree(selectorInstructionIndex, c)++;
+                    removedLabelIds.emplace_back(caseLabelId);
+                }
+            }
+
+            // The comparisons must be placed before the merge instruction that precedes the branch.
+            uint32_t anchorInstructionIndex = instructionIndex;
+            if ((instructionIndex > 0) && (SpvOp(optimizedWords[c.shader.instructions[instructionIndex - 1].wordIndex] & 0xFFFFU) == SpvOpSelectionMerge)) {
+                anchorInstructionIndex = instructionIndex - 1;
+            }
+
+            optimizerInsertBefore(anchorInstructionIndex, conditionWords.data(), uint32_t(conditionWords.size()), c);
+            optimizedWords[wordIndex] = SpvOpBranchConditional | (4U << 16U);
+            optimizedWords[wordIndex + 1] = conditionId;
+            optimizedWords[wordIndex + 2] = caseLabelId;
+            optimizedWords[wordIndex + 3] = defaultLabelId;
+            caseWordCount = 4;
+        }
+        else if (caseCount == 0) {
+            // The default label is always taken, so the selector is replaced like when the switch is folded.
+            uint32_t defaultConstantId = optimizerResolveLeader(c.shader.defaultSwitchOpConstantInt, c);
+            optimizedWords[wordIndex + 1] = defaultConstantId;
+            optimizerOutDegree(c.shader.results[defaultConstantId].instructionIndex, c)++;
+            resultStack.emplace_back(selectorId);
+        }
+
+        if (!convertToBranch) {
+            optimizedWords[wordIndex] = SpvOpSwitch | (caseWordCount << 16U);
+        }
+
+        for (uint32_t i = wordIndex + caseWordCount; i < (wordIndex + wordCount); i++) {
+            optimizedWords[i] = UINT32_MAX;
+        }
+
+        c.changeCount++;
+
+        for (uint32_t labelId : removedLabelIds) {
+            optimizerReduceLabelDegree(labelId, c);
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+    }
+
+    static void optimizerEvaluateTerminator(uint32_t instructionIndex, OptimizerContext &c) {
+        // For each type of supported terminator, check if the operands can be resolved into constants.
+        // If they can be resolved, eliminate any other branches that don't pass the condition.
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        uint32_t defaultLabelId = UINT32_MAX;
+
+        // Both instructions share that the second word is the operator they must use to resolve the condition.
+        // Operator can't be anything but a constant to be able to resolve a terminator.
+        const uint32_t operatorId = optimizedWords[wordIndex + 1];
+        const Resolution &operatorResolution = optimizerResolution(operatorId, c);
+        if (operatorResolution.type != Resolution::Type::Constant) {
+            if (opCode == SpvOpSwitch) {
+                optimizerSimplifySwitch(instructionIndex, c);
+            }
+
+            return;
+        }
+        else if ((opCode == SpvOpSwitch) && (wordCount <= 3)) {
+            // The switch has already been folded to its default label.
+            return;
+        }
+
+        if (opCode == SpvOpBranchConditional) {
+            // Branch conditional only needs to choose either label depending on whether the result is true or false.
+            if (operatorResolution.value.u32) {
+                defaultLabelId = optimizedWords[wordIndex + 2];
+                optimizerReduceArmDegree(optimizedWords[wordIndex + 3], c);
+            }
+            else {
+                defaultLabelId = optimizedWords[wordIndex + 3];
+                optimizerReduceArmDegree(optimizedWords[wordIndex + 2], c);
+            }
+
+            // If there's a selection merge before this branch, we place the unconditional branch in its place. A loop merge is
+            // kept, as the header of a loop can still end with an unconditional branch.
+            uint32_t mergeWordIndex = c.shader.instructions[instructionIndex - 1].wordIndex;
+            SpvOp mergeOpCode = SpvOp(optimizedWords[mergeWordIndex] & 0xFFFFU);
+
+            uint32_t patchWordIndex;
+            if (mergeOpCode == SpvOpSelectionMerge) {
+                optimizerReduceLabelDegree(optimizedWords[mergeWordIndex + 1], c);
+                patchWordIndex = mergeWordIndex;
+            }
+            else {
+                patchWordIndex = wordIndex;
+            }
+
+            // Make the final label the new default case and reduce the word count.
+            optimizedWords[patchWordIndex] = SpvOpBranch | (2U << 16U);
+            optimizedWords[patchWordIndex + 1] = defaultLabelId;
+
+            // Eliminate any remaining words on the block.
+            for (uint32_t i = patchWordIndex + 2; i < (wordIndex + wordCount); i++) {
+                optimizedWords[i] = UINT32_MAX;
+            }
+        }
+        else if (opCode == SpvOpSwitch) {
+            // Switch must compare the integer result of the operator to all the possible labels.
+            // If the label is not as possible result, then reduce its block's degree.
+            for (uint32_t i = 3; i < wordCount; i += 2) {
+                if (operatorResolution.value.u32 == optimizedWords[wordIndex + i]) {
+                    defaultLabelId = optimizedWords[wordIndex + i + 1];
+                }
+                else {
+                    optimizerReduceLabelDegree(optimizedWords[wordIndex + i + 1], c);
+                }
+            }
+
+            // If none are chosen, the default label is selected. Otherwise, reduce the block's degree
+            // for the default label.
+            if (defaultLabelId == UINT32_MAX) {
+                defaultLabelId = optimizedWords[wordIndex + 2];
+            }
+            else {
+                optimizerReduceLabelDegree(optimizedWords[wordIndex + 2], c);
+            }
+
+            // Make the final label the new default case and reduce the word count.
+            optimizedWords[wordIndex] = SpvOpSwitch | (3U << 16U);
+
+            // The default constant might have been merged into an identical one already.
+            uint32_t defaultConstantId = optimizerResolveLeader(c.shader.defaultSwitchOpConstantInt, c);
+            optimizedWords[wordIndex + 1] = defaultConstantId;
+            optimizedWords[wordIndex + 2] = defaultLabelId;
+
+            // Increase the degree of the default constant that was chosen so it's not considered as dead code.
+            uint32_t defaultConstantInstructionIndex = c.shader.results[defaultConstantId].instructionIndex;
+            optimizerOutDegree(defaultConstantInstructionIndex, c)++;
+
+            // Eliminate any remaining words on the block.
+            for (uint32_t i = wordIndex + 3; i < (wordIndex + wordCount); i++) {
+                optimizedWords[i] = UINT32_MAX;
+            }
+        }
+
+        c.changeCount++;
+
+        // The condition operator can be discarded.
+        thread_local std::vector<uint32_t> resultStack;
+        resultStack.clear();
+        resultStack.emplace_back(operatorId);
+        optimizerReduceResultDegrees(c, resultStack);
+    }
+
+    static bool optimizerCompactPhi(uint32_t instructionIndex, OptimizerContext &c) {
+        // Do a backwards search first to find out what label this instruction belongs to.
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t searchInstructionIndex = instructionIndex;
+        uint32_t instructionLabelId = UINT32_MAX;
+        while (searchInstructionIndex > 0) {
+            uint32_t searchWordIndex = c.shader.instructions[searchInstructionIndex].wordIndex;
+            SpvOp searchOpCode = SpvOp(optimizedWords[searchWordIndex] & 0xFFFFU);
+            if (searchOpCode == SpvOpLabel) {
+                instructionLabelId = optimizedWords[searchWordIndex + 1];
+                break;
+            }
+
+            searchInstructionIndex--;
+        }
+
+        if (instructionLabelId == UINT32_MAX) {
+            fprintf(stderr, "Unable to find a label before OpPhi.\n");
+            return false;
+        }
+
+        thread_local std::vector<uint32_t> resultStack;
+        resultStack.clear();
+
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        uint32_t newWordCount = 3;
+        for (uint32_t i = 3; i < wordCount; i += 2) {
+            uint32_t labelId = optimizedWords[wordIndex + i + 1];
+            uint32_t labelInstructionIndex = c.shader.results[labelId].instructionIndex;
+            uint32_t labelWordIndex = c.shader.instructions[labelInstructionIndex].wordIndex;
+
+            // Label's been eliminated. Skip it.
+            if (optimizedWords[labelWordIndex] == UINT32_MAX) {
+                resultStack.emplace_back(optimizedWords[wordIndex + i]);
+                continue;
+            }
+
+            // The preceding block did not have any reference to this block. Skip it.
+            if (!optimizerBranchesTo(labelInstructionIndex, instructionLabelId, c)) {
+                resultStack.emplace_back(optimizedWords[wordIndex + i]);
+                continue;
+            }
+
+            // Copy the words.
+            optimizedWords[wordIndex + newWordCount + 0] = optimizedWords[wordIndex + i + 0];
+            optimizedWords[wordIndex + newWordCount + 1] = optimizedWords[wordIndex + i + 1];
+            newWordCount += 2;
+        }
+
+        // Patch in the new word count.
+        assert((optimizedWords[wordIndex] != UINT32_MAX) && "The instruction shouldn't be getting deleted from reducing the degree of the operands.");
+        optimizedWords[wordIndex] = SpvOpPhi | (newWordCount << 16U);
+        if (newWordCount != wordCount) {
+            c.changeCount++;
+        }
+
+        // Delete any of the remaining words.
+        for (uint32_t i = newWordCount; i < wordCount; i++) {
+            optimizedWords[wordIndex + i] = UINT32_MAX;
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+
+        return true;
+    }
+
+    static void optimizerGatherLoopSpans(std::vector<std::pair<uint32_t, uint32_t>> &loopSpans, OptimizerContext &c) {
+        // Find the span of every loop that's left, from the label of its header to the label of its merge block.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        loopSpans.clear();
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            if ((optimizedWords[wordIndex] == UINT32_MAX) || (SpvOp(optimizedWords[wordIndex] & 0xFFFFU) != SpvOpLoopMerge)) {
+                continue;
+            }
+
+            uint32_t headerInstructionIndex = i;
+            while ((headerInstructionIndex > 0) && (SpvOp(c.shader.spirvWords[c.shader.instructions[headerInstructionIndex].wordIndex] & 0xFFFFU) != SpvOpLabel)) {
+                headerInstructionIndex--;
+            }
+
+            loopSpans.emplace_back(headerInstructionIndex, c.shader.results[optimizedWords[wordIndex + 1]].instructionIndex);
+        }
+    }
+
+    static bool optimizerRunEvaluationPass(OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t orderCount = uint32_t(c.shader.instructionOrder.size());
+        const uint32_t budgetCheckInterval = 256;
+
+        // Terminators inside of loops aren't folded. The continue target and the merge block stay as long as the loop merge
+        // refers to them, so removing the blocks they come from would leave them using results that are gone.
+        thread_local std::vector<std::pair<uint32_t, uint32_t>> loopSpans;
+        optimizerGatherLoopSpans(loopSpans, c);
+        auto insideLoop = [&](uint32_t instructionIndex) {
+            for (const std::pair<uint32_t, uint32_t> &loopSpan : loopSpans) {
+                if ((instructionIndex >= loopSpan.first) && (instructionIndex < loopSpan.second)) {
+                    return true;
+                }
+            }
+
+            return false;
+        };
+
+        for (uint32_t i = 0; i < orderCount; i++) {
+            // Check periodically whether the optimization should be stopped.
+            c.evaluatedInstructions++;
+            if (((i % budgetCheckInterval) == 0) && !optimizerCheckBudget(c)) {
+                return true;
+            }
+
+            uint32_t instructionIndex = c.shader.instructionOrder[i];
+            uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+
+            // Instruction has been deleted.
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            uint32_t patchedWordCount = wordCount;
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+
+            if (hasResult) {
+                if (opCode == SpvOpPhi) {
+                    if (optimizerCompactPhi(instructionIndex, c)) {
+                        patchedWordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+
+                // Check if any of the operands isn't a constant.
+                bool allOperandsAreConstant = true;
+                uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+                bool operandWordSkipString;
+                if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+                    uint32_t operandWordIndex = operandWordStart;
+                    for (uint32_t j = 0; j < operandWordCount; j++) {
+                        if (checkOperandWordSkip(wordIndex, optimizedWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                            continue;
+                        }
+
+                        if (operandWordIndex >= patchedWordCount) {
+                            break;
+                        }
+
+                        uint32_t operandId = optimizedWords[wordIndex + operandWordIndex];
+                        assert((operandId != UINT32_MAX) && "An operand that's been deleted shouldn't be getting evaluated.");
+
+                        // It shouldn't be possible for an operand to not be solved, but OpPhi can do so because previous blocks might've been deleted.
+                        if ((opCode != SpvOpPhi) && (optimizerResolution(operandId, c).type == Resolution::Type::Unknown)) {
+                            fprintf(stderr, "Error in resolution of the operations. Operand %u was not solved.\n", operandId);
+                            return false;
+                        }
+
+                        if (optimizerResolution(operandId, c).type == Resolution::Type::Variable) {
+                            allOperandsAreConstant = false;
+                            break;
+                        }
+
+                        operandWordIndex += operandWordStride;
+                    }
+                }
+
+                // The result can only be evaluated if all operands are constant.
+                uint32_t resultId = optimizedWords[wordIndex + (hasType ? 2 : 1)];
+                if (allOperandsAreConstant) {
+                    optimizerEvaluateResult(resultId, c);
+                }
+                else if ((opCode != SpvOpLoad) || !optimizerEvaluateLoad(wordIndex, c)) {
+                    optimizerResolution(resultId, c).type = Resolution::Type::Variable;
+                }
+            }
+            else if (((opCode == SpvOpBranchConditional) || (opCode == SpvOpSwitch)) && !insideLoop(instructionIndex)) {
+                optimizerEvaluateTerminator(instructionIndex, c);
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerIsPrunableInterface(uint32_t typeId, OptimizerContext &c) {
+        // Only types that occupy a single location can be pruned, as the rest span more locations than the one that's decorated.
+        const uint32_t *shaderWords = c.shader.spirvWords;
+        uint32_t typeWordIndex = c.shader.instructions[c.shader.results[typeId].instructionIndex].wordIndex;
+        SpvOp typeOpCode = SpvOp(shaderWords[typeWordIndex] & 0xFFFFU);
+        if (typeOpCode == SpvOpTypeVector) {
+            typeWordIndex = c.shader.instructions[c.shader.results[shaderWords[typeWordIndex + 2]].instructionIndex].wordIndex;
+            typeOpCode = SpvOp(shaderWords[typeWordIndex] & 0xFFFFU);
+        }
+
+        return ((typeOpCode == SpvOpTypeInt) || (typeOpCode == SpvOpTypeFloat)) && (shaderWords[typeWordIndex + 2] <= 32);
+    }
+
+    static bool optimizerGatherInterfaceAccesses(const Variable &variable, uint32_t storageClass, std::vector<uint32_t> &accessInstructions, OptimizerContext &c) {
+        // Inputs can only be loaded and outputs can only be stored to, either directly or through access chains.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        thread_local std::vector<uint32_t> pointerInstructions;
+        pointerInstructions.clear();
+        pointerInstructions.emplace_back(variable.instructionIndex);
+        accessInstructions.clear();
+        for (uint32_t i = 0; i < pointerInstructions.size(); i++) {
+            uint32_t pointerId = optimizedWords[c.shader.instructions[pointerInstructions[i]].wordIndex + 2];
+            uint32_t listInstructionIndex = pointerInstructions[i];
+            uint32_t listIndex = c.shader.instructions[listInstructionIndex].adjacentListIndex;
+            while ((listIndex != UINT32_MAX) || (optimizerMergedInstruction(listInstructionIndex, c) != UINT32_MAX)) {
+                // Continue with the users of the instructions that were merged into this one.
+                if (listIndex == UINT32_MAX) {
+                    listInstructionIndex = optimizerMergedInstruction(listInstructionIndex, c);
+                    listIndex = c.shader.instructions[listInstructionIndex].adjacentListIndex;
+                    continue;
+                }
+
+                const ListNode &listNode = c.shader.listNodes[listIndex];
+                uint32_t userWordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+                SpvOp userOpCode = SpvOp(optimizedWords[userWordIndex] & 0xFFFFU);
+                listIndex = listNode.nextListIndex;
+
+                // The user has already been deleted.
+                if (optimizedWords[userWordIndex] == UINT32_MAX) {
+                    continue;
+                }
+
+                switch (userOpCode) {
+                case SpvOpDecorate:
+                case SpvOpGroupDecorate:
+                case SpvOpDecorateId:
+                case SpvOpDecorateString:
+                case SpvOpEntryPoint:
+                    break;
+                case SpvOpAccessChain:
+                    if (i > 0) {
+                        return false;
+                    }
+
+                    pointerInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                case SpvOpLoad:
+                    if (storageClass != SpvStorageClassInput) {
+                        return false;
+                    }
+
+                    accessInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                case SpvOpStore:
+                    if ((storageClass != SpvStorageClassOutput) || (optimizedWords[userWordIndex + 1] != pointerId)) {
+                        return false;
+                    }
+
+                    accessInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                default:
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerPruneInterface(OptimizerContext &c) {
+        if ((c.options == nullptr) || ((c.options->activeInputLocations == UINT64_MAX) && (c.options->activeOutputLocations == UINT64_MAX))) {
+            return true;
+        }
+
+        // Outputs are pruned first, so loads that only fed stores to absent outputs are eliminated instead of being replaced.
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        const uint32_t *shaderWords = c.shader.spirvWords;
+        const uint32_t storageClasses[] = { SpvStorageClassOutput, SpvStorageClassInput };
+        thread_local std::vector<uint32_t> accessInstructions;
+        thread_local std::vector<uint32_t> resultStack;
+        for (uint32_t storageClass : storageClasses) {
+            uint64_t activeLocations = (storageClass == SpvStorageClassInput) ? c.options->activeInputLocations : c.options->activeOutputLocations;
+            resultStack.clear();
+            for (const Variable &variable : c.shader.variables) {
+                uint32_t variableWordIndex = c.shader.instructions[variable.instructionIndex].wordIndex;
+                if (shaderWords[variableWordIndex + 3] != storageClass) {
+                    continue;
+                }
+
+                uint32_t location;
+                if (!optimizerFindDecoration(c.shader, shaderWords[variableWordIndex + 2], UINT32_MAX, SpvDecorationLocation, location) || (location >= 64) || (((activeLocations >> location) & 1) != 0)) {
+                    continue;
+                }
+
+                uint32_t pointerTypeWordIndex = c.shader.instructions[c.shader.results[shaderWords[variableWordIndex + 1]].instructionIndex].wordIndex;
+                if (!optimizerIsPrunableInterface(shaderWords[pointerTypeWordIndex + 3], c) || !optimizerGatherInterfaceAccesses(variable, storageClass, accessInstructions, c)) {
+                    continue;
+                }
+
+                // Loads are replaced with a null constant of the same type and stores are removed. The pointers and the values
+                // stored lose a user, so any computation that is no longer needed is eliminated.
+                for (uint32_t instructionIndex : accessInstructions) {
+                    uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+                    if (storageClass == SpvStorageClassInput) {
+                        uint32_t nullConstantId = optimizerNullConstant(optimizedWords[wordIndex + 1], c);
+                        resultStack.emplace_back(optimizedWords[wordIndex + 3]);
+                        optimizedWords[wordIndex] = SpvOpCopyObject | (4U << 16U);
+                        optimizedWords[wordIndex + 3] = nullConstantId;
+                        c.changeCount++;
+                    }
+                    else {
+                        resultStack.emplace_back(optimizedWords[wordIndex + 1]);
+                        resultStack.emplace_back(optimizedWords[wordIndex + 2]);
+                        optimizerEliminateInstruction(instructionIndex, c);
+                    }
+                }
+            }
+
+            optimizerReduceResultDegrees(c, resultStack);
+        }
+
+        return true;
+    }
+
+    static bool optimizerHasUses(uint32_t instructionIndex, OptimizerContext &c) {
+        // Decorations don't count as reads when looking for variables and accesses that are dead.
+        uint32_t decorationDegree = c.decorationsAreUses ? c.shader.instructionDecorationDegrees[instructionIndex] : 0;
+        return optimizerOutDegree(instructionIndex, c) > decorationDegree;
+    }
+
+    static bool optimizerGatherDeadAccesses(const Variable &variable, std::vector<uint32_t> &accessInstructions, OptimizerContext &c) {
+        // The variable is dead if nothing reads from it. Stores to it, loads whose results are unused and access chains that
+        // aren't used anymore are gathered so they can be removed along with it.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        thread_local std::vector<uint32_t> pointerInstructions;
+        pointerInstructions.clear();
+        pointerInstructions.emplace_back(variable.instructionIndex);
+        accessInstructions.clear();
+        for (uint32_t i = 0; i < pointerInstructions.size(); i++) {
+            uint32_t pointerId = optimizedWords[c.shader.instructions[pointerInstructions[i]].wordIndex + 2];
+            if ((i > 0) && !optimizerHasUses(pointerInstructions[i], c)) {
+                accessInstructions.emplace_back(pointerInstructions[i]);
+            }
+
+            uint32_t listInstructionIndex = pointerInstructions[i];
+            uint32_t listIndex = c.shader.instructions[listInstructionIndex].adjacentListIndex;
+            while ((listIndex != UINT32_MAX) || (optimizerMergedInstruction(listInstructionIndex, c) != UINT32_MAX)) {
+                // Continue with the users of the instructions that were merged into this one.
+                if (listIndex == UINT32_MAX) {
+                    listInstructionIndex = optimizerMergedInstruction(listInstructionIndex, c);
+                    listIndex = c.shader.instructions[listInstructionIndex].adjacentListIndex;
+                    continue;
+                }
+
+                const ListNode &listNode = c.shader.listNodes[listIndex];
+                uint32_t userWordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+                SpvOp userOpCode = SpvOp(optimizedWords[userWordIndex] & 0xFFFFU);
+                listIndex = listNode.nextListIndex;
+
+                // The user has already been deleted.
+                if (optimizedWords[userWordIndex] == UINT32_MAX) {
+                    continue;
+                }
+
+                switch (userOpCode) {
+                case SpvOpDecorate:
+                case SpvOpGroupDecorate:
+                case SpvOpDecorateId:
+                case SpvOpDecorateString:
+                    break;
+                case SpvOpEntryPoint:
+                    if (i > 0) {
+                        return false;
+                    }
+
+                    accessInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                case SpvOpAccessChain:
+                    if (optimizedWords[userWordIndex + 3] != pointerId) {
+                        return false;
+                    }
+
+                    pointerInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                case SpvOpLoad:
+                    if ((optimizedWords[userWordIndex + 3] != pointerId) || optimizerHasUses(listNode.instructionIndex, c)) {
+                        return false;
+                    }
+
+                    accessInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                case SpvOpStore:
+                    if (optimizedWords[userWordIndex + 1] != pointerId) {
+                        return false;
+                    }
+
+                    accessInstructions.emplace_back(listNode.instructionIndex);
+                    break;
+                default:
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    static void optimizerRemoveInterfaceVariable(uint32_t instructionIndex, uint32_t variableId, OptimizerContext &c, std::vector<uint32_t> &resultStack) {
+        // The interface of the entry point comes right after its name.
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        const char *name = reinterpret_cast<const char *>(&optimizedWords[wordIndex + 3]);
+        uint32_t interfaceWordIndex = 3 + uint32_t(strnlen(name, (wordCount - 3) * sizeof(uint32_t)) / sizeof(uint32_t)) + 1;
+        uint32_t newWordCount = interfaceWordIndex;
+        for (uint32_t j = interfaceWordIndex; j < wordCount; j++) {
+            if (optimizedWords[wordIndex + j] == variableId) {
+                resultStack.emplace_back(variableId);
+            }
+            else {
+                optimizedWords[wordIndex + newWordCount++] = optimizedWords[wordIndex + j];
+            }
+        }
+
+        optimizedWords[wordIndex] = SpvOpEntryPoint | (newWordCount << 16U);
+        c.changeCount++;
+    }
+
+    static bool optimizerEliminateDeadStores(OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        thread_local std::vector<uint32_t> accessInstructions;
+        thread_local std::vector<uint32_t> resultStack;
+
+        // Removing the stores to one variable can eliminate the last load from another, so the variables are checked again
+        // until none of them are removed.
+        bool removedVariable = true;
+        while (removedVariable) {
+            removedVariable = false;
+            for (const Variable &variable : c.shader.variables) {
+                uint32_t variableWordIndex = c.shader.instructions[variable.instructionIndex].wordIndex;
+                if (optimizedWords[variableWordIndex] == UINT32_MAX) {
+                    continue;
+                }
+
+                uint32_t storageClass = optimizedWords[variableWordIndex + 3];
+                if ((storageClass != SpvStorageClassFunction) && (storageClass != SpvStorageClassPrivate)) {
+                    continue;
+                }
+
+                if (!optimizerGatherDeadAccesses(variable, accessInstructions, c)) {
+                    continue;
+                }
+
+                // The stored values and the pointers lose a user, so the variable is eliminated once the last access to it
+                // is removed. A variable that never had any is eliminated directly.
+                uint32_t variableId = optimizedWords[variableWordIndex + 2];
+                resultStack.clear();
+                for (uint32_t instructionIndex : accessInstructions) {
+                    uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+                    if (optimizedWords[wordIndex] == UINT32_MAX) {
+                        continue;
+                    }
+                    else if (SpvOp(optimizedWords[wordIndex] & 0xFFFFU) == SpvOpEntryPoint) {
+                        optimizerRemoveInterfaceVariable(instructionIndex, variableId, c, resultStack);
+                    }
+                    else {
+                        optimizerEliminateInstructionAndOperands(instructionIndex, c, resultStack);
+                    }
+                }
+
+                if (!optimizerHasUses(variable.instructionIndex, c)) {
+                    optimizerEliminateInstructionAndOperands(variable.instructionIndex, c, resultStack);
+                }
+
+                optimizerReduceResultDegrees(c, resultStack);
+                removedVariable = removedVariable || (optimizedWords[variableWordIndex] == UINT32_MAX);
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerIsCommutative(SpvOp opCode) {
+        switch (opCode) {
+        case SpvOpIAdd:
+        case SpvOpFAdd:
+        case SpvOpIMul:
+        case SpvOpFMul:
+        case SpvOpBitwiseOr:
+        case SpvOpBitwiseXor:
+        case SpvOpBitwiseAnd:
+        case SpvOpLogicalEqual:
+        case SpvOpLogicalNotEqual:
+        case SpvOpLogicalOr:
+        case SpvOpLogicalAnd:
+        case SpvOpIEqual:
+        case SpvOpINotEqual:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool optimizerCanNumberValue(uint32_t wordIndex, OptimizerContext &c) {
+        // Only instructions whose result depends on nothing but their operands can be replaced by an identical one.
+        // OpSampledImage is left out as it must be in the same block as its users, and so are derivatives, as they
+        // depend on the control flow they're in.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+        switch (opCode) {
+        case SpvOpLoad: {
+            // Loads are only numbered when the memory can't be written to during the invocation.
+            if (wordCount != 4) {
+                return false;
+            }
+
+            uint32_t pointerWordIndex = c.shader.instructions[c.shader.results[optimizedWords[wordIndex + 3]].instructionIndex].wordIndex;
+            uint32_t pointerTypeWordIndex = c.shader.instructions[c.shader.results[optimizedWords[pointerWordIndex + 1]].instructionIndex].wordIndex;
+            uint32_t storageClass = optimizedWords[pointerTypeWordIndex + 2];
+            return (storageClass == SpvStorageClassInput) || (storageClass == SpvStorageClassUniformConstant) || (storageClass == SpvStorageClassPushConstant);
+        }
+        case SpvOpExtInst: {
+            // Only the extended instructions of GLSL.std.450 are known. Modf and Frexp store part of their result through a
+            // pointer, and the interpolation functions read from their input.
+            const uint32_t GLSLstd450Modf = 35;
+            const uint32_t GLSLstd450Frexp = 51;
+            const uint32_t GLSLstd450InterpolateAtCentroid = 76;
+            const uint32_t GLSLstd450InterpolateAtOffset = 78;
+            uint32_t setWordIndex = c.shader.instructions[c.shader.results[optimizedWords[wordIndex + 3]].instructionIndex].wordIndex;
+            uint32_t instruction = optimizedWords[wordIndex + 4];
+            if (!optimizerIsGLSLInstructionSet(optimizedWords, setWordIndex) || (instruction == GLSLstd450Modf) || (instruction == GLSLstd450Frexp)) {
+                return false;
+            }
+
+            return (instruction < GLSLstd450InterpolateAtCentroid) || (instruction > GLSLstd450InterpolateAtOffset);
+        }
+        case SpvOpAccessChain:
+        case SpvOpVectorShuffle:
+        case SpvOpCompositeConstruct:
+        case SpvOpCompositeExtract:
+        case SpvOpCompositeInsert:
+        case SpvOpCopyObject:
+        case SpvOpImageSampleExplicitLod:
+        case SpvOpImageFetch:
+        case SpvOpImageQuerySizeLod:
+        case SpvOpImageQueryLevels:
+        case SpvOpConvertFToU:
+        case SpvOpConvertFToS:
+        case SpvOpConvertSToF:
+        case SpvOpConvertUToF:
+        case SpvOpBitcast:
+        case SpvOpSNegate:
+        case SpvOpFNegate:
+        case SpvOpIAdd:
+        case SpvOpFAdd:
+        case SpvOpISub:
+        case SpvOpFSub:
+        case SpvOpIMul:
+        case SpvOpFMul:
+        case SpvOpUDiv:
+        case SpvOpSDiv:
+        case SpvOpFDiv:
+        case SpvOpUMod:
+        case SpvOpSRem:
+        case SpvOpSMod:
+        case SpvOpFRem:
+        case SpvOpFMod:
+        case SpvOpVectorTimesScalar:
+        case SpvOpMatrixTimesScalar:
+        case SpvOpVectorTimesMatrix:
+        case SpvOpMatrixTimesVector:
+        case SpvOpMatrixTimesMatrix:
+        case SpvOpOuterProduct:
+        case SpvOpDot:
+        case SpvOpIAddCarry:
+        case SpvOpISubBorrow:
+        case SpvOpUMulExtended:
+        case SpvOpSMulExtended:
+        case SpvOpAll:
+        case SpvOpLogicalEqual:
+        case SpvOpLogicalNotEqual:
+        case SpvOpLogicalOr:
+        case SpvOpLogicalAnd:
+        case SpvOpLogicalNot:
+        case SpvOpSelect:
+        case SpvOpIEqual:
+        case SpvOpINotEqual:
+        case SpvOpUGreaterThan:
+        case SpvOpSGreaterThan:
+        case SpvOpUGreaterThanEqual:
+        case SpvOpSGreaterThanEqual:
+        case SpvOpULessThan:
+        case SpvOpSLessThan:
+        case SpvOpULessThanEqual:
+        case SpvOpSLessThanEqual:
+        case SpvOpFOrdEqual:
+        case SpvOpFUnordEqual:
+        case SpvOpFOrdNotEqual:
+        case SpvOpFUnordNotEqual:
+        case SpvOpFOrdLessThan:
+        case SpvOpFUnordLessThan:
+        case SpvOpFOrdGreaterThan:
+        case SpvOpFUnordGreaterThan:
+        case SpvOpFOrdLessThanEqual:
+        case SpvOpFUnordLessThanEqual:
+        case SpvOpFOrdGreaterThanEqual:
+        case SpvOpFUnordGreaterThanEqual:
+        case SpvOpShiftRightLogical:
+        case SpvOpShiftRightArithmetic:
+        case SpvOpShiftLeftLogical:
+        case SpvOpBitwiseOr:
+        case SpvOpBitwiseXor:
+        case SpvOpBitwiseAnd:
+        case SpvOpNot:
+        case SpvOpBitFieldInsert:
+        case SpvOpBitFieldSExtract:
+        case SpvOpBitFieldUExtract:
+        case SpvOpBitReverse:
+        case SpvOpBitCount:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool optimizerHasDecorations(uint32_t instructionIndex, OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t listIndex = c.shader.instructions[instructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = c.shader.listNodes[listIndex];
+            if (SpvIsDecoration(SpvOp(optimizedWords[c.shader.instructions[listNode.instructionIndex].wordIndex] & 0xFFFFU))) {
+                return true;
+            }
+
+            listIndex = listNode.nextListIndex;
+        }
+
+        return false;
+    }
+
+    static bool optimizerHasSameDecorations(uint32_t firstInstructionIndex, uint32_t secondInstructionIndex, OptimizerContext &c) {
+        // Decorations like RelaxedPrecision or NoContraction change what the result is, so both must have the same ones.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        thread_local std::vector<uint32_t> firstDecorations;
+        thread_local std::vector<uint32_t> secondDecorations;
+        bool hasGroupDecorations = false;
+        auto gatherDecorations = [&](uint32_t instructionIndex, std::vector<uint32_t> &decorations) {
+            decorations.clear();
+            uint32_t listIndex = c.shader.instructions[instructionIndex].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = c.shader.listNodes[listIndex];
+                uint32_t userWordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+                SpvOp userOpCode = SpvOp(optimizedWords[userWordIndex] & 0xFFFFU);
+                if ((userOpCode == SpvOpGroupDecorate) || (userOpCode == SpvOpGroupMemberDecorate)) {
+                    hasGroupDecorations = true;
+                }
+                else if (SpvIsDecoration(userOpCode)) {
+                    decorations.emplace_back(userWordIndex);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        };
+
+        // Decorations applied through a group aren't compared, so results that have them are never considered the same.
+        gatherDecorations(firstInstructionIndex, firstDecorations);
+        gatherDecorations(secondInstructionIndex, secondDecorations);
+        if (hasGroupDecorations || (firstDecorations.size() != secondDecorations.size())) {
+            return false;
+        }
+
+        for (uint32_t secondWordIndex : secondDecorations) {
+            uint32_t secondWordCount = (optimizedWords[secondWordIndex] >> 16U) & 0xFFFFU;
+            bool foundDecoration = false;
+            for (uint32_t firstWordIndex : firstDecorations) {
+                if ((optimizedWords[firstWordIndex] == optimizedWords[secondWordIndex]) && (memcmp(&optimizedWords[firstWordIndex + 2], &optimizedWords[secondWordIndex + 2], (secondWordCount - 2) * sizeof(uint32_t)) == 0)) {
+                    foundDecoration = true;
+                    break;
+                }
+            }
+
+            if (!foundDecoration) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static void optimizerReplaceReferences(uint32_t *instructionWords, uint32_t oldId, uint32_t newId) {
+        SpvOp opCode = SpvOp(instructionWords[0] & 0xFFFFU);
+        uint32_t wordCount = (instructionWords[0] >> 16U) & 0xFFFFU;
+        bool hasResult, hasType;
+        SpvHasResultAndType(opCode, &hasResult, &hasType);
+        if (hasType && (instructionWords[1] == oldId)) {
+            instructionWords[1] = newId;
+        }
+
+        uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+        bool operandWordSkipString;
+        if (!SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+            return;
+        }
+
+        uint32_t operandWordIndex = operandWordStart;
+        for (uint32_t j = 0; j < operandWordCount; j++) {
+            if (checkOperandWordSkip(0, instructionWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                continue;
+            }
+
+            if (operandWordIndex >= wordCount) {
+                break;
+            }
+
+            if (instructionWords[operandWordIndex] == oldId) {
+                instructionWords[operandWordIndex] = newId;
+            }
+
+            operandWordIndex += operandWordStride;
+        }
+    }
+
+    static void optimizerMergeResult(uint32_t instructionIndex, uint32_t leaderInstructionIndex, OptimizerContext &c, std::vector<uint32_t> &resultStack) {
+        // Every user of the result, including the users of the instructions that were merged into it before, is changed to
+        // use the result of the leader instead. The instructions inserted by the optimizer aren't part of the analysis, so
+        // they're checked separately.
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+        bool hasResult, hasType;
+        SpvHasResultAndType(SpvOp(optimizedWords[wordIndex] & 0xFFFFU), &hasResult, &hasType);
+        uint32_t resultWordOffset = hasType ? 2 : 1;
+        uint32_t resultId = optimizedWords[wordIndex + resultWordOffset];
+        uint32_t leaderResultId = optimizedWords[c.shader.instructions[leaderInstructionIndex].wordIndex + resultWordOffset];
+        uint32_t lastMergedInstructionIndex = instructionIndex;
+        for (uint32_t i = instructionIndex; i != UINT32_MAX; i = optimizerMergedInstruction(i, c)) {
+            uint32_t listIndex = c.shader.instructions[i].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = c.shader.listNodes[listIndex];
+                uint32_t userWordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+                SpvOp userOpCode = SpvOp(optimizedWords[userWordIndex] & 0xFFFFU);
+                if ((optimizedWords[userWordIndex] != UINT32_MAX) && (userOpCode == SpvOpDecorateId)) {
+                    // The decoration stays with its target, but the IDs it refers to are replaced like any other operand.
+                    uint32_t userWordCount = (optimizedWords[userWordIndex] >> 16U) & 0xFFFFU;
+                    for (uint32_t j = 3; j < userWordCount; j++) {
+                        if (optimizedWords[userWordIndex + j] == resultId) {
+                            optimizedWords[userWordIndex + j] = leaderResultId;
+                        }
+                    }
+                }
+                else if ((optimizedWords[userWordIndex] != UINT32_MAX) && !SpvIsDecoration(userOpCode)) {
+                    optimizerReplaceReferences(&optimizedWords[userWordIndex], resultId, leaderResultId);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+
+            lastMergedInstructionIndex = i;
+        }
+
+        auto replaceInsertedReferences = [&](std::vector<uint32_t> &insertedWords) {
+            uint32_t insertedWordIndex = 0;
+            while (insertedWordIndex < insertedWords.size()) {
+                optimizerReplaceReferences(&insertedWords[insertedWordIndex], resultId, leaderResultId);
+                insertedWordIndex += (insertedWords[insertedWordIndex] >> 16U) & 0xFFFFU;
+            }
+        };
+
+        replaceInsertedReferences(c.state.insertedWords);
+        replaceInsertedReferences(c.state.functionInsertedWords);
+
+        // The leader takes over the users and the chain of merged instructions.
+        optimizerResultLeader(resultId, c) = leaderResultId;
+        c.mergedResultCount++;
+        optimizerOutDegree(leaderInstructionIndex, c) += optimizerOutDegree(instructionIndex, c);
+        optimizerMergedInstruction(lastMergedInstructionIndex, c) = optimizerMergedInstruction(leaderInstructionIndex, c);
+        optimizerMergedInstruction(leaderInstructionIndex, c) = instructionIndex;
+        optimizerEliminateInstructionAndOperands(instructionIndex, c, resultStack);
+    }
+
+    static void optimizerRedirectReferences(uint32_t *instructionWords, uint32_t operandWordStart, OptimizerContext &c) {
+        SpvOp opCode = SpvOp(instructionWords[0] & 0xFFFFU);
+        uint32_t wordCount = (instructionWords[0] >> 16U) & 0xFFFFU;
+        bool hasResult, hasType;
+        SpvHasResultAndType(opCode, &hasResult, &hasType);
+        if (hasType) {
+            instructionWords[1] = optimizerResolveLeader(instructionWords[1], c);
+        }
+
+        uint32_t operandWordCount, operandWordStride, operandWordSkip;
+        bool operandWordSkipString;
+        uint32_t operandWordIndex;
+        if (!SpvHasOperands(opCode, operandWordIndex, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+            return;
+        }
+
+        for (uint32_t j = 0; j < operandWordCount; j++) {
+            if (checkOperandWordSkip(0, instructionWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                continue;
+            }
+
+            if (operandWordIndex >= wordCount) {
+                break;
+            }
+
+            if (operandWordIndex >= operandWordStart) {
+                instructionWords[operandWordIndex] = optimizerResolveLeader(instructionWords[operandWordIndex], c);
+            }
+
+            operandWordIndex += operandWordStride;
+        }
+    }
+
+    static void optimizerRedirectMergedResults(uint32_t mergedResultCount, OptimizerContext &c) {
+        // Merges only replace the references of the users in the analysis. Switches folded into the default constant, loads of
+        // pruned inputs and selections converted from an OpPhi refer to results the analysis doesn't know about, so every
+        // instruction that's left is redirected to the leaders once a pass has merged any results.
+        if (c.mergedResultCount == mergedResultCount) {
+            return;
+        }
+
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if ((optimizedWords[wordIndex] == UINT32_MAX) || SpvIsIgnored(opCode)) {
+                continue;
+            }
+
+            // Decorations stay with their targets, but the IDs that OpDecorateId refers to are redirected.
+            if (!SpvIsDecoration(opCode)) {
+                optimizerRedirectReferences(&optimizedWords[wordIndex], 0, c);
+            }
+            else if (opCode == SpvOpDecorateId) {
+                optimizerRedirectReferences(&optimizedWords[wordIndex], 3, c);
+            }
+        }
+
+        auto redirectInsertedReferences = [&](std::vector<uint32_t> &insertedWords) {
+            uint32_t insertedWordIndex = 0;
+            while (insertedWordIndex < insertedWords.size()) {
+                optimizerRedirectReferences(&insertedWords[insertedWordIndex], 0, c);
+                insertedWordIndex += (insertedWords[insertedWordIndex] >> 16U) & 0xFFFFU;
+            }
+        };
+
+        redirectInsertedReferences(c.state.insertedWords);
+        redirectInsertedReferences(c.state.functionInsertedWords);
+    }
+
+    struct OptimizerValueNumber {
+        uint32_t instructionIndex = UINT32_MAX;
+        uint32_t blockIndex = UINT32_MAX;
+        uint32_t keyWordIndex = 0;
+        uint32_t keyWordCount = 0;
+        uint32_t nextValueNumber = UINT32_MAX;
+
+        OptimizerValueNumber() {
+            // Empty.
+        }
+
+        OptimizerValueNumber(uint32_t instructionIndex, uint32_t blockIndex, uint32_t keyWordIndex, uint32_t keyWordCount, uint32_t nextValueNumber) {
+            this->instructionIndex = instructionIndex;
+            this->blockIndex = blockIndex;
+            this->keyWordIndex = keyWordIndex;
+            this->keyWordCount = keyWordCount;
+            this->nextValueNumber = nextValueNumber;
+        }
+    };
+
+    static void optimizerNumberFunctionValues(uint32_t functionBegin, uint32_t functionEnd, OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        thread_local std::vector<uint32_t> instructionBlocks;
+        thread_local std::vector<std::pair<uint32_t, uint32_t>> blockEdges;
+        thread_local std::vector<uint32_t> blockDominators;
+        thread_local std::vector<OptimizerValueNumber> valueNumbers;
+        thread_local std::vector<uint32_t> keyWords;
+        thread_local std::unordered_map<uint64_t, uint32_t> keyValueNumbers;
+        thread_local std::vector<uint32_t> resultStack;
+
+        // Find the block of every instruction that's left and the edges between the blocks.
+        uint32_t blockCount = 0;
+        instructionBlocks.clear();
+        instructionBlocks.resize(functionEnd - functionBegin, UINT32_MAX);
+        for (uint32_t i = functionBegin; i < functionEnd; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            if (SpvOp(optimizedWords[wordIndex] & 0xFFFFU) == SpvOpLabel) {
+                blockCount++;
+            }
+
+            instructionBlocks[i - functionBegin] = (blockCount > 0) ? (blockCount - 1) : UINT32_MAX;
+        }
+
+        blockEdges.clear();
+        for (uint32_t i = functionBegin; i < functionEnd; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if ((optimizedWords[wordIndex] == UINT32_MAX) || ((opCode != SpvOpBranch) && (opCode != SpvOpBranchConditional) && (opCode != SpvOpSwitch))) {
+                continue;
+            }
+
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            uint32_t labelWordStart, labelWordCount, labelWordStride;
+            SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride);
+            for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
+                uint32_t labelIndex = c.shader.results[optimizedWords[wordIndex + labelWordStart + j * labelWordStride]].instructionIndex;
+                if ((labelIndex >= functionBegin) && (labelIndex < functionEnd)) {
+                    blockEdges.emplace_back(instructionBlocks[labelIndex - functionBegin], instructionBlocks[i - functionBegin]);
+                }
+            }
+        }
+
+        std::sort(blockEdges.begin(), blockEdges.end());
+
+        // The immediate dominator of a block is the closest block that all its predecessors share. Blocks always come after
+        // their dominators in the layout, so a block with a predecessor that comes later is conservatively treated as having
+        // no dominator at all.
+        const uint32_t NoDominator = UINT32_MAX;
+        blockDominators.clear();
+        blockDominators.resize(blockCount, NoDominator);
+        auto dominates = [&](uint32_t dominatorBlock, uint32_t block) {
+            while ((block != NoDominator) && (block > dominatorBlock)) {
+                block = blockDominators[block];
+            }
+
+            return block == dominatorBlock;
+        };
+
+        uint32_t edgeIndex = 0;
+        uint32_t edgeCount = uint32_t(blockEdges.size());
+        for (uint32_t b = 0; b < blockCount; b++) {
+            uint32_t dominator = NoDominator;
+            bool firstPredecessor = true;
+            bool laterPredecessor = false;
+            for (; (edgeIndex < edgeCount) && (blockEdges[edgeIndex].first == b); edgeIndex++) {
+                uint32_t predecessor = blockEdges[edgeIndex].second;
+                if (predecessor >= b) {
+                    laterPredecessor = true;
+                }
+                else if (firstPredecessor) {
+                    dominator = predecessor;
+                    firstPredecessor = false;
+                }
+                else {
+                    while ((dominator != predecessor) && (dominator != NoDominator) && (predecessor != NoDominator)) {
+                        if (dominator > predecessor) {
+                            dominator = blockDominators[dominator];
+                        }
+                        else {
+                            predecessor = blockDominators[predecessor];
+                        }
+                    }
+
+                    dominator = (dominator == predecessor) ? dominator : NoDominator;
+                }
+            }
+
+            blockDominators[b] = laterPredecessor ? NoDominator : dominator;
+        }
+
+        // Visit the instructions in the order they're laid out and look for an identical instruction that was visited before
+        // in the same block or in a block that dominates it.
+        valueNumbers.clear();
+        keyWords.clear();
+        keyValueNumbers.clear();
+        resultStack.clear();
+        for (uint32_t i = functionBegin; i < functionEnd; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            uint32_t blockIndex = instructionBlocks[i - functionBegin];
+            if ((optimizedWords[wordIndex] == UINT32_MAX) || (blockIndex == UINT32_MAX) || !optimizerCanNumberValue(wordIndex, c)) {
+                continue;
+            }
+
+            // A copy is the same value as its operand, so its users can use the operand instead. Chains of copies are folded one
+            // at a time, as merging a copy also replaces the operand of the next one. OpSampledImage can't be used outside of its
+            // block, so copies of it are kept.
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if (opCode == SpvOpCopyObject) {
+                uint32_t operandId = optimizedWords[wordIndex + 3];
+                if (operandId < c.shader.results.size()) {
+                    uint32_t operandInstructionIndex = c.shader.results[operandId].instructionIndex;
+                    uint32_t operandWordIndex = c.shader.instructions[operandInstructionIndex].wordIndex;
+                    bool sampledImage = (SpvOp(optimizedWords[operandWordIndex] & 0xFFFFU) == SpvOpSampledImage);
+                    if (!sampledImage && (!optimizerHasDecorations(i, c) || optimizerHasSameDecorations(operandInstructionIndex, i, c))) {
+                        optimizerMergeResult(i, operandInstructionIndex, c, resultStack);
+                        continue;
+                    }
+                }
+            }
+
+            // The key is made of the instruction without its result. The operands of commutative instructions are sorted.
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            uint32_t keyWordIndex = uint32_t(keyWords.size());
+            keyWords.emplace_back(optimizedWords[wordIndex]);
+            keyWords.emplace_back(optimizedWords[wordIndex + 1]);
+            keyWords.insert(keyWords.end(), &optimizedWords[wordIndex + 3], &optimizedWords[wordIndex + wordCount]);
+            uint32_t keyWordCount = uint32_t(keyWords.size()) - keyWordIndex;
+            if (optimizerIsCommutative(opCode) && (keyWordCount == 4) && (keyWords[keyWordIndex + 2] > keyWords[keyWordIndex + 3])) {
+                std::swap(keyWords[keyWordIndex + 2], keyWords[keyWordIndex + 3]);
+            }
+
+            // FNV-1a.
+            uint64_t hash = 14695981039346656037ULL;
+            for (uint32_t j = 0; j < keyWordCount; j++) {
+                hash ^= keyWords[keyWordIndex + j];
+                hash *= 1099511628211ULL;
+            }
+
+            auto keyIt = keyValueNumbers.find(hash);
+            uint32_t leaderInstructionIndex = UINT32_MAX;
+            uint32_t valueNumberIndex = (keyIt != keyValueNumbers.end()) ? keyIt->second : UINT32_MAX;
+            while ((valueNumberIndex != UINT32_MAX) && (leaderInstructionIndex == UINT32_MAX)) {
+                const OptimizerValueNumber &valueNumber = valueNumbers[valueNumberIndex];
+                bool sameKey = (valueNumber.keyWordCount == keyWordCount) && (memcmp(&keyWords[valueNumber.keyWordIndex], &keyWords[keyWordIndex], keyWordCount * sizeof(uint32_t)) == 0);
+                uint32_t leaderWordIndex = c.shader.instructions[valueNumber.instructionIndex].wordIndex;
+                if (sameKey && (optimizedWords[leaderWordIndex] != UINT32_MAX) && dominates(valueNumber.blockIndex, blockIndex) && optimizerHasSameDecorations(valueNumber.instructionIndex, i, c)) {
+                    leaderInstructionIndex = valueNumber.instructionIndex;
+                }
+
+                valueNumberIndex = valueNumber.nextValueNumber;
+            }
+
+            if (leaderInstructionIndex != UINT32_MAX) {
+                keyWords.resize(keyWordIndex);
+                optimizerMergeResult(i, leaderInstructionIndex, c, resultStack);
+            }
+            else {
+                uint32_t nextValueNumber = (keyIt != keyValueNumbers.end()) ? keyIt->second : UINT32_MAX;
+                keyValueNumbers[hash] = uint32_t(valueNumbers.size());
+                valueNumbers.emplace_back(i, blockIndex, keyWordIndex, keyWordCount, nextValueNumber);
+            }
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+    }
+
+    static bool optimizerNumberValues(OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        uint32_t mergedResultCount = c.mergedResultCount;
+        uint32_t functionBegin = UINT32_MAX;
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+            else if (opCode == SpvOpFunction) {
+                functionBegin = i;
+            }
+            else if ((opCode == SpvOpFunctionEnd) && (functionBegin != UINT32_MAX)) {
+                if (!optimizerCheckBudget(c)) {
+                    break;
+                }
+
+                optimizerNumberFunctionValues(functionBegin, i + 1, c);
+                functionBegin = UINT32_MAX;
+            }
+        }
+
+        optimizerRedirectMergedResults(mergedResultCount, c);
+        return true;
+    }
+
+    static bool optimizerCanDeduplicate(SpvOp opCode) {
+        switch (opCode) {
+        case SpvOpTypeVoid:
+        case SpvOpTypeBool:
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        case SpvOpTypeImage:
+        case SpvOpTypeSampler:
+        case SpvOpTypeSampledImage:
+        case SpvOpTypeArray:
+        case SpvOpTypeRuntimeArray:
+        case SpvOpTypeStruct:
+        case SpvOpTypePointer:
+        case SpvOpTypeFunction:
+        case SpvOpConstantTrue:
+        case SpvOpConstantFalse:
+        case SpvOpConstant:
+        case SpvOpConstantComposite:
+        case SpvOpConstantNull:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool optimizerIsForwardDeclared(uint32_t instructionIndex, OptimizerContext &c) {
+        // The types that refer to a pointer declared with OpTypeForwardPointer aren't in its list of users, so their references
+        // to it can't be replaced.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t listIndex = c.shader.instructions[instructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = c.shader.listNodes[listIndex];
+            uint32_t userWordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+            if ((optimizedWords[userWordIndex] != UINT32_MAX) && (SpvOp(optimizedWords[userWordIndex] & 0xFFFFU) == SpvOpTypeForwardPointer)) {
+                return true;
+            }
+
+            listIndex = listNode.nextListIndex;
+        }
+
+        return false;
+    }
+
+    static bool optimizerDeduplicateDeclarations(OptimizerContext &c) {
+        // Types and constants only refer to the declarations before them, so by the time one is visited, the declarations it
+        // refers to were already replaced with the first one that's identical to them. Constants patched from spec constants
+        // are plain constants by now and are merged as well.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        thread_local std::vector<std::pair<uint32_t, uint32_t>> declarations;
+        thread_local std::unordered_map<uint64_t, uint32_t> hashDeclarations;
+        thread_local std::vector<uint32_t> resultStack;
+        declarations.clear();
+        hashDeclarations.clear();
+        resultStack.clear();
+
+        uint32_t mergedResultCount = c.mergedResultCount;
+
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+            else if (opCode == SpvOpFunction) {
+                break;
+            }
+            else if (!optimizerCanDeduplicate(opCode) || ((opCode == SpvOpTypePointer) && optimizerIsForwardDeclared(i, c))) {
+                continue;
+            }
+
+            // Declarations are identical when every word except for the result is the same.
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            uint32_t resultWordOffset = hasType ? 2 : 1;
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            auto sameWords = [&](uint32_t otherWordIndex) {
+                return (optimizedWords[otherWordIndex] == optimizedWords[wordIndex]) &&
+                    (memcmp(&optimizedWords[otherWordIndex + 1], &optimizedWords[wordIndex + 1], (resultWordOffset - 1) * sizeof(uint32_t)) == 0) &&
+                    (memcmp(&optimizedWords[otherWordIndex + resultWordOffset + 1], &optimizedWords[wordIndex + resultWordOffset + 1], (wordCount - resultWordOffset - 1) * sizeof(uint32_t)) == 0);
+            };
+
+            // FNV-1a.
+            uint64_t hash = 14695981039346656037ULL;
+            for (uint32_t j = 0; j < wordCount; j++) {
+                if (j != resultWordOffset) {
+                    hash ^= optimizedWords[wordIndex + j];
+                    hash *= 1099511628211ULL;
+                }
+            }
+
+            auto hashIt = hashDeclarations.find(hash);
+            uint32_t leaderInstructionIndex = UINT32_MAX;
+            uint32_t declarationIndex = (hashIt != hashDeclarations.end()) ? hashIt->second : UINT32_MAX;
+            while ((declarationIndex != UINT32_MAX) && (leaderInstructionIndex == UINT32_MAX)) {
+                uint32_t declarationInstructionIndex = declarations[declarationIndex].first;
+                if (sameWords(c.shader.instructions[declarationInstructionIndex].wordIndex) && optimizerHasSameDecorations(declarationInstructionIndex, i, c)) {
+                    leaderInstructionIndex = declarationInstructionIndex;
+                }
+
+                declarationIndex = declarations[declarationIndex].second;
+            }
+
+            if (leaderInstructionIndex != UINT32_MAX) {
+                optimizerMergeResult(i, leaderInstructionIndex, c, resultStack);
+            }
+            else {
+                uint32_t nextDeclarationIndex = (hashIt != hashDeclarations.end()) ? hashIt->second : UINT32_MAX;
+                hashDeclarations[hash] = uint32_t(declarations.size());
+                declarations.emplace_back(i, nextDeclarationIndex);
+            }
+        }
+
+        optimizerRedirectMergedResults(mergedResultCount, c);
+        optimizerReduceResultDegrees(c, resultStack);
+        return true;
+    }
+
+    static bool optimizerCanSpeculate(uint32_t wordIndex, OptimizerContext &c) {
+        // Memory and image accesses are left in their blocks, as they can be out of bounds or expensive when they're not needed.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        switch (SpvOp(optimizedWords[wordIndex] & 0xFFFFU)) {
+        case SpvOpLoad:
+        case SpvOpAccessChain:
+        case SpvOpImageSampleExplicitLod:
+        case SpvOpImageFetch:
+        case SpvOpImageQuerySizeLod:
+        case SpvOpImageQueryLevels:
+            return false;
+        default:
+            return optimizerCanNumberValue(wordIndex, c);
+        }
+    }
+
+    static uint32_t optimizerNextInstruction(uint32_t instructionIndex, OptimizerContext &c) {
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        for (uint32_t i = instructionIndex + 1; i < instructionCount; i++) {
+            uint32_t word = optimizedWords[c.shader.instructions[i].wordIndex];
+            if ((word != UINT32_MAX) && !SpvIsIgnored(SpvOp(word & 0xFFFFU))) {
+                return i;
+            }
+        }
+
+        return instructionCount;
+    }
+
+    static bool optimizerHasMovedInstructions(uint32_t labelInstructionIndex, OptimizerContext &c) {
+        for (const OptimizerInsertion &insertion : c.state.functionInsertions) {
+            if ((insertion.instructionIndex == labelInstructionIndex) && (insertion.movedInstructionIndex != UINT32_MAX)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool optimizerConvertSelection(uint32_t mergeInstructionIndex, uint32_t maxInstructionCount, OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        auto instructionWordIndex = [&](uint32_t instructionIndex) {
+            return c.shader.instructions[instructionIndex].wordIndex;
+        };
+
+        auto instructionOpCode = [&](uint32_t instructionIndex) {
+            return SpvOp(optimizedWords[instructionWordIndex(instructionIndex)] & 0xFFFFU);
+        };
+
+        // The selection must be a conditional branch whose arms are laid out right after it and go straight to the merge block.
+        uint32_t mergeWordIndex = instructionWordIndex(mergeInstructionIndex);
+        uint32_t mergeLabelId = optimizedWords[mergeWordIndex + 1];
+        if ((optimizedWords[mergeWordIndex + 2] & SpvSelectionControlDontFlattenMask) != 0) {
+            return false;
+        }
+
+        uint32_t branchInstructionIndex = optimizerNextInstruction(mergeInstructionIndex, c);
+        if ((branchInstructionIndex >= instructionCount) || (instructionOpCode(branchInstructionIndex) != SpvOpBranchConditional)) {
+            return false;
+        }
+
+        uint32_t branchWordIndex = instructionWordIndex(branchInstructionIndex);
+        uint32_t conditionId = optimizedWords[branchWordIndex + 1];
+        uint32_t trueLabelId = optimizedWords[branchWordIndex + 2];
+        uint32_t falseLabelId = optimizedWords[branchWordIndex + 3];
+        if (trueLabelId == falseLabelId) {
+            return false;
+        }
+
+        uint32_t headerLabelId = UINT32_MAX;
+        for (uint32_t i = mergeInstructionIndex; (i > 0) && (headerLabelId == UINT32_MAX); i--) {
+            if (instructionOpCode(i) == SpvOpLabel) {
+                headerLabelId = optimizedWords[instructionWordIndex(i) + 1];
+            }
+        }
+
+        if (headerLabelId == UINT32_MAX) {
+            return false;
+        }
+
+        thread_local std::vector<uint32_t> removedInstructions;
+        removedInstructions.clear();
+        removedInstructions.emplace_back(mergeInstructionIndex);
+        removedInstructions.emplace_back(branchInstructionIndex);
+
+        uint32_t armCount = (trueLabelId != mergeLabelId) + (falseLabelId != mergeLabelId);
+        uint32_t speculatedCount = 0;
+        uint32_t i = optimizerNextInstruction(branchInstructionIndex, c);
+        for (uint32_t a = 0; a < armCount; a++) {
+            if ((i >= instructionCount) || (instructionOpCode(i) != SpvOpLabel)) {
+                return false;
+            }
+
+            // Each arm can only be entered from the branch of the selection. Arms that instructions were moved into are left
+            // alone, as the instructions were moved there to only be computed when they're needed.
+            uint32_t armLabelId = optimizedWords[instructionWordIndex(i) + 1];
+            bool isArm = ((armLabelId == trueLabelId) || (armLabelId == falseLabelId)) && (armLabelId != mergeLabelId);
+            if (!isArm || (optimizerInDegree(i, c) != 1) || optimizerHasMovedInstructions(i, c)) {
+                return false;
+            }
+
+            removedInstructions.emplace_back(i);
+            i = optimizerNextInstruction(i, c);
+            while ((i < instructionCount) && (instructionOpCode(i) != SpvOpBranch)) {
+                if (!optimizerCanSpeculate(instructionWordIndex(i), c) || (++speculatedCount > maxInstructionCount)) {
+                    return false;
+                }
+
+                i = optimizerNextInstruction(i, c);
+            }
+
+            if ((i >= instructionCount) || (optimizedWords[instructionWordIndex(i) + 1] != mergeLabelId)) {
+                return false;
+            }
+
+            removedInstructions.emplace_back(i);
+            i = optimizerNextInstruction(i, c);
+        }
+
+        // The merge block must follow the arms and only be reached from them and the merge instruction.
+        if ((i >= instructionCount) || (instructionOpCode(i) != SpvOpLabel) || (optimizedWords[instructionWordIndex(i) + 1] != mergeLabelId) || (optimizerInDegree(i, c) != 3)) {
+            return false;
+        }
+
+        uint32_t mergeLabelInstructionIndex = i;
+        removedInstructions.emplace_back(mergeLabelInstructionIndex);
+
+        // Every OpPhi of the merge block must pick between two scalars or vectors, one for each way into it. OpSelect only
+        // accepts a scalar condition for vectors since SPIR-V 1.4, so vectors are left alone in older modules.
+        const uint32_t spirvVersion14 = 0x10400;
+        bool selectsVectors = (optimizedWords[1] >= spirvVersion14);
+        uint32_t truePredecessorId = (trueLabelId == mergeLabelId) ? headerLabelId : trueLabelId;
+        uint32_t falsePredecessorId = (falseLabelId == mergeLabelId) ? headerLabelId : falseLabelId;
+        thread_local std::vector<uint32_t> phiInstructions;
+        phiInstructions.clear();
+        for (i = optimizerNextInstruction(i, c); (i < instructionCount) && (instructionOpCode(i) == SpvOpPhi); i = optimizerNextInstruction(i, c)) {
+            uint32_t phiWordIndex = instructionWordIndex(i);
+            if (((optimizedWords[phiWordIndex] >> 16U) & 0xFFFFU) != 7) {
+                return false;
+            }
+
+            uint32_t typeWordIndex = instructionWordIndex(c.shader.results[optimizedWords[phiWordIndex + 1]].instructionIndex);
+            SpvOp typeOpCode = SpvOp(optimizedWords[typeWordIndex] & 0xFFFFU);
+            bool isScalarOrVector = (typeOpCode == SpvOpTypeBool) || (typeOpCode == SpvOpTypeInt) || (typeOpCode == SpvOpTypeFloat) || ((typeOpCode == SpvOpTypeVector) && selectsVectors);
+            bool hasPredecessors = ((optimizedWords[phiWordIndex + 4] == truePredecessorId) && (optimizedWords[phiWordIndex + 6] == falsePredecessorId)) ||
+                ((optimizedWords[phiWordIndex + 4] == falsePredecessorId) && (optimizedWords[phiWordIndex + 6] == truePredecessorId));
+            if (!isScalarOrVector || !hasPredecessors) {
+                return false;
+            }
+
+            phiInstructions.emplace_back(i);
+        }
+
+        // The OpPhis become an OpSelect on the condition of the branch, which fits in the words of the OpPhi.
+        bool conditionInserted = (conditionId >= c.shader.results.size());
+        for (uint32_t phiInstructionIndex : phiInstructions) {
+            uint32_t phiWordIndex = instructionWordIndex(phiInstructionIndex);
+            bool trueFirst = (optimizedWords[phiWordIndex + 4] == truePredecessorId);
+            uint32_t trueValueId = optimizedWords[phiWordIndex + (trueFirst ? 3 : 5)];
+            uint32_t falseValueId = optimizedWords[phiWordIndex + (trueFirst ? 5 : 3)];
+            optimizedWords[phiWordIndex] = SpvOpSelect | (6U << 16U);
+            optimizedWords[phiWordIndex + 3] = conditionId;
+            optimizedWords[phiWordIndex + 4] = trueValueId;
+            optimizedWords[phiWordIndex + 5] = falseValueId;
+            optimizedWords[phiWordIndex + 6] = UINT32_MAX;
+            if (!conditionInserted) {
+                optimizerOutDegree(c.shader.results[conditionId].instructionIndex, c)++;
+            }
+        }
+
+        if (!conditionInserted && !phiInstructions.empty()) {
+            c.state.selectConditionIds.emplace_back(conditionId);
+        }
+
+        // Instructions inserted before the ones that are removed, like the comparisons of a switch that was converted into
+        // this branch, are placed before the next instruction that's left instead.
+        for (OptimizerInsertion &insertion : c.state.functionInsertions) {
+            uint32_t anchorInstructionIndex = insertion.instructionIndex;
+            while ((anchorInstructionIndex < instructionCount) && (std::find(removedInstructions.begin(), removedInstructions.end(), anchorInstructionIndex) != removedInstructions.end())) {
+                anchorInstructionIndex = optimizerNextInstruction(anchorInstructionIndex, c);
+            }
+
+            insertion.instructionIndex = anchorInstructionIndex;
+        }
+
+        // The blocks are joined into the block of the selection header by removing the labels and branches between them.
+        thread_local std::vector<uint32_t> resultStack;
+        resultStack.clear();
+        for (uint32_t removedInstructionIndex : removedInstructions) {
+            optimizerEliminateInstructionAndOperands(removedInstructionIndex, c, resultStack);
+        }
+
+        // The successors of the merge block are now reached from the header block instead.
+        uint32_t listIndex = c.shader.instructions[mergeLabelInstructionIndex].adjacentListIndex;
+        while (listIndex != UINT32_MAX) {
+            const ListNode &listNode = c.shader.listNodes[listIndex];
+            uint32_t userWordIndex = instructionWordIndex(listNode.instructionIndex);
+            if ((optimizedWords[userWordIndex] != UINT32_MAX) && (SpvOp(optimizedWords[userWordIndex] & 0xFFFFU) == SpvOpPhi)) {
+                uint32_t userWordCount = (optimizedWords[userWordIndex] >> 16U) & 0xFFFFU;
+                for (uint32_t j = 4; j < userWordCount; j += 2) {
+                    if (optimizedWords[userWordIndex + j] == mergeLabelId) {
+                        optimizedWords[userWordIndex + j] = headerLabelId;
+                    }
+                }
+            }
+
+            listIndex = listNode.nextListIndex;
+        }
+
+        optimizerReduceResultDegrees(c, resultStack);
+        return true;
+    }
+
+    static bool optimizerConvertSelections(OptimizerContext &c) {
+        if ((c.options == nullptr) || (c.options->ifConversionMaxInstructions == 0)) {
+            return true;
+        }
+
+        // Selections are visited from the last one so the nested ones are converted before the ones that contain them.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        for (uint32_t i = uint32_t(c.shader.instructions.size()); i > 0; i--) {
+            uint32_t wordIndex = c.shader.instructions[i - 1].wordIndex;
+            if ((optimizedWords[wordIndex] != UINT32_MAX) && (SpvOp(optimizedWords[wordIndex] & 0xFFFFU) == SpvOpSelectionMerge)) {
+                optimizerConvertSelection(i - 1, c.options->ifConversionMaxInstructions, c);
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerCanSink(uint32_t wordIndex, OptimizerContext &c) {
+        // Loads can't be moved past the stores that might happen before their users, and access chains are left in place
+        // for the passes that follow pointers. Samples can be moved as long as they don't need derivatives.
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(c.optimizedData.data());
+        switch (SpvOp(optimizedWords[wordIndex] & 0xFFFFU)) {
+        case SpvOpLoad:
+        case SpvOpAccessChain:
+            return false;
+        default:
+            return optimizerCanNumberValue(wordIndex, c);
+        }
+    }
+
+    static bool optimizerSinkInstructions(OptimizerContext &c) {
+        const std::vector<Region> &regions = c.shader.regions;
+        if (regions.empty()) {
+            return true;
+        }
+
+        // Find the region that directly contains each region. Regions that aren't nested inside the ones around them are
+        // never used as a destination.
+        uint32_t regionCount = uint32_t(regions.size());
+        thread_local std::vector<uint32_t> regionParents;
+        thread_local std::vector<uint32_t> regionStack;
+        thread_local std::vector<uint8_t> regionNested;
+        regionParents.clear();
+        regionStack.clear();
+        regionNested.clear();
+        for (uint32_t i = 0; i < regionCount; i++) {
+            while (!regionStack.empty() && (regions[regionStack.back()].endInstructionIndex <= regions[i].labelInstructionIndex)) {
+                regionStack.pop_back();
+            }
+
+            bool nested = regionStack.empty() || (regions[i].endInstructionIndex <= regions[regionStack.back()].endInstructionIndex);
+            regionParents.emplace_back(regionStack.empty() ? UINT32_MAX : regionStack.back());
+            regionNested.emplace_back(nested);
+            if (nested) {
+                regionStack.emplace_back(i);
+            }
+        }
+
+        auto regionContains = [&](uint32_t regionIndex, uint32_t instructionIndex) {
+            const Region &region = regions[regionIndex];
+            return regionNested[regionIndex] && (instructionIndex >= region.labelInstructionIndex) && (instructionIndex < region.endInstructionIndex);
+        };
+
+        auto innermostRegion = [&](uint32_t instructionIndex) {
+            auto regionIt = std::upper_bound(regions.begin(), regions.end(), instructionIndex, [](uint32_t instructionIndex, const Region &region) {
+                return instructionIndex < region.labelInstructionIndex;
+            });
+
+            uint32_t regionIndex = (regionIt == regions.begin()) ? UINT32_MAX : uint32_t(regionIt - regions.begin()) - 1;
+            while ((regionIndex != UINT32_MAX) && !regionContains(regionIndex, instructionIndex)) {
+                regionIndex = regionParents[regionIndex];
+            }
+
+            return regionIndex;
+        };
+
+        // Instructions are never moved into a loop, as they'd run on every iteration instead of once.
+        thread_local std::vector<std::pair<uint32_t, uint32_t>> loopSpans;
+        optimizerGatherLoopSpans(loopSpans, c);
+        auto entersLoop = [&](uint32_t instructionIndex, uint32_t labelInstructionIndex) {
+            for (const std::pair<uint32_t, uint32_t> &loopSpan : loopSpans) {
+                bool containsLabel = (labelInstructionIndex >= loopSpan.first) && (labelInstructionIndex < loopSpan.second);
+                bool containsInstruction = (instructionIndex >= loopSpan.first) && (instructionIndex < loopSpan.second);
+                if (containsLabel && !containsInstruction) {
+                    return true;
+                }
+            }
+
+            return false;
+        };
+
+        uint32_t instructionCount = uint32_t(c.shader.instructions.size());
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+
+        // Instructions that were already moved are used from the label they were moved after, and the results used by any other
+        // instruction that was inserted or by the selections converted from an OpPhi can't be moved at all.
+        thread_local std::vector<uint32_t> movedLabels;
+        thread_local std::vector<uint32_t> insertedOperands;
+        movedLabels.clear();
+        movedLabels.resize(instructionCount, UINT32_MAX);
+        insertedOperands.clear();
+        for (const OptimizerInsertion &insertion : c.state.functionInsertions) {
+            if (insertion.movedInstructionIndex != UINT32_MAX) {
+                movedLabels[insertion.movedInstructionIndex] = insertion.instructionIndex;
+            }
+            else {
+                const uint32_t *insertionWords = &c.state.functionInsertedWords[insertion.wordIndex];
+                insertedOperands.insert(insertedOperands.end(), insertionWords + 1, insertionWords + insertion.wordCount);
+            }
+        }
+
+        for (uint32_t conditionId : c.state.selectConditionIds) {
+            insertedOperands.emplace_back(optimizerResolveLeader(conditionId, c));
+        }
+
+        std::sort(insertedOperands.begin(), insertedOperands.end());
+
+        // Instructions are visited from the last one so their users have already been moved when they're visited.
+        for (uint32_t i = instructionCount; i > 0; i--) {
+            uint32_t instructionIndex = i - 1;
+            uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            if ((opCode == SpvOpFunctionEnd) && !optimizerCheckBudget(c)) {
+                return true;
+            }
+
+            if (!optimizerCanSink(wordIndex, c)) {
+                continue;
+            }
+
+            uint32_t resultId = optimizedWords[wordIndex + 2];
+            if (std::binary_search(insertedOperands.begin(), insertedOperands.end(), resultId)) {
+                continue;
+            }
+
+            // Find the innermost region that contains every use of the result. Uses by an OpPhi happen at the end of the block
+            // the value comes from.
+            bool used = false;
+            uint32_t targetRegionIndex = UINT32_MAX;
+            auto addUse = [&](uint32_t useInstructionIndex) {
+                if (!used) {
+                    targetRegionIndex = innermostRegion(useInstructionIndex);
+                    used = true;
+                }
+
+                while ((targetRegionIndex != UINT32_MAX) && !regionContains(targetRegionIndex, useInstructionIndex)) {
+                    targetRegionIndex = regionParents[targetRegionIndex];
+                }
+            };
+
+            uint32_t listInstructionIndex = instructionIndex;
+            uint32_t listIndex = c.shader.instructions[listInstructionIndex].adjacentListIndex;
+            while (((listIndex != UINT32_MAX) || (optimizerMergedInstruction(listInstructionIndex, c) != UINT32_MAX)) && (!used || (targetRegionIndex != UINT32_MAX))) {
+                // Continue with the users of the instructions that were merged into this one.
+                if (listIndex == UINT32_MAX) {
+                    listInstructionIndex = optimizerMergedInstruction(listInstructionIndex, c);
+                    listIndex = c.shader.instructions[listInstructionIndex].adjacentListIndex;
+                    continue;
+                }
+
+                const ListNode &listNode = c.shader.listNodes[listIndex];
+                uint32_t userWordIndex = c.shader.instructions[listNode.instructionIndex].wordIndex;
+                SpvOp userOpCode = SpvOp(optimizedWords[userWordIndex] & 0xFFFFU);
+                listIndex = listNode.nextListIndex;
+                if (optimizedWords[userWordIndex] == UINT32_MAX) {
+                    if (movedLabels[listNode.instructionIndex] != UINT32_MAX) {
+                        addUse(movedLabels[listNode.instructionIndex]);
+                    }
+                }
+                else if (userOpCode == SpvOpPhi) {
+                    uint32_t userWordCount = (optimizedWords[userWordIndex] >> 16U) & 0xFFFFU;
+                    for (uint32_t j = 3; (j + 1) < userWordCount; j += 2) {
+                        if (optimizedWords[userWordIndex + j] == resultId) {
+                            addUse(c.shader.results[optimizedWords[userWordIndex + j + 1]].instructionIndex);
+                        }
+                    }
+                }
+                else if (!SpvIsDecoration(userOpCode)) {
+                    addUse(listNode.instructionIndex);
+                }
+            }
+
+            if (targetRegionIndex == UINT32_MAX) {
+                continue;
+            }
+
+            // The instruction is only moved if it's outside of the region and the loops around it, into a block that's still there
+            // and doesn't start with an OpPhi.
+            const Region &targetRegion = regions[targetRegionIndex];
+            uint32_t labelInstructionIndex = targetRegion.labelInstructionIndex;
+            uint32_t firstInstructionIndex = optimizerNextInstruction(labelInstructionIndex, c);
+            if (regionContains(targetRegionIndex, instructionIndex) || entersLoop(instructionIndex, labelInstructionIndex) || (optimizedWords[c.shader.instructions[labelInstructionIndex].wordIndex] == UINT32_MAX) ||
+                (firstInstructionIndex >= instructionCount) || (SpvOp(optimizedWords[c.shader.instructions[firstInstructionIndex].wordIndex] & 0xFFFFU) == SpvOpPhi))
+            {
+                continue;
+            }
+
+            // An OpSampledImage must be in the same block as its user, so it's moved along with the sample.
+            uint32_t sampledImageInstructionIndex = UINT32_MAX;
+            if (opCode == SpvOpImageSampleExplicitLod) {
+                uint32_t sampledImageId = optimizedWords[wordIndex + 3];
+                if (sampledImageId >= c.shader.results.size()) {
+                    continue;
+                }
+
+                uint32_t operandInstructionIndex = c.shader.results[sampledImageId].instructionIndex;
+                if (SpvOp(optimizedWords[c.shader.instructions[operandInstructionIndex].wordIndex] & 0xFFFFU) == SpvOpSampledImage) {
+                    if (optimizerOutDegree(operandInstructionIndex, c) != 1) {
+                        continue;
+                    }
+
+                    sampledImageInstructionIndex = operandInstructionIndex;
+                }
+            }
+
+            if (sampledImageInstructionIndex != UINT32_MAX) {
+                optimizerMoveAfterLabel(labelInstructionIndex, sampledImageInstructionIndex, c);
+                movedLabels[sampledImageInstructionIndex] = labelInstructionIndex;
+            }
+
+            optimizerMoveAfterLabel(labelInstructionIndex, instructionIndex, c);
+            movedLabels[instructionIndex] = labelInstructionIndex;
+        }
+
+        return true;
+    }
+
+    static bool optimizerRemoveUnusedDecorations(OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+
+        // Instructions that were moved into another block still have their result as long as that block is still there.
+        thread_local std::vector<uint32_t> movedInstructions;
+        movedInstructions.clear();
+        for (const OptimizerInsertion &insertion : c.state.functionInsertions) {
+            if ((insertion.movedInstructionIndex != UINT32_MAX) && (optimizedWords[c.shader.instructions[insertion.instructionIndex].wordIndex] != UINT32_MAX)) {
+                movedInstructions.emplace_back(insertion.movedInstructionIndex);
+            }
+        }
+
+        std::sort(movedInstructions.begin(), movedInstructions.end());
+
+        auto isDeleted = [&](uint32_t resultId) {
+            uint32_t resultInstructionIndex = c.shader.results[resultId].instructionIndex;
+            uint32_t resultWordIndex = c.shader.instructions[resultInstructionIndex].wordIndex;
+            return (optimizedWords[resultWordIndex] == UINT32_MAX) && !std::binary_search(movedInstructions.begin(), movedInstructions.end(), resultInstructionIndex);
+        };
+
+        for (Decoration decoration : c.shader.decorations) {
+            uint32_t wordIndex = c.shader.instructions[decoration.instructionIndex].wordIndex;
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                // This decoration has already been deleted.
+                continue;
+            }
+
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            if ((opCode == SpvOpGroupDecorate) || (opCode == SpvOpGroupMemberDecorate)) {
+                // Only the targets that were deleted are removed from the list. The decoration is deleted once none are left.
+                uint32_t targetWordStride = (opCode == SpvOpGroupMemberDecorate) ? 2 : 1;
+                uint32_t newWordCount = 2;
+                for (uint32_t j = 2; (j + targetWordStride) <= wordCount; j += targetWordStride) {
+                    if (!isDeleted(optimizedWords[wordIndex + j])) {
+                        for (uint32_t k = 0; k < targetWordStride; k++) {
+                            optimizedWords[wordIndex + newWordCount++] = optimizedWords[wordIndex + j + k];
+                        }
+                    }
+                }
+
+                if (newWordCount == 2) {
+                    optimizerEliminateInstruction(decoration.instructionIndex, c);
+                }
+                else if (newWordCount < wordCount) {
+                    std::fill(&optimizedWords[wordIndex + newWordCount], &optimizedWords[wordIndex + wordCount], UINT32_MAX);
+                    optimizedWords[wordIndex] = opCode | (newWordCount << 16U);
+                }
+
+                continue;
+            }
+
+            // The target has been deleted, so we delete the decoration as well. Decorations that refer to other IDs are
+            // deleted along with any of them too.
+            bool deleted = isDeleted(optimizedWords[wordIndex + 1]);
+            if (opCode == SpvOpDecorateId) {
+                for (uint32_t j = 3; (j < wordCount) && !deleted; j++) {
+                    deleted = isDeleted(optimizedWords[wordIndex + j]);
+                }
+            }
+
+            if (deleted) {
+                optimizerEliminateInstruction(decoration.instructionIndex, c);
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerCompactPhis(OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        for (Phi phi : c.shader.phis) {
+            uint32_t wordIndex = c.shader.instructions[phi.instructionIndex].wordIndex;
+            if (optimizedWords[wordIndex] == UINT32_MAX) {
+                // This operation has already been deleted.
+                continue;
+            }
+
+            // The OpPhi was converted into an OpSelect.
+            if (SpvOp(optimizedWords[wordIndex] & 0xFFFFU) != SpvOpPhi) {
+                continue;
+            }
+
+            if (!optimizerCompactPhi(phi.instructionIndex, c)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static bool optimizerCompactData(OptimizerContext &c) {
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+        const uint32_t *sourceWords = optimizedWords;
+        uint32_t optimizedWordCount = 0;
+        uint32_t instructionCount = c.shader.instructions.size();
+
+        // Instructions inserted inside of functions can make the module grow, so the words are compacted from a copy instead.
+        std::vector<OptimizerInsertion> &functionInsertions = c.state.functionInsertions;
+        const std::vector<uint32_t> &functionInsertedWords = c.state.functionInsertedWords;
+        thread_local std::vector<uint32_t> sourceWordsCopy;
+        if (!functionInsertions.empty()) {
+            uint32_t sourceWordCount = uint32_t(c.optimizedData.size() / sizeof(uint32_t));
+            sourceWordsCopy.assign(optimizedWords, optimizedWords + sourceWordCount);
+            sourceWords = sourceWordsCopy.data();
+            c.optimizedData.resize((sourceWordCount + functionInsertedWords.size()) * sizeof(uint32_t));
+            optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+            std::stable_sort(functionInsertions.begin(), functionInsertions.end(), [](const OptimizerInsertion &a, const OptimizerInsertion &b) {
+                if (a.instructionIndex != b.instructionIndex) {
+                    return a.instructionIndex < b.instructionIndex;
+                }
+
+                bool aMoved = (a.movedInstructionIndex != UINT32_MAX);
+                bool bMoved = (b.movedInstructionIndex != UINT32_MAX);
+                if (aMoved != bMoved) {
+                    return bMoved;
+                }
+
+                return aMoved && (a.movedInstructionIndex < b.movedInstructionIndex);
+            });
+        }
+
+        // Copy the header.
+        const uint32_t startingWordIndex = 5;
+        for (uint32_t i = 0; i < startingWordIndex; i++) {
+            optimizedWords[optimizedWordCount++] = sourceWords[i];
+        }
+
+        // Write out all the words for all the instructions and skip any that were marked as deleted.
+        uint32_t functionsWordIndex = UINT32_MAX;
+        uint32_t insertionIndex = 0;
+        uint32_t insertionCount = uint32_t(functionInsertions.size());
+        for (uint32_t i = 0; i < instructionCount; i++) {
+            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+
+            // Instruction has been deleted.
+            if (sourceWords[wordIndex] == UINT32_MAX) {
+                continue;
+            }
+
+            SpvOp opCode = SpvOp(sourceWords[wordIndex] & 0xFFFFU);
+            if ((opCode == SpvOpFunction) && (functionsWordIndex == UINT32_MAX)) {
+                functionsWordIndex = optimizedWordCount;
+            }
+
+            // Insertions anchored to instructions that were deleted are skipped.
+            while ((insertionIndex < insertionCount) && (functionInsertions[insertionIndex].instructionIndex <= i)) {
+                const OptimizerInsertion &insertion = functionInsertions[insertionIndex];
+                if ((insertion.instructionIndex == i) && (insertion.movedInstructionIndex != UINT32_MAX)) {
+                    break;
+                }
+
+                if (insertion.instructionIndex == i) {
+                    memcpy(&optimizedWords[optimizedWordCount], &functionInsertedWords[insertion.wordIndex], insertion.wordCount * sizeof(uint32_t));
+                    optimizedWordCount += insertion.wordCount;
+                }
+
+                insertionIndex++;
+            }
+
+            // Check if the instruction should be ignored. Insertions anchored to it are still written out above.
+            if (SpvIsIgnored(opCode)) {
+                continue;
+            }
+
+            // Copy all the words of the instruction.
+            uint32_t wordCount = (sourceWords[wordIndex] >> 16U) & 0xFFFFU;
+            for (uint32_t j = 0; j < wordCount; j++) {
+                optimizedWords[optimizedWordCount++] = sourceWords[wordIndex + j];
+            }
+
+            // Instructions moved into the block of a label go right after it.
+            while ((insertionIndex < insertionCount) && (functionInsertions[insertionIndex].instructionIndex == i)) {
+                const OptimizerInsertion &insertion = functionInsertions[insertionIndex++];
+                memcpy(&optimizedWords[optimizedWordCount], &functionInsertedWords[insertion.wordIndex], insertion.wordCount * sizeof(uint32_t));
+                optimizedWordCount += insertion.wordCount;
+            }
+        }
+
+        // Instructions added by the optimizer are placed at the end of the global declarations, right before the first function.
+        const std::vector<uint32_t> &insertedWords = c.state.insertedWords;
+        if (!insertedWords.empty()) {
+            if (functionsWordIndex == UINT32_MAX) {
+                functionsWordIndex = optimizedWordCount;
+            }
+
+            uint32_t insertedWordCount = uint32_t(insertedWords.size());
+            c.optimizedData.resize((optimizedWordCount + insertedWordCount) * sizeof(uint32_t));
+            optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
+            memmove(&optimizedWords[functionsWordIndex + insertedWordCount], &optimizedWords[functionsWordIndex], (optimizedWordCount - functionsWordIndex) * sizeof(uint32_t));
+            memcpy(&optimizedWords[functionsWordIndex], insertedWords.data(), insertedWordCount * sizeof(uint32_t));
+            optimizedWordCount += insertedWordCount;
+        }
+
+        // When results were merged, the bound only needs to fit the results that are left.
+        if (c.mergedResultCount > 0) {
+            uint32_t idBound = 1;
+            for (uint32_t i = startingWordIndex; i < optimizedWordCount; i += (optimizedWords[i] >> 16U) & 0xFFFFU) {
+                bool hasResult, hasType;
+                SpvHasResultAndType(SpvOp(optimizedWords[i] & 0xFFFFU), &hasResult, &hasType);
+                if (hasResult) {
+                    idBound = std::max(idBound, optimizedWords[i + (hasType ? 2 : 1)] + 1);
+                }
+            }
+
+            optimizedWords[3] = idBound;
+        }
+        else if (!insertedWords.empty() || !functionInsertions.empty()) {
+            optimizedWords[3] = c.idBound;
+        }
+
+        c.optimizedData.resize(optimizedWordCount * sizeof(uint32_t));
+
+        return true;
+    }
+
+    bool Optimizer::run(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData) {
+        return run(shader, newSpecConstants, newSpecConstantCount, optimizedData, OptimizerOptions());
+    }
+
+    static bool optimizerRunPass(OptimizerPass pass, OptimizerContext &c) {
+        switch (pass) {
+        case OptimizerPass::Evaluation:
+            return optimizerRunEvaluationPass(c);
+        case OptimizerPass::PruneInterface:
+            return optimizerPruneInterface(c);
+        case OptimizerPass::DeadStores:
+            return optimizerEliminateDeadStores(c);
+        case OptimizerPass::IfConversion:
+            return optimizerConvertSelections(c);
+        case OptimizerPass::ValueNumbering:
+            return optimizerNumberValues(c);
+        case OptimizerPass::Sinking:
+            return optimizerSinkInstructions(c);
+        case OptimizerPass::Deduplication:
+            return optimizerDeduplicateDeclarations(c);
+        default:
+            fprintf(stderr, "Optimization error. Unknown pass %u.\n", uint32_t(pass));
+            return false;
+        }
+    }
+
+    static bool optimizerRunPipeline(const OptimizerPipeline &pipeline, OptimizerContext &c) {
+        OptimizerPipelineStatistics *statistics = c.options->statistics;
+        uint32_t stageCount = uint32_t(pipeline.stages.size());
+        if (statistics != nullptr) {
+            statistics->stages.clear();
+            statistics->stages.resize(stageCount);
+            statistics->iterationCount = 0;
+        }
+
+        // A stage only needs to run again if anything has changed since the last time it ran.
+        thread_local std::vector<uint64_t> stageChangeCounts;
+        stageChangeCounts.clear();
+        stageChangeCounts.resize(stageCount, UINT64_MAX);
+        for (uint32_t iteration = 0; iteration < pipeline.maxIterations; iteration++) {
+            uint64_t iterationChangeCount = c.changeCount;
+            bool stageRan = false;
+            for (uint32_t i = 0; i < stageCount; i++) {
+                const OptimizerPipeline::Stage &stage = pipeline.stages[i];
+                if (!stage.enabled || (stageChangeCounts[i] == c.changeCount)) {
+                    continue;
+                }
+
+                if (!optimizerCheckBudget(c)) {
+                    return true;
+                }
+
+                std::chrono::steady_clock::time_point startTime;
+                if (statistics != nullptr) {
+                    startTime = std::chrono::steady_clock::now();
+                }
+
+                uint64_t stageStartChangeCount = c.changeCount;
+                if (!optimizerRunPass(stage.pass, c)) {
+                    return false;
+                }
+
+                // A stage that made changes might be able to make more, so it's not considered done until it makes none.
+                stageChangeCounts[i] = (c.changeCount == stageStartChangeCount) ? c.changeCount : UINT64_MAX;
+                stageRan = true;
+                if (statistics != nullptr) {
+                    OptimizerPipelineStatistics::Stage &stageStatistics = statistics->stages[i];
+                    stageStatistics.runCount++;
+                    stageStatistics.changeCount += c.changeCount - stageStartChangeCount;
+                    stageStatistics.time += std::chrono::steady_clock::now() - startTime;
+                }
+            }
+
+            if (statistics != nullptr) {
+                statistics->iterationCount += stageRan ? 1 : 0;
+            }
+
+            if (!stageRan || (c.changeCount == iterationChangeCount)) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    static OptimizerStatus optimizerRun(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, OptimizerContext &c) {
+        // When the budget runs out, the output is either discarded or replaced with one that only has the spec constants patched in.
+        auto handleBudgetExceeded = [&]() {
+            if (c.options->patchOnlyFallback && Optimizer::patch(c.shader, newSpecConstants, newSpecConstantCount, c.optimizedData)) {
+                return OptimizerStatus::PatchOnly;
+            }
+            else {
+                c.optimizedData.clear();
+                return OptimizerStatus::Incomplete;
+            }
+        };
+
+        if (!optimizerCheckBudget(c)) {
+            return handleBudgetExceeded();
+        }
+
+        if (!optimizerPrepareData(c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        if (!optimizerPatchSpecializationConstants(newSpecConstants, newSpecConstantCount, c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        if (!optimizerSelectEntryPoint(c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        if (!optimizerRunPipeline(c.options->pipeline, c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        if (!optimizerCheckBudget(c)) {
+            return handleBudgetExceeded();
+        }
+
+        if (!optimizerRemoveUnusedDecorations(c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        // FIXME: For some reason, it seems that based on the order of the resolution, OpPhis can be compacted
+        // before all their preceding blocks have been evaluated in time whether they should be deleted or not.
+        // This pass merely re-runs the compaction step as a safeguard to remove any stale references. There's
+        // potential for further optimization if this is fixed properly.
+        if (!optimizerCompactPhis(c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        if (!optimizerCheckBudget(c)) {
+            return handleBudgetExceeded();
+        }
+
+        if (!optimizerCompactData(c)) {
+            return OptimizerStatus::Failed;
+        }
+
+        return OptimizerStatus::Complete;
+    }
+
+    bool Optimizer::run(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData, const OptimizerOptions &options, OptimizerStatus *status) {
+        thread_local OptimizerState state;
+        OptimizerContext c = { shader, state, optimizedData, &options };
+        OptimizerStatus runStatus = optimizerRun(newSpecConstants, newSpecConstantCount, c);
+        if (status != nullptr) {
+            *status = runStatus;
+        }
+
+        return (runStatus == OptimizerStatus::Complete) || (runStatus == OptimizerStatus::PatchOnly);
+    }
+
+    static void optimizerPatchConstantWords(const uint32_t *specConstantWords, const SpecConstant &newSpecConstant, uint32_t *constantWords) {
+        // The values must've been validated against the spec constant instruction already.
+        SpvOp specConstantOpCode = SpvOp(specConstantWords[0] & 0xFFFFU);
+        uint32_t constantWordCount = (specConstantWords[0] >> 16U) & 0xFFFFU;
+        if (specConstantOpCode == SpvOpSpecConstant) {
+            constantWords[0] = SpvOpConstant | (constantWordCount << 16U);
+            memcpy(&constantWords[3], newSpecConstant.values.data(), sizeof(uint32_t) * (constantWordCount - 3));
+        }
+        else {
+            constantWords[0] = (newSpecConstant.values[0] ? SpvOpConstantTrue : SpvOpConstantFalse) | (constantWordCount << 16U);
+        }
+    }
+
+    bool Optimizer::patch(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData) {
+        struct RemovedRange {
+            uint32_t wordIndex;
+            uint32_t wordCount;
+
+            bool operator<(const RemovedRange &r) const {
+                return wordIndex < r.wordIndex;
+            }
+        };
+
+        thread_local std::vector<RemovedRange> removedRanges;
+        thread_local std::vector<uint32_t> removedWordSums;
+        removedRanges.clear();
+        removedWordSums.clear();
+
+        // Validate the constants and gather the decorations that must be removed from the output.
+        const uint32_t *shaderWords = shader.spirvWords;
+        for (uint32_t i = 0; i < newSpecConstantCount; i++) {
+            const SpecConstant &newSpecConstant = newSpecConstants[i];
+            if (newSpecConstant.specId >= shader.specializations.size()) {
+                continue;
+            }
+
+            const Specialization &specialization = shader.specializations[newSpecConstant.specId];
+            if (specialization.constantInstructionIndex == UINT32_MAX) {
+                continue;
+            }
+
+            uint32_t constantWordIndex = shader.instructions[specialization.constantInstructionIndex].wordIndex;
+            SpvOp constantOpCode = SpvOp(shaderWords[constantWordIndex] & 0xFFFFU);
+            uint32_t constantWordCount = (shaderWords[constantWordIndex] >> 16U) & 0xFFFFU;
+            switch (constantOpCode) {
+            case SpvOpSpecConstantTrue:
+            case SpvOpSpecConstantFalse:
+                break;
+            case SpvOpSpecConstant:
+                if (constantWordCount <= 3) {
+                    fprintf(stderr, "Optimization error. Specialization constant has less words than expected.\n");
+                    return false;
+                }
+
+                if (newSpecConstant.values.size() != (constantWordCount - 3)) {
+                    fprintf(stderr, "Optimization error. Value count for specialization constant %u differs from the expected size.\n", newSpecConstant.specId);
+                    return false;
+                }
+
+                break;
+            default:
+                fprintf(stderr, "Optimization error. Can't patch opCode %u.\n", constantOpCode);
+                return false;
+            }
+
+            uint32_t decorationWordIndex = shader.instructions[specialization.decorationInstructionIndex].wordIndex;
+            uint32_t decorationWordCount = (shaderWords[decorationWordIndex] >> 16U) & 0xFFFFU;
+            removedRanges.push_back({ decorationWordIndex, decorationWordCount });
+        }
+
+        // The same constant can be provided more than once, but its decoration must only be removed once.
+        std::sort(removedRanges.begin(), removedRanges.end());
+        removedRanges.erase(std::unique(removedRanges.begin(), removedRanges.end(), [](const RemovedRange &a, const RemovedRange &b) { return a.wordIndex == b.wordIndex; }), removedRanges.end());
+
+        // Copy the words in the segments between the removed decorations.
+        uint32_t removedWordCount = 0;
+        for (const RemovedRange &range : removedRanges) {
+            removedWordSums.emplace_back(removedWordCount);
+            removedWordCount += range.wordCount;
+        }
+
+        optimizedData.resize((shader.spirvWordCount - removedWordCount) * sizeof(uint32_t));
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(optimizedData.data());
+        uint32_t segmentWordIndex = 0;
+        uint32_t optimizedWordCount = 0;
+        for (const RemovedRange &range : removedRanges) {
+            uint32_t segmentWordCount = range.wordIndex - segmentWordIndex;
+            memcpy(&optimizedWords[optimizedWordCount], &shaderWords[segmentWordIndex], segmentWordCount * sizeof(uint32_t));
+            optimizedWordCount += segmentWordCount;
+            segmentWordIndex = range.wordIndex + range.wordCount;
+        }
+
+        memcpy(&optimizedWords[optimizedWordCount], &shaderWords[segmentWordIndex], (shader.spirvWordCount - segmentWordIndex) * sizeof(uint32_t));
+
+        // Patch the constants at their new positions, which are shifted by the amount of words removed before them.
+        for (uint32_t i = 0; i < newSpecConstantCount; i++) {
+            const SpecConstant &newSpecConstant = newSpecConstants[i];
+            if (newSpecConstant.specId >= shader.specializations.size()) {
+                continue;
+            }
+
+            const Specialization &specialization = shader.specializations[newSpecConstant.specId];
+            if (specialization.constantInstructionIndex == UINT32_MAX) {
+                continue;
+            }
+
+            uint32_t constantWordIndex = shader.instructions[specialization.constantInstructionIndex].wordIndex;
+            auto rangeIt = std::lower_bound(removedRanges.begin(), removedRanges.end(), RemovedRange{ constantWordIndex, 0 });
+            uint32_t rangeIndex = uint32_t(rangeIt - removedRanges.begin());
+            uint32_t shiftWordCount = (rangeIndex < removedRanges.size()) ? removedWordSums[rangeIndex] : removedWordCount;
+            optimizerPatchConstantWords(&shaderWords[constantWordIndex], newSpecConstant, &optimizedWords[constantWordIndex - shiftWordCount]);
+        }
+
+        return true;
+    }
+
+    // Specializer
+
+    Specializer::Specializer() {
+        // Empty.
+    }
+
+    Specializer::Specializer(const Shader &shader) {
+        reset(shader);
+    }
+
+    void Specializer::reset(const Shader &shader) {
+        this->shader = &shader;
+        specConstants.clear();
+        resolutions.clear();
+        specConstantWordIndices.clear();
+        sourceData.clear();
+        optimizedData.clear();
+        cachedOutputs.clear();
+        valid = false;
+    }
+
+    bool Specializer::run(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData) {
+        if (shader == nullptr) {
+            fprintf(stderr, "Specializer error. No shader was provided.\n");
+            return false;
+        }
+
+        if (!valid || !runIncremental(newSpecConstants, newSpecConstantCount)) {
+            if (!runCached(newSpecConstants, newSpecConstantCount) && !runFull(newSpecConstants, newSpecConstantCount)) {
+                return false;
+            }
+        }
+
+        optimizedData = this->optimizedData;
+        return true;
+    }
+
+    bool Specializer::runCached(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount) {
+        if (!valid) {
+            return false;
+        }
+
+        // The cached outputs are tried from the most recently used one. Each try only evaluates the instructions that depend on
+        // the constants that differ from the ones of that output.
+        uint32_t cachedOutputCount = uint32_t(cachedOutputs.size());
+        for (uint32_t i = cachedOutputCount; i > 0; i--) {
+            swapCachedOutput(i - 1);
+            if (runIncremental(newSpecConstants, newSpecConstantCount)) {
+                // The output that was current is cached in its place and becomes the most recently used.
+                std::rotate(cachedOutputs.begin() + (i - 1), cachedOutputs.begin() + i, cachedOutputs.end());
+                return true;
+            }
+
+            swapCachedOutput(i - 1);
+        }
+
+        return false;
+    }
+
+    void Specializer::swapCachedOutput(uint32_t cachedOutputIndex) {
+        SpecializerOutput &cachedOutput = cachedOutputs[cachedOutputIndex];
+        std::swap(specConstants, cachedOutput.specConstants);
+        std::swap(resolutions, cachedOutput.resolutions);
+        std::swap(specConstantWordIndices, cachedOutput.specConstantWordIndices);
+        std::swap(optimizedData, cachedOutput.optimizedData);
+
+        // The source must have the constants of the output patched in, as the instructions are evaluated from it.
+        uint32_t *sourceWords = reinterpret_cast<uint32_t *>(sourceData.data());
+        uint32_t specializationCount = uint32_t(shader->specializations.size());
+        for (uint32_t i = 0; i < specializationCount; i++) {
+            uint32_t instructionIndex = shader->specializations[i].constantInstructionIndex;
+            if (instructionIndex == UINT32_MAX) {
+                continue;
+            }
+
+            uint32_t wordIndex = shader->instructions[instructionIndex].wordIndex;
+            if (specConstants[i].values.empty()) {
+                uint32_t wordCount = (shader->spirvWords[wordIndex] >> 16U) & 0xFFFFU;
+                memcpy(&sourceWords[wordIndex], &shader->spirvWords[wordIndex], wordCount * sizeof(uint32_t));
+            }
+            else {
+                optimizerPatchConstantWords(&shader->spirvWords[wordIndex], specConstants[i], &sourceWords[wordIndex]);
+            }
+        }
+    }
+
+    bool Specializer::runFull(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount) {
+        // The previous output is cached, as the decisions of the new constants are different from it.
+        if (valid && (maxCachedOutputs > 0)) {
+            if (cachedOutputs.size() >= maxCachedOutputs) {
+                cachedOutputs.erase(cachedOutputs.begin());
+            }
+
+            cachedOutputs.emplace_back();
+            SpecializerOutput &cachedOutput = cachedOutputs.back();
+            std::swap(specConstants, cachedOutput.specConstants);
+            std::swap(resolutions, cachedOutput.resolutions);
+            std::swap(specConstantWordIndices, cachedOutput.specConstantWordIndices);
+            std::swap(optimizedData, cachedOutput.optimizedData);
+        }
+
+        valid = false;
+
+        // The constants are patched directly into the output when only their values change, so they can't be merged with any
+        // other constant that happens to have the same value.
+        thread_local OptimizerState state;
+        OptimizerOptions options;
+        for (OptimizerPipeline::Stage &stage : options.pipeline.stages) {
+            if (stage.pass == OptimizerPass::Deduplication) {
+                stage.enabled = false;
+            }
+        }
+
+        OptimizerContext c = { *shader, state, optimizedData, &options };
+        if (optimizerRun(newSpecConstants, newSpecConstantCount, c) != OptimizerStatus::Complete) {
+            return false;
+        }
+
+        // Store the resolutions of the run to evaluate the changes against them later.
+        uint32_t resultCount = uint32_t(shader->results.size());
+        resolutions.resize(resultCount);
+        for (uint32_t i = 0; i < resultCount; i++) {
+            resolutions[i] = optimizerResolution(i, c);
+        }
+
+        // Store the values indexed by their ID. Values that are provided more than once use the last one, just like when patching.
+        uint32_t specializationCount = uint32_t(shader->specializations.size());
+        specConstants.clear();
+        specConstants.resize(specializationCount);
+        for (uint32_t i = 0; i < newSpecConstantCount; i++) {
+            const SpecConstant &newSpecConstant = newSpecConstants[i];
+            if ((newSpecConstant.specId < specializationCount) && (shader->specializations[newSpecConstant.specId].constantInstructionIndex != UINT32_MAX)) {
+                specConstants[newSpecConstant.specId] = newSpecConstant;
+            }
+        }
+
+        // Keep a copy of the module with the constants patched in to evaluate the instructions from.
+        sourceData.resize(shader->spirvWordCount * sizeof(uint32_t));
+        memcpy(sourceData.data(), shader->spirvWords, sourceData.size());
+
+        thread_local std::vector<uint32_t> resultSpecIds;
+        resultSpecIds.clear();
+        resultSpecIds.resize(resultCount, UINT32_MAX);
+        uint32_t *sourceWords = reinterpret_cast<uint32_t *>(sourceData.data());
+        for (uint32_t i = 0; i < specializationCount; i++) {
+            if (specConstants[i].values.empty()) {
+                continue;
+            }
+
+            uint32_t wordIndex = shader->instructions[shader->specializations[i].constantInstructionIndex].wordIndex;
+            optimizerPatchConstantWords(&shader->spirvWords[wordIndex], specConstants[i], &sourceWords[wordIndex]);
+            resultSpecIds[shader->spirvWords[wordIndex + 2]] = i;
+        }
+
+        // Find where the constants ended up in the output so they can be patched directly.
+        specConstantWordIndices.clear();
+        specConstantWordIndices.resize(specializationCount, UINT32_MAX);
+        const uint32_t *optimizedWords = reinterpret_cast<const uint32_t *>(optimizedData.data());
+        uint32_t optimizedWordCount = uint32_t(optimizedData.size() / sizeof(uint32_t));
+        const uint32_t startingWordIndex = 5;
+        uint32_t wordIndex = startingWordIndex;
+        while (wordIndex < optimizedWordCount) {
+            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
+            bool isConstant = (opCode == SpvOpConstant) || (opCode == SpvOpConstantTrue) || (opCode == SpvOpConstantFalse);
+            if (isConstant && (wordCount >= 3) && (optimizedWords[wordIndex + 2] < resultCount) && (resultSpecIds[optimizedWords[wordIndex + 2]] != UINT32_MAX)) {
+                specConstantWordIndices[resultSpecIds[optimizedWords[wordIndex + 2]]] = wordIndex;
+            }
+
+            wordIndex += wordCount;
+        }
+
+        valid = true;
+        return true;
+    }
+
+    bool Specializer::runIncremental(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount) {
+        // Find the last value provided for each constant and which ones differ from the previous run.
+        thread_local std::vector<uint32_t> lastSpecConstantIndices;
+        thread_local std::vector<uint32_t> changedSpecIds;
+        uint32_t specializationCount = uint32_t(shader->specializations.size());
+        lastSpecConstantIndices.clear();
+        lastSpecConstantIndices.resize(specializationCount, UINT32_MAX);
+        changedSpecIds.clear();
+        for (uint32_t i = 0; i < newSpecConstantCount; i++) {
+            uint32_t specId = newSpecConstants[i].specId;
+            if ((specId < specializationCount) && (shader->specializations[specId].constantInstructionIndex != UINT32_MAX)) {
+                lastSpecConstantIndices[specId] = i;
+            }
+        }
+
+        // The set of provided constants must be the same, as the decorations that are removed depend on it.
+        for (uint32_t i = 0; i < specializationCount; i++) {
+            const std::vector<uint32_t> &previousValues = specConstants[i].values;
+            if (lastSpecConstantIndices[i] == UINT32_MAX) {
+                if (!previousValues.empty()) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            const std::vector<uint32_t> &newValues = newSpecConstants[lastSpecConstantIndices[i]].values;
+            if (newValues.size() != previousValues.size()) {
+                return false;
+            }
+
+            if (newValues != previousValues) {
+                changedSpecIds.emplace_back(i);
+            }
+        }
+
+        if (changedSpecIds.empty()) {
+            return true;
+        }
+
+        // Gather all the instructions that depend on the changed constants.
+        thread_local std::vector<uint32_t> coneInstructions;
+        thread_local std::vector<uint32_t> coneStamps;
+        thread_local uint32_t coneGeneration = 0;
+        uint32_t instructionCount = uint32_t(shader->instructions.size());
+        if (coneStamps.size() < instructionCount) {
+            coneStamps.resize(instructionCount, 0);
+        }
+
+        coneGeneration++;
+        if (coneGeneration == 0) {
+            std::fill(coneStamps.begin(), coneStamps.end(), 0);
+            coneGeneration = 1;
+        }
+
+        coneInstructions.clear();
+        for (uint32_t specId : changedSpecIds) {
+            uint32_t instructionIndex = shader->specializations[specId].constantInstructionIndex;
+            coneStamps[instructionIndex] = coneGeneration;
+            coneInstructions.emplace_back(instructionIndex);
+        }
+
+        const uint32_t *shaderWords = shader->spirvWords;
+        for (uint32_t i = 0; i < coneInstructions.size(); i++) {
+            uint32_t instructionIndex = coneInstructions[i];
+            SpvOp opCode = SpvOp(shaderWords[shader->instructions[instructionIndex].wordIndex] & 0xFFFFU);
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+
+            // Only the users of results can be affected. Phis and loads that merge the values of a local variable depend on
+            // which blocks were eliminated, so they're not evaluated here.
+            if (!hasResult) {
+                continue;
+            }
+            else if (opCode == SpvOpPhi) {
+                return false;
+            }
+            else if (opCode == SpvOpLoad) {
+                uint32_t localLoadIndex = shader->findLocalLoad(instructionIndex);
+                if ((localLoadIndex != UINT32_MAX) && (shader->localLoads[localLoadIndex].mergeLabelId != UINT32_MAX)) {
+                    return false;
+                }
+            }
+
+            uint32_t listIndex = shader->instructions[instructionIndex].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = shader->listNodes[listIndex];
+                if (coneStamps[listNode.instructionIndex] != coneGeneration) {
+                    coneStamps[listNode.instructionIndex] = coneGeneration;
+                    coneInstructions.emplace_back(listNode.instructionIndex);
+                }
+
+                listIndex = listNode.nextListIndex;
+            }
+        }
+
+        std::sort(coneInstructions.begin(), coneInstructions.end(), [this](uint32_t a, uint32_t b) {
+            uint32_t aLevel = shader->instructionLevels[a];
+            uint32_t bLevel = shader->instructionLevels[b];
+            return (aLevel != bLevel) ? (aLevel < bLevel) : (a < b);
+        });
+
+        // Patch the new values into the source and evaluate the instructions in order. Operands from outside the cone use
+        // the resolutions of the previous run.
+        uint32_t *sourceWords = reinterpret_cast<uint32_t *>(sourceData.data());
+        for (uint32_t specId : changedSpecIds) {
+            uint32_t wordIndex = shader->instructions[shader->specializations[specId].constantInstructionIndex].wordIndex;
+            optimizerPatchConstantWords(&shaderWords[wordIndex], newSpecConstants[lastSpecConstantIndices[specId]], &sourceWords[wordIndex]);
         }
-        case SpvOpSDiv: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.i32 / secondResolution.value.i32);
-            break;
+
+        thread_local OptimizerState state;
+        OptimizerContext c = { *shader, state, sourceData };
+        optimizerPrepareState(c);
+        for (uint32_t instructionIndex : coneInstructions) {
+            uint32_t wordIndex = shader->instructions[instructionIndex].wordIndex;
+            SpvOp opCode = SpvOp(sourceWords[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (sourceWords[wordIndex] >> 16U) & 0xFFFFU;
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            if (!hasResult) {
+                continue;
+            }
+
+            // Instructions that weren't evaluated in the previous run were eliminated, and they'll remain so if no decisions change.
+            uint32_t resultId = sourceWords[wordIndex + (hasType ? 2 : 1)];
+            if (resolutions[resultId].type == Resolution::Type::Unknown) {
+                continue;
+            }
+
+            bool allOperandsAreConstant = true;
+            uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+            bool operandWordSkipString;
+            if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+                uint32_t operandWordIndex = operandWordStart;
+                for (uint32_t j = 0; j < operandWordCount; j++) {
+                    if (checkOperandWordSkip(wordIndex, sourceWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
+                        continue;
+                    }
+
+                    if (operandWordIndex >= wordCount) {
+                        break;
+                    }
+
+                    uint32_t operandId = sourceWords[wordIndex + operandWordIndex];
+                    Resolution &operandResolution = optimizerResolution(operandId, c);
+                    if (coneStamps[shader->results[operandId].instructionIndex] != coneGeneration) {
+                        operandResolution = resolutions[operandId];
+                    }
+
+                    // All operands are seeded, as loads from constant tables read the indices of the access chain.
+                    if (operandResolution.type == Resolution::Type::Unknown) {
+                        return false;
+                    }
+                    else if (operandResolution.type == Resolution::Type::Variable) {
+                        allOperandsAreConstant = false;
+                    }
+
+                    operandWordIndex += operandWordStride;
+                }
+            }
+
+            // The value stored to a local variable is seeded like an operand for the loads that resolve to it.
+            uint32_t localLoadIndex = (opCode == SpvOpLoad) ? shader->findLocalLoad(instructionIndex) : UINT32_MAX;
+            if (localLoadIndex != UINT32_MAX) {
+                uint32_t valueId = shader->localValues[shader->localLoads[localLoadIndex].valueIndex].resultId;
+                if (coneStamps[shader->results[valueId].instructionIndex] != coneGeneration) {
+                    optimizerResolution(valueId, c) = resolutions[valueId];
+                }
+            }
+
+            if (allOperandsAreConstant) {
+                optimizerEvaluateResult(resultId, c);
+            }
+            else if ((opCode != SpvOpLoad) || !optimizerEvaluateLoad(wordIndex, c)) {
+                optimizerResolution(resultId, c).type = Resolution::Type::Variable;
+            }
         }
-        case SpvOpLogicalEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) == (secondResolution.value.u32 != 0));
-            break;
+
+        // The known bits are found from the resolutions of both runs. Every result outside of the cone keeps its previous
+        // resolution, so both contexts are only seeded once a switch needs them.
+        thread_local OptimizerState previousState;
+        OptimizerContext previousContext = { *shader, previousState, sourceData };
+        bool knownBitsSeeded = false;
+        auto knownZeroBits = [&](uint32_t selectorId, OptimizerContext &selectorContext) {
+            if (!knownBitsSeeded) {
+                optimizerPrepareState(previousContext);
+                uint32_t resultCount = uint32_t(shader->results.size());
+                for (uint32_t i = 0; i < resultCount; i++) {
+                    uint32_t resultInstructionIndex = shader->results[i].instructionIndex;
+                    optimizerResolution(i, previousContext) = resolutions[i];
+                    if ((resultInstructionIndex != UINT32_MAX) && (coneStamps[resultInstructionIndex] != coneGeneration)) {
+                        optimizerResolution(i, c) = resolutions[i];
+                    }
+                }
+
+                knownBitsSeeded = true;
+            }
+
+            return optimizerKnownZeroBits(selectorId, 0, selectorContext);
+        };
+
+        // Compare the decisions of all the terminators that depend on the changed constants.
+        for (uint32_t instructionIndex : coneInstructions) {
+            uint32_t wordIndex = shader->instructions[instructionIndex].wordIndex;
+            SpvOp opCode = SpvOp(sourceWords[wordIndex] & 0xFFFFU);
+            if ((opCode != SpvOpBranchConditional) && (opCode != SpvOpSwitch)) {
+                continue;
+            }
+
+            uint32_t operatorId = sourceWords[wordIndex + 1];
+            const Resolution &previousResolution = resolutions[operatorId];
+            const Resolution &newResolution = optimizerResolution(operatorId, c);
+            if (previousResolution.type == Resolution::Type::Unknown) {
+                continue;
+            }
+            else if (previousResolution.type != newResolution.type) {
+                return false;
+            }
+            else if (newResolution.type != Resolution::Type::Constant) {
+                // Switches on unknown values can be simplified from the bits of the selector that are known, which
+                // might depend on the changed constants.
+                if ((opCode == SpvOpSwitch) && (knownZeroBits(operatorId, previousContext) != knownZeroBits(operatorId, c))) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (opCode == SpvOpBranchConditional) {
+                if ((previousResolution.value.u32 != 0) != (newResolution.value.u32 != 0)) {
+                    return false;
+                }
+            }
+            else {
+                uint32_t wordCount = (sourceWords[wordIndex] >> 16U) & 0xFFFFU;
+                uint32_t previousLabelId = sourceWords[wordIndex + 2];
+                uint32_t newLabelId = sourceWords[wordIndex + 2];
+                for (uint32_t i = 3; i < wordCount; i += 2) {
+                    if (previousResolution.value.u32 == sourceWords[wordIndex + i]) {
+                        previousLabelId = sourceWords[wordIndex + i + 1];
+                    }
+
+                    if (newResolution.value.u32 == sourceWords[wordIndex + i]) {
+                        newLabelId = sourceWords[wordIndex + i + 1];
+                    }
+                }
+
+                if (previousLabelId != newLabelId) {
+                    return false;
+                }
+            }
         }
-        case SpvOpLogicalNotEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) != (secondResolution.value.u32 != 0));
-            break;
+
+        // The output keeps the same structure, so only the constants need to be patched in.
+        for (uint32_t instructionIndex : coneInstructions) {
+            uint32_t wordIndex = shader->instructions[instructionIndex].wordIndex;
+            SpvOp opCode = SpvOp(sourceWords[wordIndex] & 0xFFFFU);
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            if (hasResult) {
+                uint32_t resultId = sourceWords[wordIndex + (hasType ? 2 : 1)];
+                resolutions[resultId] = optimizerResolution(resultId, c);
+            }
         }
-        case SpvOpLogicalOr: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) || (secondResolution.value.u32 != 0));
-            break;
+
+        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(optimizedData.data());
+        for (uint32_t specId : changedSpecIds) {
+            const SpecConstant &newSpecConstant = newSpecConstants[lastSpecConstantIndices[specId]];
+            if (specConstantWordIndices[specId] != UINT32_MAX) {
+                uint32_t wordIndex = shader->instructions[shader->specializations[specId].constantInstructionIndex].wordIndex;
+                optimizerPatchConstantWords(&shaderWords[wordIndex], newSpecConstant, &optimizedWords[specConstantWordIndices[specId]]);
+            }
+
+            specConstants[specId].values = newSpecConstant.values;
         }
-        case SpvOpLogicalAnd: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool((firstResolution.value.u32 != 0) && (secondResolution.value.u32 != 0));
-            break;
+
+        return true;
+    }
+
+    // BatchEvaluator
+
+    struct BatchOperation {
+        SpvOp opCode = SpvOpNop;
+        uint32_t extInstruction = UINT32_MAX;
+        uint32_t resultSlot = UINT32_MAX;
+        uint32_t operandSlots[4] = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+    };
+
+    static bool batchIsSupported(SpvOp opCode) {
+        switch (opCode) {
+        case SpvOpBitcast:
+        case SpvOpIAdd:
+        case SpvOpISub:
+        case SpvOpIMul:
+        case SpvOpUDiv:
+        case SpvOpSDiv:
+        case SpvOpUMod:
+        case SpvOpSRem:
+        case SpvOpSMod:
+        case SpvOpSNegate:
+        case SpvOpLogicalEqual:
+        case SpvOpLogicalNotEqual:
+        case SpvOpLogicalOr:
+        case SpvOpLogicalAnd:
+        case SpvOpLogicalNot:
+        case SpvOpSelect:
+        case SpvOpIEqual:
+        case SpvOpINotEqual:
+        case SpvOpUGreaterThan:
+        case SpvOpSGreaterThan:
+        case SpvOpUGreaterThanEqual:
+        case SpvOpSGreaterThanEqual:
+        case SpvOpULessThan:
+        case SpvOpSLessThan:
+        case SpvOpULessThanEqual:
+        case SpvOpSLessThanEqual:
+        case SpvOpShiftRightLogical:
+        case SpvOpShiftRightArithmetic:
+        case SpvOpShiftLeftLogical:
+        case SpvOpBitwiseOr:
+        case SpvOpBitwiseAnd:
+        case SpvOpBitwiseXor:
+        case SpvOpNot:
+        case SpvOpBitFieldInsert:
+        case SpvOpBitFieldSExtract:
+        case SpvOpBitFieldUExtract:
+        case SpvOpBitReverse:
+        case SpvOpBitCount:
+            return true;
+        default:
+            return false;
         }
-        case SpvOpLogicalNot: {
-            const Resolution &operandResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            resolution = Resolution::fromBool(operandResolution.value.u32 == 0);
-            break;
+    }
+
+    static void batchEvaluateOperation(const BatchOperation &operation, std::vector<uint32_t> &laneValues, std::vector<uint32_t> &laneMasks) {
+        const uint32_t LaneCount = BatchEvaluator::LaneCount;
+        uint32_t resultMask = (operation.opCode != SpvOpNop) ? ((1U << LaneCount) - 1U) : 0U;
+        for (uint32_t i = 0; i < 4; i++) {
+            if (operation.operandSlots[i] != UINT32_MAX) {
+                resultMask &= laneMasks[operation.operandSlots[i]];
+            }
         }
-        case SpvOpSelect: {
-            const Resolution &conditionResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 5]];
-            resolution = (conditionResolution.value.u32 != 0) ? firstResolution : secondResolution;
-            break;
+
+        laneMasks[operation.resultSlot] = resultMask;
+        if (resultMask == 0) {
+            return;
         }
-        case SpvOpIEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.u32 == secondResolution.value.u32);
-            break;
+
+        // Copy the operands to local arrays so the compiler knows they don't alias with the result.
+        uint32_t first[LaneCount] = {};
+        uint32_t second[LaneCount] = {};
+        uint32_t third[LaneCount] = {};
+        uint32_t fourth[LaneCount] = {};
+        uint32_t result[LaneCount] = {};
+        uint32_t invalid[LaneCount] = {};
+        uint32_t *operandLanes[4] = { first, second, third, fourth };
+        for (uint32_t i = 0; i < 4; i++) {
+            if (operation.operandSlots[i] != UINT32_MAX) {
+                memcpy(operandLanes[i], &laneValues[operation.operandSlots[i] * LaneCount], sizeof(first));
+            }
         }
-        case SpvOpINotEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.u32 != secondResolution.value.u32);
+
+        switch (operation.opCode) {
+        case SpvOpBitcast:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l];
+            }
+
             break;
-        }
-        case SpvOpUGreaterThan: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.u32 > secondResolution.value.u32);
+        case SpvOpIAdd:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l] + second[l];
+            }
+
             break;
-        }
-        case SpvOpSGreaterThan: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.i32 > secondResolution.value.i32);
+        case SpvOpISub:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l] - second[l];
+            }
+
+            break;
+        case SpvOpIMul:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l] * second[l];
+            }
+
+            break;
+        case SpvOpUDiv:
+            // Lanes that divide by zero can't be folded.
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] == 0);
+                result[l] = first[l] / (invalid[l] ? 1U : second[l]);
+            }
+
+            break;
+        case SpvOpSDiv:
+            // Lanes that divide by zero or overflow can't be folded.
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] == 0) || ((first[l] == 0x80000000U) && (second[l] == UINT32_MAX));
+                result[l] = uint32_t(int32_t(first[l]) / (invalid[l] ? 1 : int32_t(second[l])));
+            }
+
+            break;
+        case SpvOpUMod:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] == 0);
+                result[l] = first[l] % (invalid[l] ? 1U : second[l]);
+            }
+
+            break;
+        case SpvOpSRem:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] == 0) || ((first[l] == 0x80000000U) && (second[l] == UINT32_MAX));
+                result[l] = uint32_t(int32_t(first[l]) % (invalid[l] ? 1 : int32_t(second[l])));
+            }
+
+            break;
+        case SpvOpSMod:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] == 0) || ((first[l] == 0x80000000U) && (second[l] == UINT32_MAX));
+                int32_t divisor = invalid[l] ? 1 : int32_t(second[l]);
+                int32_t remainder = int32_t(first[l]) % divisor;
+                result[l] = uint32_t(((remainder != 0) && ((remainder < 0) != (divisor < 0))) ? (remainder + divisor) : remainder);
+            }
+
+            break;
+        case SpvOpSNegate:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = 0U - first[l];
+            }
+
+            break;
+        case SpvOpLogicalEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = ((first[l] != 0) == (second[l] != 0));
+            }
+
+            break;
+        case SpvOpLogicalNotEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = ((first[l] != 0) != (second[l] != 0));
+            }
+
+            break;
+        case SpvOpLogicalOr:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = ((first[l] | second[l]) != 0);
+            }
+
+            break;
+        case SpvOpLogicalAnd:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = ((first[l] != 0) & (second[l] != 0));
+            }
+
+            break;
+        case SpvOpLogicalNot:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] == 0);
+            }
+
+            break;
+        case SpvOpSelect:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] != 0) ? second[l] : third[l];
+            }
+
+            break;
+        case SpvOpIEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] == second[l]);
+            }
+
+            break;
+        case SpvOpINotEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] != second[l]);
+            }
+
+            break;
+        case SpvOpUGreaterThan:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] > second[l]);
+            }
+
+            break;
+        case SpvOpSGreaterThan:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (int32_t(first[l]) > int32_t(second[l]));
+            }
+
+            break;
+        case SpvOpUGreaterThanEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] >= second[l]);
+            }
+
+            break;
+        case SpvOpSGreaterThanEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (int32_t(first[l]) >= int32_t(second[l]));
+            }
+
+            break;
+        case SpvOpULessThan:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] < second[l]);
+            }
+
+            break;
+        case SpvOpSLessThan:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (int32_t(first[l]) < int32_t(second[l]));
+            }
+
             break;
-        }
-        case SpvOpUGreaterThanEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.u32 >= secondResolution.value.u32);
+        case SpvOpULessThanEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (first[l] <= second[l]);
+            }
+
             break;
-        }
-        case SpvOpSGreaterThanEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.i32 >= secondResolution.value.i32);
+        case SpvOpSLessThanEqual:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = (int32_t(first[l]) <= int32_t(second[l]));
+            }
+
             break;
-        }
-        case SpvOpULessThan: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.u32 < secondResolution.value.u32);
+        case SpvOpShiftRightLogical:
+            // Lanes that shift by the bit width or more can't be folded.
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] >= 32);
+                result[l] = first[l] >> (second[l] & 31U);
+            }
+
             break;
-        }
-        case SpvOpSLessThan: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.i32 < secondResolution.value.i32);
+        case SpvOpShiftRightArithmetic:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] >= 32);
+                result[l] = uint32_t(int32_t(first[l]) >> (second[l] & 31U));
+            }
+
             break;
-        }
-        case SpvOpULessThanEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.u32 <= secondResolution.value.u32);
+        case SpvOpShiftLeftLogical:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                invalid[l] = (second[l] >= 32);
+                result[l] = first[l] << (second[l] & 31U);
+            }
+
             break;
-        }
-        case SpvOpSLessThanEqual: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromBool(firstResolution.value.i32 <= secondResolution.value.i32);
+        case SpvOpBitwiseOr:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l] | second[l];
+            }
+
             break;
-        }
-        case SpvOpShiftRightLogical: {
-            const Resolution &baseResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &shiftResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(baseResolution.value.u32 >> shiftResolution.value.u32);
+        case SpvOpBitwiseAnd:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l] & second[l];
+            }
+
             break;
-        }
-        case SpvOpShiftRightArithmetic: {
-            const Resolution &baseResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &shiftResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromInt32(baseResolution.value.i32 >> shiftResolution.value.i32);
+        case SpvOpBitwiseXor:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = first[l] ^ second[l];
+            }
+
             break;
-        }
-        case SpvOpShiftLeftLogical: {
-            const Resolution &baseResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &shiftResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(baseResolution.value.u32 << shiftResolution.value.u32);
+        case SpvOpNot:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                result[l] = ~first[l];
+            }
+
             break;
-        }
-        case SpvOpBitwiseOr: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.u32 | secondResolution.value.u32);
+        case SpvOpBitFieldInsert:
+            // Lanes with fields that don't fit in the value can't be folded.
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                uint32_t offset = third[l], count = fourth[l];
+                invalid[l] = (offset > 32) || (count > 32) || ((offset + count) > 32);
+                uint32_t mask = (count >= 32) ? UINT32_MAX : (((1U << (count & 31U)) - 1U) << (offset & 31U));
+                result[l] = (first[l] & ~mask) | ((second[l] << (offset & 31U)) & mask);
+            }
+
             break;
-        }
-        case SpvOpBitwiseAnd: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.u32 & secondResolution.value.u32);
+        case SpvOpBitFieldSExtract:
+        case SpvOpBitFieldUExtract:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                uint32_t offset = second[l], count = third[l];
+                invalid[l] = (offset > 32) || (count > 32) || ((offset + count) > 32);
+                uint32_t fieldMask = (count >= 32) ? UINT32_MAX : ((1U << (count & 31U)) - 1U);
+                uint32_t field = (first[l] >> (offset & 31U)) & fieldMask;
+                uint32_t signBit = (count - 1U) & 31U;
+                bool extendSign = (operation.opCode == SpvOpBitFieldSExtract) && (count > 0) && (count < 32) && ((field >> signBit) & 1U);
+                result[l] = extendSign ? (field | ~fieldMask) : field;
+            }
+
             break;
-        }
-        case SpvOpBitwiseXor: {
-            const Resolution &firstResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            const Resolution &secondResolution = c.resolutions[optimizedWords[resultWordIndex + 4]];
-            resolution = Resolution::fromUint32(firstResolution.value.u32 ^ secondResolution.value.u32);
+        case SpvOpBitReverse:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                uint32_t value = first[l];
+                value = ((value >> 1U) & 0x55555555U) | ((value & 0x55555555U) << 1U);
+                value = ((value >> 2U) & 0x33333333U) | ((value & 0x33333333U) << 2U);
+                value = ((value >> 4U) & 0x0F0F0F0FU) | ((value & 0x0F0F0F0FU) << 4U);
+                value = ((value >> 8U) & 0x00FF00FFU) | ((value & 0x00FF00FFU) << 8U);
+                result[l] = (value >> 16U) | (value << 16U);
+            }
+
             break;
-        }
-        case SpvOpNot: {
-            const Resolution &operandResolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
-            resolution = Resolution::fromUint32(~operandResolution.value.u32);
+        case SpvOpBitCount:
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                uint32_t value = first[l];
+                value = value - ((value >> 1U) & 0x55555555U);
+                value = (value & 0x33333333U) + ((value >> 2U) & 0x33333333U);
+                value = (value + (value >> 4U)) & 0x0F0F0F0FU;
+                result[l] = (value * 0x01010101U) >> 24U;
+            }
+
             break;
-        }
-        case SpvOpPhi: {
-            // Resolve as constant if Phi operator was compacted to only one option.
-            if (wordCount == 5) {
-                resolution = c.resolutions[optimizedWords[resultWordIndex + 3]];
+        case SpvOpExtInst: {
+            uint32_t operandCount = 0;
+            while ((operandCount < 4) && (operation.operandSlots[operandCount] != UINT32_MAX)) {
+                operandCount++;
             }
-            else {
-                resolution.type = Resolution::Type::Variable;
+
+            for (uint32_t l = 0; l < LaneCount; l++) {
+                const uint32_t operands[3] = { first[l], second[l], third[l] };
+                invalid[l] = !optimizerFoldGLSLInteger(operation.extInstruction, operands, operandCount, result[l]);
             }
 
             break;
         }
         default:
-            // It's not known how to evaluate the instruction, consider the result a variable.
-            resolution.type = Resolution::Type::Variable;
             break;
         }
-    }
 
-    static void optimizerReduceLabelDegree(uint32_t firstLabelId, OptimizerContext &c) {
-        thread_local std::vector<uint32_t> labelStack;
-        thread_local std::vector<uint32_t> resultStack;
-        thread_local std::vector<uint32_t> degreeReductions;
-        labelStack.emplace_back(firstLabelId);
-        resultStack.clear();
-        degreeReductions.clear();
+        for (uint32_t l = 0; l < LaneCount; l++) {
+            resultMask &= ~(invalid[l] << l);
+        }
 
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        while (!labelStack.empty()) {
-            uint32_t labelId = labelStack.back();
-            labelStack.pop_back();
+        laneMasks[operation.resultSlot] = resultMask;
+        memcpy(&laneValues[operation.resultSlot * LaneCount], result, sizeof(result));
+    }
 
-            uint32_t instructionIndex = c.shader.results[labelId].instructionIndex;
-            if (c.instructionInDegrees[instructionIndex] == 0) {
-                continue;
+    bool BatchEvaluator::run(const Shader &shader, const std::vector<std::vector<SpecConstant>> &variants, BatchDecisions &decisions) {
+        decisions.terminatorIndices.clear();
+        decisions.labelIds.clear();
+        decisions.variantCount = uint32_t(variants.size());
+
+        // Gather all the instructions that depend on any of the spec constants.
+        thread_local std::vector<uint32_t> coneInstructions;
+        thread_local std::vector<uint8_t> coneFlags;
+        uint32_t instructionCount = uint32_t(shader.instructions.size());
+        coneInstructions.clear();
+        coneFlags.clear();
+        coneFlags.resize(instructionCount, 0);
+        for (const Specialization &specialization : shader.specializations) {
+            if (specialization.constantInstructionIndex != UINT32_MAX) {
+                coneFlags[specialization.constantInstructionIndex] = 1;
+                coneInstructions.emplace_back(specialization.constantInstructionIndex);
             }
+        }
 
-            c.instructionInDegrees[instructionIndex]--;
-
-            // If a label's degree becomes 0, eliminate all the instructions of the block.
-            // Eliminate as many instructions as possible until finding the terminator of the block.
-            // When finding the terminator, look at the labels it has and push them to the stack to
-            // reduce their degrees as well.
-            if (c.instructionInDegrees[instructionIndex] == 0) {
-                bool foundTerminator = false;
-                uint32_t instructionCount = c.shader.instructions.size();
-                for (uint32_t i = instructionIndex; (i < instructionCount) && !foundTerminator; i++) {
-                    uint32_t wordIndex = c.shader.instructions[i].wordIndex;
-                    if (optimizedWords[wordIndex] == UINT32_MAX) {
-                        continue;
-                    }
-
-                    // If the instruction has labels it can reference, we push the labels to reduce their degrees as well.
-                    SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
-                    uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-                    uint32_t labelWordStart, labelWordCount, labelWordStride;
-                    if (SpvHasLabels(opCode, labelWordStart, labelWordCount, labelWordStride)) {
-                        for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < wordCount); j++) {
-                            uint32_t terminatorLabelId = optimizedWords[wordIndex + labelWordStart + j * labelWordStride];
-                            labelStack.emplace_back(terminatorLabelId);
-                        }
-                    }
-
-                    // If the instruction has operands, decrease their degree.
-                    uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
-                    bool operandWordSkipString;
-                    if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
-                        uint32_t operandWordIndex = operandWordStart;
-                        for (uint32_t j = 0; j < operandWordCount; j++) {
-                            if (checkOperandWordSkip(wordIndex, optimizedWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
-                                continue;
-                            }
-
-                            if (operandWordIndex >= wordCount) {
-                                break;
-                            }
-
-                            uint32_t operandId = optimizedWords[wordIndex + operandWordIndex];
-                            resultStack.emplace_back(operandId);
-                            operandWordIndex += operandWordStride;
-                        }
-                    }
+        const uint32_t *words = shader.spirvWords;
+        for (uint32_t i = 0; i < coneInstructions.size(); i++) {
+            uint32_t instructionIndex = coneInstructions[i];
+            SpvOp opCode = SpvOp(words[shader.instructions[instructionIndex].wordIndex] & 0xFFFFU);
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            if (!hasResult) {
+                continue;
+            }
 
-                    foundTerminator = SpvOpIsTerminator(opCode);
-                    optimizerEliminateInstruction(i, c);
+            uint32_t listIndex = shader.instructions[instructionIndex].adjacentListIndex;
+            while (listIndex != UINT32_MAX) {
+                const ListNode &listNode = shader.listNodes[listIndex];
+                if (coneFlags[listNode.instructionIndex] == 0) {
+                    coneFlags[listNode.instructionIndex] = 1;
+                    coneInstructions.emplace_back(listNode.instructionIndex);
                 }
+
+                listIndex = listNode.nextListIndex;
             }
         }
 
-        optimizerReduceResultDegrees(c, resultStack);
-    }
-
-    static void optimizerEvaluateTerminator(uint32_t instructionIndex, OptimizerContext &c) {
-        // For each type of supported terminator, check if the operands can be resolved into constants.
-        // If they can be resolved, eliminate any other branches that don't pass the condition.
-        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
-        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-        uint32_t defaultLabelId = UINT32_MAX;
+        std::sort(coneInstructions.begin(), coneInstructions.end(), [&shader](uint32_t a, uint32_t b) {
+            uint32_t aLevel = shader.instructionLevels[a];
+            uint32_t bLevel = shader.instructionLevels[b];
+            return (aLevel != bLevel) ? (aLevel < bLevel) : (a < b);
+        });
+
+        // Assign a slot of lanes to every result in the cone. Operands from outside the cone have the same value in every
+        // lane, and their lanes are only valid if they're a constant the optimizer can evaluate.
+        thread_local std::vector<uint32_t> resultSlots;
+        thread_local std::vector<uint32_t> laneValues;
+        thread_local std::vector<uint32_t> laneMasks;
+        thread_local std::vector<uint32_t> specSlots;
+        thread_local std::vector<uint8_t> specBooleans;
+        thread_local std::vector<BatchOperation> operations;
+        thread_local std::vector<std::pair<uint32_t, uint32_t>> terminators;
+        resultSlots.clear();
+        resultSlots.resize(shader.results.size(), UINT32_MAX);
+        laneValues.clear();
+        laneMasks.clear();
+        specSlots.clear();
+        specSlots.resize(shader.specializations.size(), UINT32_MAX);
+        specBooleans.clear();
+        specBooleans.resize(shader.specializations.size(), 0);
+        operations.clear();
+        terminators.clear();
+
+        auto addSlot = [&](uint32_t resultId) {
+            resultSlots[resultId] = uint32_t(laneMasks.size());
+            laneMasks.emplace_back(0);
+            laneValues.resize(laneValues.size() + LaneCount, 0);
+            return resultSlots[resultId];
+        };
 
-        // Both instructions share that the second word is the operator they must use to resolve the condition.
-        // Operator can't be anything but a constant to be able to resolve a terminator.
-        const uint32_t operatorId = optimizedWords[wordIndex + 1];
-        const Resolution &operatorResolution = c.resolutions[operatorId];
-        if (operatorResolution.type != Resolution::Type::Constant) {
-            return;
-        }
-        
-        if (opCode == SpvOpBranchConditional) {
-            // Branch conditional only needs to choose either label depending on whether the result is true or false.
-            if (operatorResolution.value.u32) {
-                defaultLabelId = optimizedWords[wordIndex + 2];
-                optimizerReduceLabelDegree(optimizedWords[wordIndex + 3], c);
+        auto operandSlot = [&](uint32_t operandId) {
+            if (resultSlots[operandId] != UINT32_MAX) {
+                return resultSlots[operandId];
             }
-            else {
-                defaultLabelId = optimizedWords[wordIndex + 3];
-                optimizerReduceLabelDegree(optimizedWords[wordIndex + 2], c);
+
+            uint32_t slot = addSlot(operandId);
+            uint32_t value;
+            if (optimizerConstantValue(shader, shader.results[operandId].instructionIndex, value)) {
+                laneMasks[slot] = (1U << LaneCount) - 1U;
+                std::fill(laneValues.begin() + slot * LaneCount, laneValues.begin() + (slot + 1) * LaneCount, value);
             }
 
-            // If there's a selection merge before this branch, we place the unconditional branch in its place.
-            const uint32_t mergeWordCount = 3;
-            uint32_t mergeWordIndex = wordIndex - mergeWordCount;
-            SpvOp mergeOpCode = SpvOp(optimizedWords[mergeWordIndex] & 0xFFFFU);
+            return slot;
+        };
 
-            uint32_t patchWordIndex;
-            if (mergeOpCode == SpvOpSelectionMerge) {
-                optimizerReduceLabelDegree(optimizedWords[mergeWordIndex + 1], c);
-                patchWordIndex = mergeWordIndex;
+        for (uint32_t specId = 0; specId < shader.specializations.size(); specId++) {
+            uint32_t instructionIndex = shader.specializations[specId].constantInstructionIndex;
+            if (instructionIndex == UINT32_MAX) {
+                continue;
             }
-            else {
-                patchWordIndex = wordIndex;
+
+            uint32_t wordIndex = shader.instructions[instructionIndex].wordIndex;
+            uint32_t slot = addSlot(words[wordIndex + 2]);
+            uint32_t value;
+            if (optimizerConstantValue(shader, instructionIndex, value)) {
+                SpvOp opCode = SpvOp(words[wordIndex] & 0xFFFFU);
+                specSlots[specId] = slot;
+                specBooleans[specId] = (opCode == SpvOpSpecConstantTrue) || (opCode == SpvOpSpecConstantFalse);
             }
+        }
 
-            // Make the final label the new default case and reduce the word count.
-            optimizedWords[patchWordIndex] = SpvOpBranch | (2U << 16U);
-            optimizedWords[patchWordIndex + 1] = defaultLabelId;
+        for (uint32_t instructionIndex : coneInstructions) {
+            uint32_t wordIndex = shader.instructions[instructionIndex].wordIndex;
+            SpvOp opCode = SpvOp(words[wordIndex] & 0xFFFFU);
+            uint32_t wordCount = (words[wordIndex] >> 16U) & 0xFFFFU;
+            if ((opCode == SpvOpBranchConditional) || (opCode == SpvOpSwitch)) {
+                terminators.emplace_back(instructionIndex, operandSlot(words[wordIndex + 1]));
+                continue;
+            }
 
-            // Eliminate any remaining words on the block.
-            for (uint32_t i = patchWordIndex + 2; i < (wordIndex + wordCount); i++) {
-                optimizedWords[i] = UINT32_MAX;
+            bool hasResult, hasType;
+            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            uint32_t resultId = words[wordIndex + (hasType ? 2 : 1)];
+            if (!hasResult || (resultSlots[resultId] != UINT32_MAX)) {
+                continue;
             }
-        }
-        else if (opCode == SpvOpSwitch) {
-            // Switch must compare the integer result of the operator to all the possible labels.
-            // If the label is not as possible result, then reduce its block's degree.
-            for (uint32_t i = 3; i < wordCount; i += 2) {
-                if (operatorResolution.value.u32 == optimizedWords[wordIndex + i]) {
-                    defaultLabelId = optimizedWords[wordIndex + i + 1];
+
+            BatchOperation operation;
+            operation.resultSlot = addSlot(resultId);
+            if (batchIsSupported(opCode)) {
+                operation.opCode = opCode;
+                uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
+                bool operandWordSkipString;
+                if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
+                    uint32_t operandWordIndex = operandWordStart;
+                    for (uint32_t j = 0; (j < operandWordCount) && (j < 4) && (operandWordIndex < wordCount); j++) {
+                        operation.operandSlots[j] = operandSlot(words[wordIndex + operandWordIndex]);
+                        operandWordIndex += operandWordStride;
+                    }
                 }
-                else {
-                    optimizerReduceLabelDegree(optimizedWords[wordIndex + i + 1], c);
+            }
+            else if ((opCode == SpvOpExtInst) && (wordCount <= 8)) {
+                // The operands of the extended instruction come after the set and the instruction number.
+                uint32_t setWordIndex = shader.instructions[shader.results[words[wordIndex + 3]].instructionIndex].wordIndex;
+                if (optimizerIsGLSLInstructionSet(words, setWordIndex)) {
+                    operation.opCode = opCode;
+                    operation.extInstruction = words[wordIndex + 4];
+                    for (uint32_t j = 5; j < wordCount; j++) {
+                        operation.operandSlots[j - 5] = operandSlot(words[wordIndex + j]);
+                    }
                 }
             }
 
-            // If none are chosen, the default label is selected. Otherwise, reduce the block's degree
-            // for the default label.
-            if (defaultLabelId == UINT32_MAX) {
-                defaultLabelId = optimizedWords[wordIndex + 2];
-            }
-            else {
-                optimizerReduceLabelDegree(optimizedWords[wordIndex + 2], c);
+            operations.emplace_back(operation);
+        }
+
+        std::sort(terminators.begin(), terminators.end());
+        for (const std::pair<uint32_t, uint32_t> &terminator : terminators) {
+            decisions.terminatorIndices.emplace_back(terminator.first);
+        }
+
+        // Evaluate the variants in groups as big as the lane count.
+        uint32_t terminatorCount = uint32_t(terminators.size());
+        uint32_t variantCount = uint32_t(variants.size());
+        decisions.labelIds.resize(size_t(terminatorCount) * variantCount, UINT32_MAX);
+        for (uint32_t firstVariant = 0; firstVariant < variantCount; firstVariant += LaneCount) {
+            uint32_t laneCount = std::min(LaneCount, variantCount - firstVariant);
+            for (uint32_t slot : specSlots) {
+                if (slot != UINT32_MAX) {
+                    laneMasks[slot] = 0;
+                }
             }
 
-            // Make the final label the new default case and reduce the word count.
-            optimizedWords[wordIndex] = SpvOpSwitch | (3U << 16U);
-            optimizedWords[wordIndex + 1] = c.shader.defaultSwitchOpConstantInt;
-            optimizedWords[wordIndex + 2] = defaultLabelId;
+            // Spec constants that aren't provided by a variant can't be folded in its lane.
+            for (uint32_t l = 0; l < laneCount; l++) {
+                for (const SpecConstant &specConstant : variants[firstVariant + l]) {
+                    if ((specConstant.specId >= specSlots.size()) || (specSlots[specConstant.specId] == UINT32_MAX)) {
+                        continue;
+                    }
 
-            // Increase the degree of the default constant that was chosen so it's not considered as dead code.
-            uint32_t defaultConstantInstructionIndex = c.shader.results[c.shader.defaultSwitchOpConstantInt].instructionIndex;
-            c.instructionOutDegrees[defaultConstantInstructionIndex]++;
+                    uint32_t slot = specSlots[specConstant.specId];
+                    if (specConstant.values.size() == 1) {
+                        // Booleans are patched as true for any value that isn't zero.
+                        laneValues[slot * LaneCount + l] = specBooleans[specConstant.specId] ? uint32_t(specConstant.values[0] != 0) : specConstant.values[0];
+                        laneMasks[slot] |= (1U << l);
+                    }
+                    else {
+                        laneMasks[slot] &= ~(1U << l);
+                    }
+                }
+            }
 
-            // Eliminate any remaining words on the block.
-            for (uint32_t i = wordIndex + 3; i < (wordIndex + wordCount); i++) {
-                optimizedWords[i] = UINT32_MAX;
+            for (const BatchOperation &operation : operations) {
+                batchEvaluateOperation(operation, laneValues, laneMasks);
             }
-        }
 
-        // The condition operator can be discarded.
-        thread_local std::vector<uint32_t> resultStack;
-        resultStack.clear();
-        resultStack.emplace_back(operatorId);
-        optimizerReduceResultDegrees(c, resultStack);
-    }
+            for (uint32_t t = 0; t < terminatorCount; t++) {
+                uint32_t wordIndex = shader.instructions[terminators[t].first].wordIndex;
+                SpvOp opCode = SpvOp(words[wordIndex] & 0xFFFFU);
+                uint32_t wordCount = (words[wordIndex] >> 16U) & 0xFFFFU;
+                uint32_t slot = terminators[t].second;
+                for (uint32_t l = 0; l < laneCount; l++) {
+                    if ((laneMasks[slot] & (1U << l)) == 0) {
+                        continue;
+                    }
 
-    static bool optimizerCompactPhi(uint32_t instructionIndex, OptimizerContext &c) {
-        // Do a backwards search first to find out what label this instruction belongs to.
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        uint32_t searchInstructionIndex = instructionIndex;
-        uint32_t instructionLabelId = UINT32_MAX;
-        while (searchInstructionIndex > 0) {
-            uint32_t searchWordIndex = c.shader.instructions[searchInstructionIndex].wordIndex;
-            SpvOp searchOpCode = SpvOp(optimizedWords[searchWordIndex] & 0xFFFFU);
-            if (searchOpCode == SpvOpLabel) {
-                instructionLabelId = optimizedWords[searchWordIndex + 1];
-                break;
-            }
+                    uint32_t value = laneValues[slot * LaneCount + l];
+                    uint32_t labelId;
+                    if (opCode == SpvOpBranchConditional) {
+                        labelId = (value != 0) ? words[wordIndex + 2] : words[wordIndex + 3];
+                    }
+                    else {
+                        labelId = words[wordIndex + 2];
+                        for (uint32_t i = 3; (i + 1) < wordCount; i += 2) {
+                            if (value == words[wordIndex + i]) {
+                                labelId = words[wordIndex + i + 1];
+                            }
+                        }
+                    }
 
-            searchInstructionIndex--;
+                    decisions.labelIds[size_t(firstVariant + l) * terminatorCount + t] = labelId;
+                }
+            }
         }
 
-        if (instructionLabelId == UINT32_MAX) {
-            fprintf(stderr, "Unable to find a label before OpPhi.\n");
+        return true;
+    }
+
+    bool Optimizer::runBatch(const Shader &shader, const std::vector<std::vector<SpecConstant>> &variants, std::vector<std::vector<uint8_t>> &optimizedData) {
+        BatchDecisions decisions;
+        if (!BatchEvaluator::run(shader, variants, decisions)) {
             return false;
         }
 
-        thread_local std::vector<uint32_t> resultStack;
-        resultStack.clear();
+        // Group the variants that take the same decisions so the specializer only has to patch the constants between them.
+        uint32_t terminatorCount = uint32_t(decisions.terminatorIndices.size());
+        std::vector<uint32_t> variantOrder(variants.size());
+        for (uint32_t i = 0; i < variantOrder.size(); i++) {
+            variantOrder[i] = i;
+        }
 
-        uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
-        uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-        uint32_t newWordCount = 3;
-        uint32_t instructionCount = c.shader.instructions.size();
-        for (uint32_t i = 3; i < wordCount; i += 2) {
-            uint32_t labelId = optimizedWords[wordIndex + i + 1];
-            uint32_t labelInstructionIndex = c.shader.results[labelId].instructionIndex;
-            uint32_t labelWordIndex = c.shader.instructions[labelInstructionIndex].wordIndex;
+        std::stable_sort(variantOrder.begin(), variantOrder.end(), [&](uint32_t a, uint32_t b) {
+            const uint32_t *aLabelIds = &decisions.labelIds[size_t(a) * terminatorCount];
+            const uint32_t *bLabelIds = &decisions.labelIds[size_t(b) * terminatorCount];
+            return std::lexicographical_compare(aLabelIds, aLabelIds + terminatorCount, bLabelIds, bLabelIds + terminatorCount);
+        });
+
+        // Only the first variant of each group is optimized. When every decision of the group is known, the output only
+        // depends on them, so the constants of the other variants are patched directly into a copy of it. Otherwise the
+        // specializer checks the decisions that the batch evaluator couldn't make.
+        optimizedData.resize(variants.size());
+        Specializer specializer(shader);
+        uint32_t specializationCount = uint32_t(shader.specializations.size());
+        std::vector<uint32_t> lastSpecConstantIndices;
+        const uint32_t *groupLabelIds = nullptr;
+        bool groupDecided = false;
+        for (uint32_t i : variantOrder) {
+            const std::vector<SpecConstant> &variant = variants[i];
+            const uint32_t *labelIds = &decisions.labelIds[size_t(i) * terminatorCount];
+            bool sameGroup = (groupLabelIds != nullptr) && std::equal(labelIds, labelIds + terminatorCount, groupLabelIds);
+            if (sameGroup && groupDecided) {
+                // The provided constants and their sizes must match the ones the output was optimized with.
+                lastSpecConstantIndices.clear();
+                lastSpecConstantIndices.resize(specializationCount, UINT32_MAX);
+                for (uint32_t j = 0; j < variant.size(); j++) {
+                    uint32_t specId = variant[j].specId;
+                    if ((specId < specializationCount) && (shader.specializations[specId].constantInstructionIndex != UINT32_MAX)) {
+                        lastSpecConstantIndices[specId] = j;
+                    }
+                }
 
-            // Label's been eliminated. Skip it.
-            if (optimizedWords[labelWordIndex] == UINT32_MAX) {
-                resultStack.emplace_back(optimizedWords[wordIndex + i]);
-                continue;
-            }
+                bool sameConstants = true;
+                for (uint32_t j = 0; (j < specializationCount) && sameConstants; j++) {
+                    size_t valueCount = (lastSpecConstantIndices[j] != UINT32_MAX) ? variant[lastSpecConstantIndices[j]].values.size() : 0;
+                    sameConstants = (specializer.specConstants[j].values.size() == valueCount);
+                }
 
-            // While the label may not have been eliminated, verify its terminator is still pointing to this block.
-            bool foundBranchToThisBlock = false;
-            for (uint32_t j = labelInstructionIndex; j < instructionCount; j++) {
-                uint32_t searchWordIndex = c.shader.instructions[j].wordIndex;
-                SpvOp searchOpCode = SpvOp(optimizedWords[searchWordIndex] & 0xFFFFU);
-                uint32_t searchWordCount = (optimizedWords[searchWordIndex] >> 16U) & 0xFFFFU;
-                if (SpvOpIsTerminator(searchOpCode)) {
-                    uint32_t labelWordStart, labelWordCount, labelWordStride;
-                    if (SpvHasLabels(searchOpCode, labelWordStart, labelWordCount, labelWordStride)) {
-                        for (uint32_t j = 0; (j < labelWordCount) && ((labelWordStart + j * labelWordStride) < searchWordCount); j++) {
-                            uint32_t searchLabelId = optimizedWords[searchWordIndex + labelWordStart + j * labelWordStride];
-                            if (searchLabelId == instructionLabelId) {
-                                foundBranchToThisBlock = true;
-                                break;
-                            }
+                if (sameConstants) {
+                    optimizedData[i] = specializer.optimizedData;
+                    uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(optimizedData[i].data());
+                    for (uint32_t j = 0; j < specializationCount; j++) {
+                        if ((lastSpecConstantIndices[j] != UINT32_MAX) && (specializer.specConstantWordIndices[j] != UINT32_MAX)) {
+                            uint32_t wordIndex = shader.instructions[shader.specializations[j].constantInstructionIndex].wordIndex;
+                            optimizerPatchConstantWords(&shader.spirvWords[wordIndex], variant[lastSpecConstantIndices[j]], &optimizedWords[specializer.specConstantWordIndices[j]]);
                         }
                     }
 
-                    break;
+                    continue;
                 }
             }
 
-            // The preceding block did not have any reference to this block. Skip it.
-            if (!foundBranchToThisBlock) {
-                resultStack.emplace_back(optimizedWords[wordIndex + i]);
-                continue;
+            if (!specializer.run(variant.data(), uint32_t(variant.size()), optimizedData[i])) {
+                return false;
             }
 
-            // Copy the words.
-            optimizedWords[wordIndex + newWordCount + 0] = optimizedWords[wordIndex + i + 0];
-            optimizedWords[wordIndex + newWordCount + 1] = optimizedWords[wordIndex + i + 1];
-            newWordCount += 2;
+            if (!sameGroup) {
+                groupLabelIds = labelIds;
+                groupDecided = (std::find(labelIds, labelIds + terminatorCount, UINT32_MAX) == labelIds + terminatorCount);
+            }
         }
 
-        // Patch in the new word count.
-        assert((optimizedWords[wordIndex] != UINT32_MAX) && "The instruction shouldn't be getting deleted from reducing the degree of the operands.");
-        optimizedWords[wordIndex] = SpvOpPhi | (newWordCount << 16U);
+        return true;
+    }
 
-        // Delete any of the remaining words.
-        for (uint32_t i = newWordCount; i < wordCount; i++) {
-            optimizedWords[wordIndex + i] = UINT32_MAX;
+    // VariantKey
+
+    VariantKey::VariantKey() {
+        // Empty.
+    }
+
+    VariantKey::VariantKey(const SpecConstant *specConstants, uint32_t specConstantCount) {
+        thread_local std::vector<uint32_t> sortedIndices;
+        sortedIndices.resize(specConstantCount);
+        for (uint32_t i = 0; i < specConstantCount; i++) {
+            sortedIndices[i] = i;
         }
 
-        optimizerReduceResultDegrees(c, resultStack);
+        std::stable_sort(sortedIndices.begin(), sortedIndices.end(), [&](uint32_t a, uint32_t b) {
+            return specConstants[a].specId < specConstants[b].specId;
+        });
 
-        return true;
+        // The optimizer uses the last value given for an ID, so only that one is part of the key.
+        for (uint32_t j = 0; j < specConstantCount; j++) {
+            const SpecConstant &specConstant = specConstants[sortedIndices[j]];
+            if (((j + 1) < specConstantCount) && (specConstants[sortedIndices[j + 1]].specId == specConstant.specId)) {
+                continue;
+            }
+
+            words.emplace_back(specConstant.specId);
+            words.emplace_back(uint32_t(specConstant.values.size()));
+            words.insert(words.end(), specConstant.values.begin(), specConstant.values.end());
+        }
+
+        computeHash();
     }
 
-    static bool optimizerRunEvaluationPass(OptimizerContext &c) {
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        uint32_t orderCount = uint32_t(c.shader.instructionOrder.size());
-        for (uint32_t i = 0; i < orderCount; i++) {
-            uint32_t instructionIndex = c.shader.instructionOrder[i];
-            uint32_t wordIndex = c.shader.instructions[instructionIndex].wordIndex;
+    void VariantKey::computeHash() {
+        // FNV-1a.
+        hash = 14695981039346656037ULL;
+        for (uint32_t word : words) {
+            hash ^= word;
+            hash *= 1099511628211ULL;
+        }
+    }
 
-            // Instruction has been deleted.
-            if (optimizedWords[wordIndex] == UINT32_MAX) {
-                continue;
+    void VariantKey::toSpecConstants(std::vector<SpecConstant> &specConstants) const {
+        specConstants.clear();
+
+        size_t wordIndex = 0;
+        while ((wordIndex + 2) <= words.size()) {
+            uint32_t specId = words[wordIndex];
+            uint32_t valueCount = words[wordIndex + 1];
+            wordIndex += 2;
+            if ((wordIndex + valueCount) > words.size()) {
+                break;
             }
 
-            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
-            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-            uint32_t patchedWordCount = wordCount;
-            bool hasResult, hasType;
-            SpvHasResultAndType(opCode, &hasResult, &hasType);
+            specConstants.emplace_back(specId, std::vector<uint32_t>(words.begin() + wordIndex, words.begin() + wordIndex + valueCount));
+            wordIndex += valueCount;
+        }
+    }
 
-            if (hasResult) {
-                if (opCode == SpvOpPhi) {
-                    if (optimizerCompactPhi(instructionIndex, c)) {
-                        patchedWordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-                    }
-                    else {
-                        return false;
-                    }
-                }
+    bool VariantKey::operator==(const VariantKey &k) const {
+        return (hash == k.hash) && (words == k.words);
+    }
 
-                // Check if any of the operands isn't a constant.
-                bool allOperandsAreConstant = true;
-                uint32_t operandWordStart, operandWordCount, operandWordStride, operandWordSkip;
-                bool operandWordSkipString;
-                if (SpvHasOperands(opCode, operandWordStart, operandWordCount, operandWordStride, operandWordSkip, operandWordSkipString)) {
-                    uint32_t operandWordIndex = operandWordStart;
-                    for (uint32_t j = 0; j < operandWordCount; j++) {
-                        if (checkOperandWordSkip(wordIndex, optimizedWords, j, operandWordSkip, operandWordSkipString, operandWordIndex)) {
-                            continue;
-                        }
+    // OptimizerPool
 
-                        if (operandWordIndex >= patchedWordCount) {
-                            break;
-                        }
+    bool OptimizerPool::Job::operator<(const Job &j) const {
+        // The priority queue returns the largest element first, so jobs submitted later are considered smaller.
+        if (priority != j.priority) {
+            return priority < j.priority;
+        }
 
-                        uint32_t operandId = optimizedWords[wordIndex + operandWordIndex];
-                        assert((operandId != UINT32_MAX) && "An operand that's been deleted shouldn't be getting evaluated.");
+        return sequence > j.sequence;
+    }
 
-                        // It shouldn't be possible for an operand to not be solved, but OpPhi can do so because previous blocks might've been deleted.
-                        if ((opCode != SpvOpPhi) && (c.resolutions[operandId].type == Resolution::Type::Unknown)) {
-                            fprintf(stderr, "Error in resolution of the operations. Operand %u was not solved.\n", operandId);
-                            return false;
-                        }
+    OptimizerPool::OptimizerPool(uint32_t threadCount) {
+        if (threadCount == 0) {
+            threadCount = std::max(std::thread::hardware_concurrency(), 2U) - 1;
+        }
 
-                        if (c.resolutions[operandId].type == Resolution::Type::Variable) {
-                            allOperandsAreConstant = false;
-                            break;
-                        }
+        threads.reserve(threadCount);
+        for (uint32_t i = 0; i < threadCount; i++) {
+            threads.emplace_back(&OptimizerPool::workerLoop, this);
+        }
+    }
 
-                        operandWordIndex += operandWordStride;
-                    }
-                }
+    OptimizerPool::~OptimizerPool() {
+        {
+            std::unique_lock<std::mutex> lock(jobsMutex);
+            stopping = true;
+        }
 
-                // The result can only be evaluated if all operands are constant.
-                uint32_t resultId = optimizedWords[wordIndex + (hasType ? 2 : 1)];
-                if (allOperandsAreConstant) {
-                    optimizerEvaluateResult(resultId, c);
-                }
-                else {
-                    c.resolutions[resultId].type = Resolution::Type::Variable;
-                }
-            }
-            else if ((opCode == SpvOpBranchConditional) || (opCode == SpvOpSwitch)) {
-                optimizerEvaluateTerminator(instructionIndex, c);
-            }
+        jobsCondition.notify_all();
+        for (std::thread &thread : threads) {
+            thread.join();
         }
 
-        return true;
+        // Any jobs that weren't picked up are destroyed, which makes their futures report a broken promise.
     }
 
-    static bool optimizerRemoveUnusedDecorations(OptimizerContext &c) {
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        for (Decoration decoration : c.shader.decorations) {
-            uint32_t wordIndex = c.shader.instructions[decoration.instructionIndex].wordIndex;
-            uint32_t resultId = optimizedWords[wordIndex + 1];
-            if (resultId == UINT32_MAX) {
-                // This decoration has already been deleted.
-                continue;
-            }
+    std::future<OptimizerOutput> OptimizerPool::submit(const Shader &shader, std::vector<SpecConstant> specConstants, int32_t priority, const OptimizerOptions &options) {
+        const Shader *shaderPointer = &shader;
+        Job job;
+        job.priority = priority;
+        job.task = std::make_shared<std::packaged_task<OptimizerOutput()>>([shaderPointer, specConstants = std::move(specConstants), options]() {
+            OptimizerOutput output;
+            output.success = Optimizer::run(*shaderPointer, specConstants.data(), uint32_t(specConstants.size()), output.optimizedData, options, &output.status);
+            return output;
+        });
+
+        std::future<OptimizerOutput> future = job.task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(jobsMutex);
+            job.sequence = nextSequence++;
+            jobs.emplace(std::move(job));
+        }
 
-            uint32_t resultInstructionIndex = c.shader.results[resultId].instructionIndex;
-            uint32_t resultWordIndex = c.shader.instructions[resultInstructionIndex].wordIndex;
+        jobsCondition.notify_one();
+        return future;
+    }
 
-            // The result has been deleted, so we delete the decoration as well.
-            if (optimizedWords[resultWordIndex] == UINT32_MAX) {
-                optimizerEliminateInstruction(decoration.instructionIndex, c);
-            }
+    bool OptimizerPool::submitWithPatch(const Shader &shader, std::vector<SpecConstant> specConstants, std::vector<uint8_t> &patchedData, std::future<OptimizerOutput> &future, int32_t priority, const OptimizerOptions &options) {
+        if (!Optimizer::patch(shader, specConstants.data(), uint32_t(specConstants.size()), patchedData)) {
+            return false;
         }
 
+        future = submit(shader, std::move(specConstants), priority, options);
         return true;
     }
 
-    static bool optimizerCompactPhis(OptimizerContext &c) {
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        for (Phi phi : c.shader.phis) {
-            uint32_t wordIndex = c.shader.instructions[phi.instructionIndex].wordIndex;
-            if (optimizedWords[wordIndex] == UINT32_MAX) {
-                // This operation has already been deleted.
-                continue;
+    void OptimizerPool::submitBatch(const Shader &shader, const std::vector<std::vector<SpecConstant>> &variants, std::vector<std::future<OptimizerOutput>> &futures, int32_t priority) {
+        futures.reserve(futures.size() + variants.size());
+        for (const std::vector<SpecConstant> &specConstants : variants) {
+            futures.emplace_back(submit(shader, specConstants, priority));
+        }
+    }
+
+    void OptimizerPool::workerLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobsMutex);
+                jobsCondition.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (stopping) {
+                    return;
+                }
+
+                job = jobs.top();
+                jobs.pop();
             }
 
-            if (!optimizerCompactPhi(phi.instructionIndex, c)) {
-                return false;
+            (*job.task)();
+        }
+    }
+
+    // VariantRecorder
+
+    static const uint32_t VariantLogMagic = 0x4C565352U;
+    static const uint32_t VariantLogVersion = 1;
+
+    VariantRecorder::VariantRecorder() {
+        startTime = std::chrono::steady_clock::now();
+    }
+
+    void VariantRecorder::clear() {
+        std::unique_lock<std::mutex> lock(recordsMutex);
+        records.clear();
+        recordIndices.clear();
+        startTime = std::chrono::steady_clock::now();
+    }
+
+    void VariantRecorder::record(const SpecConstant *specConstants, uint32_t specConstantCount) {
+        VariantKey key(specConstants, specConstantCount);
+        auto elapsedTime = std::chrono::steady_clock::now() - startTime;
+        uint32_t elapsedMilliseconds = uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(elapsedTime).count());
+
+        std::unique_lock<std::mutex> lock(recordsMutex);
+        auto it = recordIndices.find(key);
+        if (it != recordIndices.end()) {
+            records[it->second].requestCount++;
+        }
+        else {
+            recordIndices[key] = uint32_t(records.size());
+            records.emplace_back();
+            records.back().key = std::move(key);
+            records.back().firstRequestMilliseconds = elapsedMilliseconds;
+            records.back().requestCount = 1;
+        }
+    }
+
+    void VariantRecorder::serialize(std::vector<uint8_t> &data) {
+        // The log is a sequence of words: the magic number, the version and the record count, followed by the first
+        // request time, the request count, the key's word count and the key's words of every record.
+        std::vector<uint32_t> words;
+        {
+            std::unique_lock<std::mutex> lock(recordsMutex);
+            words.emplace_back(VariantLogMagic);
+            words.emplace_back(VariantLogVersion);
+            words.emplace_back(uint32_t(records.size()));
+            for (const Record &record : records) {
+                words.emplace_back(record.firstRequestMilliseconds);
+                words.emplace_back(record.requestCount);
+                words.emplace_back(uint32_t(record.key.words.size()));
+                words.insert(words.end(), record.key.words.begin(), record.key.words.end());
             }
         }
 
-        return true;
+        data.resize(words.size() * sizeof(uint32_t));
+        memcpy(data.data(), words.data(), data.size());
     }
 
-    static bool optimizerCompactData(OptimizerContext &c) {
-        uint32_t *optimizedWords = reinterpret_cast<uint32_t *>(c.optimizedData.data());
-        uint32_t optimizedWordCount = 0;
-        uint32_t instructionCount = c.shader.instructions.size();
+    bool VariantRecorder::deserialize(const void *data, size_t size) {
+        const uint32_t *words = reinterpret_cast<const uint32_t *>(data);
+        size_t wordCount = size / sizeof(uint32_t);
+        if ((wordCount < 3) || (words[0] != VariantLogMagic)) {
+            fprintf(stderr, "Invalid variant log.\n");
+            return false;
+        }
 
-        // Copy the header.
-        const uint32_t startingWordIndex = 5;
-        for (uint32_t i = 0; i < startingWordIndex; i++) {
-            optimizedWords[optimizedWordCount++] = optimizedWords[i];
+        if (words[1] != VariantLogVersion) {
+            fprintf(stderr, "Variant log version %u is not supported.\n", words[1]);
+            return false;
         }
 
-        // Write out all the words for all the instructions and skip any that were marked as deleted.
-        for (uint32_t i = 0; i < instructionCount; i++) {
-            uint32_t wordIndex = c.shader.instructions[i].wordIndex;
+        std::unique_lock<std::mutex> lock(recordsMutex);
+        records.clear();
+        recordIndices.clear();
 
-            // Instruction has been deleted.
-            if (optimizedWords[wordIndex] == UINT32_MAX) {
-                continue;
+        uint32_t recordCount = words[2];
+        size_t wordIndex = 3;
+        for (uint32_t i = 0; i < recordCount; i++) {
+            if ((wordIndex + 3) > wordCount) {
+                fprintf(stderr, "Variant log is truncated.\n");
+                return false;
             }
 
-            // Check if the instruction should be ignored.
-            SpvOp opCode = SpvOp(optimizedWords[wordIndex] & 0xFFFFU);
-            if (SpvIsIgnored(opCode)) {
-                continue;
+            Record record;
+            record.firstRequestMilliseconds = words[wordIndex + 0];
+            record.requestCount = words[wordIndex + 1];
+            uint32_t keyWordCount = words[wordIndex + 2];
+            wordIndex += 3;
+            if ((wordIndex + keyWordCount) > wordCount) {
+                fprintf(stderr, "Variant log is truncated.\n");
+                return false;
             }
 
-            // Copy all the words of the instruction.
-            uint32_t wordCount = (optimizedWords[wordIndex] >> 16U) & 0xFFFFU;
-            for (uint32_t j = 0; j < wordCount; j++) {
-                optimizedWords[optimizedWordCount++] = optimizedWords[wordIndex + j];
+            record.key.words.assign(&words[wordIndex], &words[wordIndex] + keyWordCount);
+            record.key.computeHash();
+            wordIndex += keyWordCount;
+
+            if (recordIndices.find(record.key) == recordIndices.end()) {
+                recordIndices[record.key] = uint32_t(records.size());
+                records.emplace_back(std::move(record));
             }
         }
 
-        c.optimizedData.resize(optimizedWordCount * sizeof(uint32_t));
-
         return true;
     }
 
-    bool Optimizer::run(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData) {
-        thread_local std::vector<uint32_t> instructionInDegrees;
-        thread_local std::vector<uint32_t> instructionOutDegrees;
-        thread_local std::vector<Resolution> resolutions;
-        OptimizerContext c = { shader, instructionInDegrees, instructionOutDegrees, resolutions, optimizedData };
-        if (!optimizerPrepareData(c)) {
+    bool VariantRecorder::save(const char *path) {
+        std::vector<uint8_t> data;
+        serialize(data);
+
+        std::ofstream stream(std::filesystem::u8path(path), std::ios::binary);
+        if (!stream.is_open()) {
+            fprintf(stderr, "Failed to open %s for writing.\n", path);
             return false;
         }
 
-        if (!optimizerPatchSpecializationConstants(newSpecConstants, newSpecConstantCount, c)) {
+        stream.write(reinterpret_cast<const char *>(data.data()), data.size());
+        if (stream.bad()) {
+            fprintf(stderr, "Failed to write to %s.\n", path);
             return false;
         }
 
-        if (!optimizerRunEvaluationPass(c)) {
+        return true;
+    }
+
+    bool VariantRecorder::load(const char *path) {
+        std::ifstream stream(std::filesystem::u8path(path), std::ios::binary);
+        if (!stream.is_open()) {
             return false;
         }
 
-        if (!optimizerRemoveUnusedDecorations(c)) {
+        std::vector<char> data;
+        stream.seekg(0, std::ios::end);
+        size_t size = stream.tellg();
+        stream.seekg(0, std::ios::beg);
+        data.resize(size);
+        stream.read(data.data(), size);
+        if (stream.bad()) {
+            fprintf(stderr, "Failed to read %s.\n", path);
             return false;
         }
 
-        // FIXME: For some reason, it seems that based on the order of the resolution, OpPhis can be compacted
-        // before all their preceding blocks have been evaluated in time whether they should be deleted or not.
-        // This pass merely re-runs the compaction step as a safeguard to remove any stale references. There's
-        // potential for further optimization if this is fixed properly.
-        if (!optimizerCompactPhis(c)) {
+        return deserialize(data.data(), data.size());
+    }
+
+    // VariantPrefetcher
+
+    VariantPrefetcher::VariantPrefetcher(const Shader &shader, OptimizerPool &pool) : shader(shader), pool(pool) {
+        // Empty.
+    }
+
+    VariantPrefetcher::~VariantPrefetcher() {
+        wait();
+    }
+
+    void VariantPrefetcher::prefetch(VariantRecorder &recorder, uint32_t maxVariantCount) {
+        std::unique_lock<std::mutex> recordsLock(recorder.recordsMutex);
+        std::vector<const VariantRecorder::Record *> sortedRecords;
+        sortedRecords.reserve(recorder.records.size());
+        for (const VariantRecorder::Record &record : recorder.records) {
+            sortedRecords.emplace_back(&record);
+        }
+
+        std::stable_sort(sortedRecords.begin(), sortedRecords.end(), [](const VariantRecorder::Record *a, const VariantRecorder::Record *b) {
+            if (a->firstRequestMilliseconds != b->firstRequestMilliseconds) {
+                return a->firstRequestMilliseconds < b->firstRequestMilliseconds;
+            }
+
+            return a->requestCount > b->requestCount;
+        });
+
+        std::vector<SpecConstant> specConstants;
+        std::unique_lock<std::mutex> lock(variantsMutex);
+        uint32_t submittedCount = 0;
+        for (const VariantRecorder::Record *record : sortedRecords) {
+            if (submittedCount >= maxVariantCount) {
+                break;
+            }
+
+            if (variants.find(record->key) != variants.end()) {
+                continue;
+            }
+
+            record->key.toSpecConstants(specConstants);
+            variants[record->key] = pool.submit(shader, specConstants).share();
+            submittedCount++;
+        }
+    }
+
+    bool VariantPrefetcher::get(const SpecConstant *specConstants, uint32_t specConstantCount, std::vector<uint8_t> &optimizedData) {
+        VariantKey key(specConstants, specConstantCount);
+        std::shared_future<OptimizerOutput> future;
+        {
+            std::unique_lock<std::mutex> lock(variantsMutex);
+            auto it = variants.find(key);
+            if (it == variants.end()) {
+                return false;
+            }
+
+            future = it->second;
+        }
+
+        // The job is dropped without running if the pool is destroyed first, which makes the future report a broken promise.
+        try {
+            const OptimizerOutput &output = future.get();
+            if (!output.success) {
+                return false;
+            }
+
+            optimizedData = output.optimizedData;
+            return true;
+        }
+        catch (const std::future_error &) {
             return false;
         }
+    }
 
-        if (!optimizerCompactData(c)) {
+    bool VariantPrefetcher::ready(const SpecConstant *specConstants, uint32_t specConstantCount) {
+        VariantKey key(specConstants, specConstantCount);
+        std::unique_lock<std::mutex> lock(variantsMutex);
+        auto it = variants.find(key);
+        if (it == variants.end()) {
             return false;
         }
 
-        return true;
+        return it->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void VariantPrefetcher::wait() {
+        // The futures are copied out so the other functions aren't blocked while the variants are being optimized.
+        std::vector<std::shared_future<OptimizerOutput>> futures;
+        {
+            std::unique_lock<std::mutex> lock(variantsMutex);
+            futures.reserve(variants.size());
+            for (auto &it : variants) {
+                if (it.second.valid()) {
+                    futures.emplace_back(it.second);
+                }
+            }
+        }
+
+        for (const std::shared_future<OptimizerOutput> &future : futures) {
+            future.wait();
+        }
     }
-};
\ No newline at end of file
+};
@@ -4,7 +4,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace respv {
@@ -81,6 +91,78 @@ namespace respv {
         }
     };
 
+    struct Variable {
+        uint32_t instructionIndex = UINT32_MAX;
+
+        // The variable is only read and its initializer is a constant, so loads from it can be solved like constants.
+        bool constantTable = false;
+
+        // Decorations of variables that are bound to resources.
+        uint32_t descriptorSet = UINT32_MAX;
+        uint32_t binding = UINT32_MAX;
+
+        Variable() {
+            // Empty.
+        }
+
+        Variable(uint32_t instructionIndex) {
+            this->instructionIndex = instructionIndex;
+        }
+    };
+
+    // Value that a load from a local variable resolves to. Loads at the start of a merge block have one value for each
+    // predecessor, along with the label of the predecessor it comes from.
+    struct LocalValue {
+        uint32_t resultId = UINT32_MAX;
+        uint32_t labelId = UINT32_MAX;
+
+        LocalValue() {
+            // Empty.
+        }
+
+        LocalValue(uint32_t resultId, uint32_t labelId) {
+            this->resultId = resultId;
+            this->labelId = labelId;
+        }
+    };
+
+    // Load from a function variable whose address never escapes, which can be resolved to the values stored to it. When the
+    // values come from the predecessors of a merge block, the label of the merge block is stored as well.
+    struct LocalLoad {
+        uint32_t instructionIndex = UINT32_MAX;
+        uint32_t valueIndex = 0;
+        uint32_t valueCount = 0;
+        uint32_t mergeLabelId = UINT32_MAX;
+
+        LocalLoad() {
+            // Empty.
+        }
+
+        LocalLoad(uint32_t instructionIndex, uint32_t valueIndex, uint32_t valueCount, uint32_t mergeLabelId) {
+            this->instructionIndex = instructionIndex;
+            this->valueIndex = valueIndex;
+            this->valueCount = valueCount;
+            this->mergeLabelId = mergeLabelId;
+        }
+    };
+
+    // Contiguous span of instructions that forms one arm of a selection construct. The span starts at the label of the arm
+    // and can only be entered through the branch of the selection header, so the whole span is unreachable once that
+    // branch no longer goes to it.
+    struct Region {
+        uint32_t labelInstructionIndex = UINT32_MAX;
+        uint32_t endInstructionIndex = UINT32_MAX;
+
+        Region() {
+            // Empty.
+        }
+
+        Region(uint32_t labelInstructionIndex, uint32_t endInstructionIndex) {
+            this->labelInstructionIndex = labelInstructionIndex;
+            this->endInstructionIndex = endInstructionIndex;
+        }
+    };
+
     struct ListNode {
         uint32_t instructionIndex = UINT32_MAX;
         uint32_t nextListIndex = UINT32_MAX;
@@ -97,26 +179,447 @@ namespace respv {
         std::vector<Instruction> instructions;
         std::vector<uint32_t> instructionInDegrees;
         std::vector<uint32_t> instructionOutDegrees;
+        std::vector<uint32_t> instructionDecorationDegrees;
         std::vector<uint32_t> instructionOrder;
+        std::vector<uint32_t> instructionLevels;
         std::vector<Result> results;
         std::vector<Specialization> specializations;
         std::vector<Decoration> decorations;
         std::vector<Phi> phis;
+        std::vector<Variable> variables;
+        std::vector<Region> regions;
+        std::vector<LocalLoad> localLoads;
+        std::vector<LocalValue> localValues;
         std::vector<ListNode> listNodes;
         uint32_t defaultSwitchOpConstantInt = UINT32_MAX;
 
+        // Hash of the module that ignores debug information and how the IDs are numbered. Modules that only differ in names,
+        // line information or sources have the same fingerprint, which makes it the recommended key for caching the
+        // analysis and the optimized variants of a shader.
+        uint64_t fingerprint = 0;
+
+        // Streaming parse state. The shader owns a copy of the words when it's parsed from chunks.
+        std::vector<uint32_t> streamWords;
+        std::vector<uint32_t> streamDeferredInstructions;
+        uint32_t streamWordIndex = 0;
+        uint8_t streamPendingBytes[4] = {};
+        uint32_t streamPendingByteCount = 0;
+        bool streaming = false;
+
         Shader();
         Shader(const void *data, size_t size);
         void clear();
         uint32_t addToList(uint32_t instructionIndex, uint32_t listIndex);
+        bool parseHeader();
+        bool parseInstruction(uint32_t wordIndex);
         bool parseWords(const void *data, size_t size);
+        void computeFingerprint();
         bool parse(const void *data, size_t size);
+
+        // Incremental alternative to parse() for modules that arrive in pieces, like the output of a decompressor
+        // or an asset stream. Chunks can be of any size and don't need to be aligned to the word size. Instructions
+        // are analyzed as soon as they're received, so most of the analysis overlaps with the loading.
+        bool beginParse(size_t sizeHint = 0);
+        bool parseChunk(const void *data, size_t size);
+        bool endParse();
+
+        // Updates the analysis after the module was modified, like when a shader is hot-reloaded. The instructions that
+        // differ are expanded to whole functions and only those functions are parsed and sorted again. The degrees,
+        // variables and regions are only recomputed where the edges changed, and the sorted order is extended instead of
+        // being rebuilt. Changes outside of the functions section or to the ID bound fall back to a full parse. The words
+        // the shader was last parsed from must still be valid. The instruction indices after the range still shift, so the
+        // adjacency lists and the rest of the analysis are remapped, and the fingerprint is hashed over the whole module.
+        // Those passes are cheap compared to a parse, but they keep an update linear in the size of the module.
+        bool update(const void *data, size_t size);
+
+        bool checkReferences(uint32_t instructionIndex) const;
+        bool processInstruction(uint32_t instructionIndex, uint32_t providerBegin = 0, uint32_t providerEnd = UINT32_MAX);
+        bool processFinish();
+        bool checkConstantTable(uint32_t instructionIndex) const;
+        void analyzeVariables(uint32_t rangeBegin = 0, uint32_t rangeEnd = UINT32_MAX);
+        uint32_t findVariable(uint32_t instructionIndex) const;
+        void analyzeLocalLoads(uint32_t rangeBegin, uint32_t rangeEnd);
+        uint32_t findLocalLoad(uint32_t instructionIndex) const;
         bool process();
+        uint32_t instructionResultId(uint32_t instructionIndex) const;
+        void countEdge(uint32_t providerIndex, uint32_t providerResultId, uint32_t userIndex, int32_t count);
+        void countDegrees();
+        void analyzeRegions(uint32_t rangeBegin = 0, uint32_t rangeEnd = UINT32_MAX);
+        uint32_t findRegion(uint32_t labelInstructionIndex) const;
+
+        // Loops are the only cycles in the graph. Their back edges are kept in the adjacency and the degrees, but they're
+        // left out of the sorted order.
+        bool isBackEdge(uint32_t providerIndex, uint32_t userIndex) const;
         bool sort();
         bool empty() const;
     };
 
+    struct Resolution {
+        enum Type {
+            Unknown,
+            Constant,
+            Variable
+        };
+
+        Type type = Type::Unknown;
+
+        struct {
+            union {
+                int32_t i32;
+                uint32_t u32;
+            };
+        } value = {};
+
+        static Resolution fromBool(bool value) {
+            Resolution r;
+            r.type = Type::Constant;
+            r.value.u32 = value ? 1 : 0;
+            return r;
+        }
+
+        static Resolution fromInt32(int32_t value) {
+            Resolution r;
+            r.type = Type::Constant;
+            r.value.i32 = value;
+            return r;
+        }
+
+        static Resolution fromUint32(uint32_t value) {
+            Resolution r;
+            r.type = Type::Constant;
+            r.value.u32 = value;
+            return r;
+        }
+    };
+
+    enum class OptimizerStatus {
+        // The optimization ran to completion.
+        Complete,
+
+        // The budget ran out and the output only has the spec constants patched in without any other optimizations.
+        PatchOnly,
+
+        // The budget ran out and no output was produced.
+        Incomplete,
+
+        // The optimization failed due to an error.
+        Failed
+    };
+
+    // Value of a 32-bit integer in a uniform buffer or push constant block that is known ahead of time, like a toggle
+    // that is fixed for every draw that uses the pipeline. Loads from that location are treated as constants.
+    struct KnownValue {
+        enum class Source {
+            UniformBuffer,
+            PushConstant
+        };
+
+        Source source = Source::UniformBuffer;
+
+        // Only used by uniform buffers. There can only be one push constant block.
+        uint32_t descriptorSet = 0;
+        uint32_t binding = 0;
+
+        // Offset in bytes from the start of the block as laid out by the Offset and ArrayStride decorations.
+        uint32_t offset = 0;
+        uint32_t value = 0;
+
+        KnownValue() {
+            // Empty constructor.
+        }
+
+        KnownValue(Source source, uint32_t descriptorSet, uint32_t binding, uint32_t offset, uint32_t value) {
+            this->source = source;
+            this->descriptorSet = descriptorSet;
+            this->binding = binding;
+            this->offset = offset;
+            this->value = value;
+        }
+    };
+
+    enum class OptimizerPass {
+        // Evaluates the results with constant operands, resolves the branches that depend on them and eliminates the code
+        // that becomes unreachable or unused.
+        Evaluation,
+
+        // Removes the stores to outputs and the loads from inputs that the pipeline doesn't use. Only has an effect when
+        // the active locations are specified.
+        PruneInterface,
+
+        // Removes the stores to Function and Private variables that are never read, along with the variables themselves
+        // and any computation that only fed those stores.
+        DeadStores,
+
+        // Turns selections whose arms only compute values into straight-line code that picks the values with OpSelect. Only
+        // has an effect when the maximum amount of instructions to convert is specified.
+        IfConversion,
+
+        // Replaces instructions with an identical one that was computed before in the same block or in a block that
+        // dominates it.
+        ValueNumbering,
+
+        // Moves instructions that only compute values into the arm of a selection when it's the only place their results are
+        // used, so they're only computed when that arm is taken.
+        Sinking,
+
+        // Replaces types and constants with the first one that's identical to them, including the constants that spec constants
+        // were patched into.
+        Deduplication,
+
+        Count
+    };
+
+    struct OptimizerPipeline {
+        struct Stage {
+            OptimizerPass pass = OptimizerPass::Evaluation;
+            bool enabled = true;
+
+            Stage() {
+                // Empty constructor.
+            }
+
+            Stage(OptimizerPass pass, bool enabled = true) {
+                this->pass = pass;
+                this->enabled = enabled;
+            }
+        };
+
+        // Passes run in this order on every iteration. The default pipeline runs the evaluation, the interface pruning and the
+        // dead store elimination once. Deduplication, value numbering and sinking change the output more and cost more time
+        // for each variant, so their stages must be enabled to run.
+        std::vector<Stage> stages = { Stage(OptimizerPass::Evaluation), Stage(OptimizerPass::PruneInterface), Stage(OptimizerPass::DeadStores), Stage(OptimizerPass::IfConversion), Stage(OptimizerPass::Deduplication, false), Stage(OptimizerPass::ValueNumbering, false), Stage(OptimizerPass::Sinking, false) };
+
+        // The stages are repeated while they keep changing the module, up to this many iterations. A stage is skipped when
+        // nothing changed since the last time it ran.
+        uint32_t maxIterations = 1;
+    };
+
+    struct OptimizerPipelineStatistics {
+        struct Stage {
+            uint32_t runCount = 0;
+            uint64_t changeCount = 0;
+            std::chrono::nanoseconds time = std::chrono::nanoseconds(0);
+        };
+
+        // One entry for each stage of the pipeline, in the same order.
+        std::vector<Stage> stages;
+        uint32_t iterationCount = 0;
+    };
+
+    struct OptimizerOptions {
+        // The optimization stops as soon as possible after this flag is set from another thread.
+        const std::atomic<bool> *cancelFlag = nullptr;
+
+        // The optimization stops as soon as possible after this point in time is reached.
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+        // Maximum amount of instructions the evaluation is allowed to visit.
+        uint64_t maxEvaluatedInstructions = UINT64_MAX;
+
+        // Produce an output with only the spec constants patched in when the budget runs out instead of no output.
+        bool patchOnlyFallback = true;
+
+        // Values of uniform buffers and push constants that are specialized on along with the spec constants.
+        std::vector<KnownValue> knownValues;
+
+        // Locations of the interface that the pipeline actually uses, like the color attachments of a fragment shader or the
+        // vertex attributes of a vertex shader. Stores to outputs at any other location are removed and loads from inputs at
+        // any other location are replaced with zero. Only scalar and vector variables with a Location below 64 are pruned.
+        uint64_t activeInputLocations = UINT64_MAX;
+        uint64_t activeOutputLocations = UINT64_MAX;
+
+        // Entry point to keep when the module has several of them. The other entry points, their execution modes and any
+        // functions and globals only used by them are removed. All entry points are kept when the name is empty, and any
+        // execution model matches the name when it's left as UINT32_MAX.
+        std::string entryPointName;
+        uint32_t entryPointExecutionModel = UINT32_MAX;
+
+        // Selections whose arms only compute values with at most this many instructions between them are converted into
+        // straight-line code with OpSelect. Nothing is converted when it's zero.
+        uint32_t ifConversionMaxInstructions = 0;
+
+        // Passes that are run and their order. Removing unused decorations and compacting phis always runs after them, as
+        // the output wouldn't be valid otherwise.
+        OptimizerPipeline pipeline;
+
+        // Filled with the statistics of each stage of the pipeline when specified. It must not be shared between runs that
+        // happen at the same time.
+        OptimizerPipelineStatistics *statistics = nullptr;
+    };
+
     struct Optimizer {
         static bool run(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData);
+
+        // Returns true when the output is a valid module, which can be the case even if the budget ran out and the status
+        // reports that only the spec constants were patched in.
+        static bool run(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData, const OptimizerOptions &options, OptimizerStatus *status = nullptr);
+
+        // Only replaces the spec constants with regular constants and removes their SpecId decorations. The rest of the
+        // module is copied as is, so the cost beyond the copy only depends on the amount of spec constants provided.
+        static bool patch(const Shader &shader, const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData);
+
+        // Optimizes many variants at once. The branch decisions of all variants are evaluated in bulk first and the variants
+        // are grouped by them. Only the first variant of each group is optimized. If all its decisions are known, the constants
+        // of the other variants in the group are patched into a copy of its output, and otherwise they're updated from it
+        // incrementally.
+        static bool runBatch(const Shader &shader, const std::vector<std::vector<SpecConstant>> &variants, std::vector<std::vector<uint8_t>> &optimizedData);
+    };
+
+    struct SpecializerOutput {
+        std::vector<SpecConstant> specConstants;
+        std::vector<Resolution> resolutions;
+        std::vector<uint32_t> specConstantWordIndices;
+        std::vector<uint8_t> optimizedData;
+    };
+
+    // Keeps the state of the previous specialization of a shader so it can be updated quickly when only a few spec
+    // constants change, like when toggling a material flag in an editor. Only the instructions that depend on the changed
+    // constants are evaluated again. If none of the branch decisions change, the constants are patched directly into
+    // the previous output. When they do change, the outputs of earlier runs are checked the same way, so going back to
+    // decisions that were already seen only patches the constants of that output. Otherwise, or when the set of provided
+    // constants changes, the shader is optimized again.
+    struct Specializer {
+        const Shader *shader = nullptr;
+        std::vector<SpecConstant> specConstants;
+        std::vector<Resolution> resolutions;
+        std::vector<uint32_t> specConstantWordIndices;
+        std::vector<uint8_t> sourceData;
+        std::vector<uint8_t> optimizedData;
+        bool valid = false;
+
+        // Outputs of earlier runs with other branch decisions, from the least to the most recently used.
+        std::vector<SpecializerOutput> cachedOutputs;
+        uint32_t maxCachedOutputs = 4;
+
+        Specializer();
+        Specializer(const Shader &shader);
+        void reset(const Shader &shader);
+        bool run(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount, std::vector<uint8_t> &optimizedData);
+        bool runFull(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount);
+
+        // Returns false when the changes can't be applied to the previous output and a full run is required instead.
+        bool runIncremental(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount);
+
+        // Returns false when none of the cached outputs can be updated to the new constants either.
+        bool runCached(const SpecConstant *newSpecConstants, uint32_t newSpecConstantCount);
+        void swapCachedOutput(uint32_t cachedOutputIndex);
+    };
+
+    struct BatchDecisions {
+        // Branches and switches that depend on the spec constants, in module order.
+        std::vector<uint32_t> terminatorIndices;
+
+        // Label each variant jumps to from each terminator, stored as terminatorIndices.size() entries per variant. UINT32_MAX
+        // means the decision can't be made until runtime.
+        std::vector<uint32_t> labelIds;
+        uint32_t variantCount = 0;
+    };
+
+    // Evaluates the integer and logical instructions that depend on the spec constants for many variants at once. Each ID
+    // stores its values as an array with one lane per variant and the operations are done on all lanes in a loop without
+    // branches, which the compiler can vectorize for the target's SIMD instruction set.
+    struct BatchEvaluator {
+        static constexpr uint32_t LaneCount = 16;
+
+        static bool run(const Shader &shader, const std::vector<std::vector<SpecConstant>> &variants, BatchDecisions &decisions);
+    };
+
+    // Canonical identifier for a set of spec constants. The values are sorted by their ID so the order the
+    // constants were provided in doesn't matter. Only the last value given for an ID is kept, like the optimizer does.
+    struct VariantKey {
+        std::vector<uint32_t> words;
+        uint64_t hash = 0;
+
+        VariantKey();
+        VariantKey(const SpecConstant *specConstants, uint32_t specConstantCount);
+        void computeHash();
+        void toSpecConstants(std::vector<SpecConstant> &specConstants) const;
+        bool operator==(const VariantKey &k) const;
+    };
+
+    struct VariantKeyHasher {
+        size_t operator()(const VariantKey &k) const {
+            return size_t(k.hash);
+        }
+    };
+
+    struct OptimizerOutput {
+        bool success = false;
+        OptimizerStatus status = OptimizerStatus::Failed;
+        std::vector<uint8_t> optimizedData;
+    };
+
+    // Pool of worker threads that run the optimizer in the background. Jobs with a higher priority are picked
+    // first, and jobs with the same priority are picked in the order they were submitted. Shaders must remain
+    // valid until all the jobs that use them are finished.
+    struct OptimizerPool {
+        struct Job {
+            int32_t priority = 0;
+            uint64_t sequence = 0;
+            std::shared_ptr<std::packaged_task<OptimizerOutput()>> task;
+
+            bool operator<(const Job &j) const;
+        };
+
+        std::vector<std::thread> threads;
+        std::priority_queue<Job> jobs;
+        std::mutex jobsMutex;
+        std::condition_variable jobsCondition;
+        uint64_t nextSequence = 0;
+        bool stopping = false;
+
+        OptimizerPool(uint32_t threadCount = 0);
+        ~OptimizerPool();
+        std::future<OptimizerOutput> submit(const Shader &shader, std::vector<SpecConstant> specConstants, int32_t priority = 0, const OptimizerOptions &options = OptimizerOptions());
+
+        // Patches the spec constants into the module right away and submits the full optimization of the same variant.
+        // The patched module can be used until the future is ready and the pipeline is upgraded to the optimized one.
+        bool submitWithPatch(const Shader &shader, std::vector<SpecConstant> specConstants, std::vector<uint8_t> &patchedData, std::future<OptimizerOutput> &future, int32_t priority = 0, const OptimizerOptions &options = OptimizerOptions());
+        void submitBatch(const Shader &shader, const std::vector<std::vector<SpecConstant>> &variants, std::vector<std::future<OptimizerOutput>> &futures, int32_t priority = 0);
+        void workerLoop();
+    };
+
+    // Logs the variants that are requested by the application along with when they were first requested, so
+    // they can be prefetched on the next launch. Each unique variant is only stored once.
+    struct VariantRecorder {
+        struct Record {
+            VariantKey key;
+            uint32_t firstRequestMilliseconds = 0;
+            uint32_t requestCount = 0;
+        };
+
+        std::vector<Record> records;
+        std::unordered_map<VariantKey, uint32_t, VariantKeyHasher> recordIndices;
+        std::chrono::steady_clock::time_point startTime;
+        std::mutex recordsMutex;
+
+        VariantRecorder();
+        void clear();
+        void record(const SpecConstant *specConstants, uint32_t specConstantCount);
+        void serialize(std::vector<uint8_t> &data);
+        bool deserialize(const void *data, size_t size);
+        bool save(const char *path);
+        bool load(const char *path);
+    };
+
+    // Replays the variants of a recorded log on an optimizer pool so they're ready before they're requested.
+    // Variants are submitted in the order they were first requested in, with the most frequent ones first
+    // when they were requested at the same time.
+    struct VariantPrefetcher {
+        const Shader &shader;
+        OptimizerPool &pool;
+        std::unordered_map<VariantKey, std::shared_future<OptimizerOutput>, VariantKeyHasher> variants;
+        std::mutex variantsMutex;
+
+        VariantPrefetcher(const Shader &shader, OptimizerPool &pool);
+        ~VariantPrefetcher();
+        void prefetch(VariantRecorder &recorder, uint32_t maxVariantCount = UINT32_MAX);
+
+        // Retrieves a prefetched variant. Waits for it if it's still being optimized. Returns false if the variant
+        // wasn't prefetched, it failed to be optimized or the pool was destroyed before it ran, in which case it
+        // should be optimized on demand instead.
+        bool get(const SpecConstant *specConstants, uint32_t specConstantCount, std::vector<uint8_t> &optimizedData);
+        bool ready(const SpecConstant *specConstants, uint32_t specConstantCount);
+        void wait();
     };
 };
\ No newline at end of file